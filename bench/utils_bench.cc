@@ -0,0 +1,219 @@
+#include <benchmark/benchmark.h>
+#include "../src/utils.hpp"
+#include "../src/routes.hpp"
+#include "../src/request_context.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <nlohmann/json.hpp>
+
+/*
+ * Every heap allocation in the process goes through here so a benchmark
+ * can report how many allocations one iteration of its body costs.
+ */
+static std::atomic<std::uint64_t> allocations{0};
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+/* Adds the allocs/op counter when the benchmark loop is done. */
+class AllocationCounter
+{
+  public:
+    explicit AllocationCounter(benchmark::State &state)
+        : state(state), start(allocations.load(std::memory_order_relaxed))
+    {
+    }
+    ~AllocationCounter()
+    {
+        auto n = allocations.load(std::memory_order_relaxed) - start;
+        state.counters["allocs/op"] = benchmark::Counter(
+            static_cast<double>(n), benchmark::Counter::kAvgIterations);
+    }
+
+  private:
+    benchmark::State &state;
+    std::uint64_t start;
+};
+
+/*
+ * What Hasura sends to the webhook, give or take the forwarded headers.
+ * The token goes bare, as the only Authorization /webhook/ accepts.
+ */
+Request webhook_request()
+{
+    Request req;
+    req.method = "GET";
+    req.version = "HTTP/1.1";
+    req.path = "/webhook/";
+    req.remote_addr = "10.0.0.12";
+    req.headers = {
+        {"Host", "auth:8080"},
+        {"User-Agent", "hasura-graphql-engine/v2.19.0"},
+        {"Accept", "*/*"},
+        {"Authorization", std::string(nckd::TOKEN_LENGTH, 'x')},
+        {"Content-Type", "application/json"},
+        {"X-Forwarded-For", "203.0.113.7"},
+        {"X-Request-Id", "0f4b6c1e-1d9a-4b7a-9f3e-8c2d5a6b7c8d"},
+    };
+    return req;
+}
+
+Response webhook_response()
+{
+    Response res;
+    res.status = 200;
+    res.version = "HTTP/1.1";
+    res.headers = {{"Content-Type", "application/json"},
+                   {"Content-Length", "52"}};
+    res.body = "{\"X-Hasura-User-Id\": \"42\", \"X-Hasura-Role\": \"user\"}";
+    return res;
+}
+}  // namespace
+
+static void BM_IsValid(benchmark::State &state)
+{
+    const std::string emails[] = {"alice.smith@example.com",
+                                  "bob_42@mail.example.org",
+                                  "not-an-email",
+                                  "carol@sub.domain.example.net"};
+    AllocationCounter counter(state);
+    std::size_t k = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(is_valid(emails[k++ % std::size(emails)]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IsValid);
+
+static void BM_RandomString(benchmark::State &state)
+{
+    int length = static_cast<int>(state.range(0));
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(random_string(length));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * length);
+}
+/* 8 is the register salt, 48 the login token */
+BENCHMARK(BM_RandomString)->Arg(8)->Arg(48);
+
+static void BM_DumpHeaders(benchmark::State &state)
+{
+    auto req = webhook_request();
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(dump_headers(req.headers));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DumpHeaders);
+
+static void BM_Log(benchmark::State &state)
+{
+    auto req = webhook_request();
+    auto res = webhook_response();
+    AllocationCounter counter(state);
+    std::size_t bytes = 0;
+    for (auto _ : state)
+    {
+        auto s = log(req, res);
+        bytes += s.size();
+        benchmark::DoNotOptimize(s);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<std::int64_t>(bytes));
+}
+BENCHMARK(BM_Log);
+
+/* The /login/ and /register/ handlers parse and read the same two keys. */
+static void BM_LoginBodyParse(benchmark::State &state)
+{
+    const std::string body = "{\"email\": \"alice.smith@example.com\", "
+                             "\"password\": \"correct horse battery\"}";
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        auto json = nlohmann::json::parse(body);
+        std::string email = json["email"];
+        std::string password = json["password"];
+        benchmark::DoNotOptimize(email);
+        benchmark::DoNotOptimize(password);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_LoginBodyParse);
+
+/* A span on an untraced request, i.e. the cost tracing adds when off. */
+static void BM_TraceSpan(benchmark::State &state)
+{
+    nckd::trace_request = state.range(0);
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        TRACE_SPAN("bench");
+        benchmark::ClobberMemory();
+    }
+    nckd::trace_request = 0;
+    state.SetItemsProcessed(state.iterations());
+}
+/* 0 is an untraced request, 1 a sampled one */
+BENCHMARK(BM_TraceSpan)->Arg(0)->Arg(1);
+
+/* Static route lookup for the hottest path. */
+static void BM_RouteLookup(benchmark::State &state)
+{
+    std::string method = "GET", path = "/webhook/";
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(method);
+        benchmark::DoNotOptimize(path);
+        benchmark::DoNotOptimize(nckd::ROUTE_TABLE.find(method, path));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RouteLookup);
+
+/* Header lookup and response of a /webhook/ cache hit, 0 allocs/op. */
+static void BM_WebhookContext(benchmark::State &state)
+{
+    auto req = webhook_request();
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        auto &context = nckd::request_context;
+        context.begin(req.headers);
+        auto token = context.header(nckd::Header::Authorization);
+        benchmark::DoNotOptimize(token);
+        benchmark::DoNotOptimize(context.arena.concat(
+            {"{\"X-Hasura-Role\": \"", "user", "\", ",
+             "\"X-Hasura-User-Id\": \"", "42", "\"}"}));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WebhookContext);
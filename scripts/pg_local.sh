@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+# Throwaway Postgres cluster for load tests on one box.
+#
+#   scripts/pg_local.sh start   # initdb on first use, start, load schema
+#   scripts/pg_local.sh seed    # schema plus seed.sql
+#   scripts/pg_local.sh replica # streaming standby of it on the next port
+#   scripts/pg_local.sh stop
+#   scripts/pg_local.sh reset   # stop and delete the clusters
+#
+# PGLOCAL_DIR, PGLOCAL_PORT, SEED_FILLER, SEED_USERS and SEED_LOGIN_USERS
+# override the defaults below. The cluster trusts local connections only.
+set -euo pipefail
+
+here="$(cd "$(dirname "$0")" && pwd)"
+dir="${PGLOCAL_DIR:-${TMPDIR:-/tmp}/nckd-pg}"
+port="${PGLOCAL_PORT:-55432}"
+replica_dir="$dir-replica"
+replica_port=$((port + 1))
+db=nckd
+
+pg_bin="$(pg_config --bindir 2>/dev/null || true)"
+if [[ -n "$pg_bin" ]]; then
+    PATH="$pg_bin:$PATH"
+fi
+
+psql_local() {
+    psql -X -q -v ON_ERROR_STOP=1 -h 127.0.0.1 -p "$port" -U postgres "$@"
+}
+
+start() {
+    if [[ ! -f "$dir/PG_VERSION" ]]; then
+        initdb -D "$dir" -U postgres --auth=trust >/dev/null
+        # tuned for throughput runs, not for durability
+        cat >>"$dir/postgresql.conf" <<CONF
+listen_addresses = '127.0.0.1'
+port = $port
+max_connections = 200
+shared_buffers = 256MB
+fsync = off
+synchronous_commit = off
+full_page_writes = off
+CONF
+    fi
+    if ! pg_ctl -D "$dir" status >/dev/null 2>&1; then
+        pg_ctl -D "$dir" -l "$dir/server.log" -w start >/dev/null
+    fi
+    if ! psql_local -d postgres -tAc \
+        "SELECT 1 FROM pg_database WHERE datname = '$db'" | grep -q 1; then
+        psql_local -d postgres -c "CREATE DATABASE $db"
+    fi
+    psql_local -d "$db" -f "$here/schema.sql"
+    # NckdLoadgen sends everything from one address, as a few users
+    echo "--database-url \"user=postgres dbname=$db host=127.0.0.1 port=$port\"" \
+        "--rate-limit-ip 0 --rate-limit-email 0"
+}
+
+replica() {
+    start >/dev/null
+    if [[ ! -f "$replica_dir/PG_VERSION" ]]; then
+        pg_basebackup -h 127.0.0.1 -p "$port" -U postgres -D "$replica_dir" \
+            -R -X stream >/dev/null
+        echo "port = $replica_port" >>"$replica_dir/postgresql.conf"
+    fi
+    if ! pg_ctl -D "$replica_dir" status >/dev/null 2>&1; then
+        pg_ctl -D "$replica_dir" -l "$replica_dir/server.log" -w start \
+            >/dev/null
+    fi
+    echo "--replica-url \"user=postgres dbname=$db host=127.0.0.1" \
+        "port=$replica_port\""
+}
+
+case "${1:-start}" in
+start)
+    start
+    ;;
+seed)
+    start
+    psql_local -d "$db" \
+        -v filler="${SEED_FILLER:-100000}" \
+        -v users="${SEED_USERS:-1000}" \
+        -v login_users="${SEED_LOGIN_USERS:-100}" \
+        -f "$here/seed.sql"
+    ;;
+replica)
+    replica
+    ;;
+stop)
+    if [[ -f "$replica_dir/PG_VERSION" ]]; then
+        pg_ctl -D "$replica_dir" -w stop >/dev/null 2>&1 || true
+    fi
+    pg_ctl -D "$dir" -w stop >/dev/null
+    ;;
+reset)
+    pg_ctl -D "$replica_dir" -w stop >/dev/null 2>&1 || true
+    pg_ctl -D "$dir" -w stop >/dev/null 2>&1 || true
+    rm -rf "$dir" "$replica_dir"
+    ;;
+*)
+    echo "usage: $0 start|seed|replica|stop|reset" >&2
+    exit 1
+    ;;
+esac
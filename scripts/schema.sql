@@ -0,0 +1,11 @@
+-- Schema the server expects, see PG_STATEMENTS in src/utils.hpp.
+CREATE TABLE IF NOT EXISTS users (
+    id       bigserial PRIMARY KEY,
+    email    text      NOT NULL UNIQUE,
+    password text      NOT NULL,
+    token    text,
+    role     text      NOT NULL DEFAULT 'user'
+);
+
+-- /webhook/ looks every request up by token.
+CREATE INDEX IF NOT EXISTS users_token_idx ON users (token);
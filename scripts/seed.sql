@@ -0,0 +1,27 @@
+-- Seed data for load tests, run with
+--   psql -v filler=100000 -v users=1000 -v login_users=100 -f seed.sql
+--
+-- `filler` rows only give the table and its indexes a realistic size.
+-- The seed*@loadgen.example.com rows match what NckdLoadgen --prefix seed
+-- generates, so its setup only has to log them in. Their password is
+-- "loadgen-pw", hashed with the server's default argon2id parameters.
+\set hash '$argon2id$v=16$m=65536,t=2,p=1$c2VlZHNhbHQ$eiyyZyc59T+AAsdvKZGPxODzHz/bX6cZsDc8mSmbLws'
+
+INSERT INTO users (email, password, token)
+SELECT 'filler' || g || '@loadgen.example.com',
+       :'hash',
+       md5('filler' || g) || left(md5('token' || g), 16)
+FROM generate_series(1, :filler) AS g
+ON CONFLICT (email) DO NOTHING;
+
+INSERT INTO users (email, password)
+SELECT 'seedhook' || g || '@loadgen.example.com', :'hash'
+FROM generate_series(0, :users - 1) AS g
+ON CONFLICT (email) DO NOTHING;
+
+INSERT INTO users (email, password)
+SELECT 'seedlogin' || g || '@loadgen.example.com', :'hash'
+FROM generate_series(0, :login_users - 1) AS g
+ON CONFLICT (email) DO NOTHING;
+
+ANALYZE users;
@@ -0,0 +1,113 @@
+#pragma once
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <httplib.h>
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_sinks.h>
+#include <spdlog/spdlog.h>
+
+namespace nckd
+{
+struct AccessLogOptions
+{
+    /* fraction of successful requests written, errors are always kept */
+    double sample_rate = 1.0;
+    spdlog::level::level_enum level = spdlog::level::info;
+    bool log_bodies = false;
+    std::size_t queue_size = 8192;
+};
+
+/*
+ * Access log written by spdlog's async logger. Request threads only format
+ * one short line and push it into the logger's ring buffer; when the
+ * buffer is full the oldest line is dropped rather than blocking the
+ * request. At debug level the full dump from log() is written instead.
+ * Bodies are only written with `log_bodies`, and Authorization values
+ * never are.
+ */
+class AccessLog
+{
+  public:
+    explicit AccessLog(const AccessLogOptions &options) : options(options)
+    {
+        spdlog::init_thread_pool(options.queue_size, 1);
+        logger = spdlog::create_async_nb<spdlog::sinks::stdout_sink_mt>(
+            "access");
+        logger->set_pattern("[%Y-%m-%d %H:%M:%S.%e] %v");
+        logger->set_level(options.level);
+        threshold = options.sample_rate >= 1.0
+                        ? UINT64_MAX
+                        : static_cast<std::uint64_t>(
+                              std::max(options.sample_rate, 0.0) * 0x1p64);
+    }
+
+    void record(const httplib::Request &req, const httplib::Response &res)
+    {
+        auto level =
+            res.status >= 500 ? spdlog::level::warn : spdlog::level::info;
+        if (!logger->should_log(level) || (res.status < 400 && !sampled()))
+        {
+            return;
+        }
+        if (logger->should_log(spdlog::level::debug))
+        {
+            logger->debug("{}", log(req, res, options.log_bodies));
+            return;
+        }
+        if (options.log_bodies)
+        {
+            logger->log(level,
+                        "{} {} {} {} {}B {}B req={} res={}",
+                        req.remote_addr,
+                        req.method,
+                        req.path,
+                        res.status,
+                        req.body.size(),
+                        res.body.size(),
+                        req.body,
+                        res.body);
+        }
+        else
+        {
+            logger->log(level,
+                        "{} {} {} {} {}B {}B",
+                        req.remote_addr,
+                        req.method,
+                        req.path,
+                        res.status,
+                        req.body.size(),
+                        res.body.size());
+        }
+    }
+
+    void flush()
+    {
+        logger->flush();
+    }
+
+  private:
+    bool sampled() const
+    {
+        if (threshold == UINT64_MAX)
+        {
+            return true;
+        }
+        /* xorshift64*, one per thread, no shared state to contend on */
+        thread_local std::uint64_t state =
+            0x9E3779B97F4A7C15ull ^
+            reinterpret_cast<std::uintptr_t>(&state);
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull < threshold;
+    }
+
+    AccessLogOptions options;
+    std::uint64_t threshold;
+    std::shared_ptr<spdlog::logger> logger;
+};
+
+}  // namespace nckd
@@ -0,0 +1,207 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nckd
+{
+inline std::uint64_t admission_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/* 64 bit mix so neighbouring addresses land in unrelated slots. */
+inline std::uint64_t admission_hash(std::string_view key)
+{
+    std::uint64_t h = std::hash<std::string_view>{}(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Token buckets keyed by client IP or email, `rate` admissions per second
+ * with bursts of up to `burst`.
+ *
+ * Every bucket is a single atomic word holding its theoretical arrival
+ * time (GCRA, the token bucket expressed as a timestamp), updated with one
+ * compare-and-swap; nothing is allocated or locked per key. Keys hash into
+ * a fixed table, so two keys sharing a slot share a budget. With the
+ * table sized well above the number of active clients that only makes the
+ * limit slightly stricter, and a flood of distinct keys can not grow it.
+ */
+class RateLimiter
+{
+  public:
+    RateLimiter(double rate, double burst, std::size_t slots = 1 << 16)
+        : interval(rate > 0 ? static_cast<std::uint64_t>(1e9 / rate) : 0),
+          tolerance(static_cast<std::uint64_t>(
+              std::max(burst - 1, 0.0) * (rate > 0 ? 1e9 / rate : 0))),
+          mask(std::bit_ceil(std::max<std::size_t>(slots, 1)) - 1),
+          table(std::make_unique<std::atomic<std::uint64_t>[]>(mask + 1))
+    {
+    }
+
+    bool enabled() const
+    {
+        return interval != 0;
+    }
+
+    /* Take one admission for `key`; false when its bucket is empty. */
+    bool allow(std::string_view key, std::uint64_t now = admission_now())
+    {
+        if (!enabled())
+        {
+            return true;
+        }
+        auto &slot = table[admission_hash(key) & mask];
+        std::uint64_t tat = slot.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            std::uint64_t start = std::max(tat, now);
+            if (start - now > tolerance)
+            {
+                return false;
+            }
+            if (slot.compare_exchange_weak(tat,
+                                           start + interval,
+                                           std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    /* True while `key` has no admission left, without taking one. */
+    bool blocked(std::string_view key,
+                 std::uint64_t now = admission_now()) const
+    {
+        if (!enabled())
+        {
+            return false;
+        }
+        auto tat = table[admission_hash(key) & mask].load(
+            std::memory_order_relaxed);
+        return tat > now && tat - now > tolerance;
+    }
+
+  private:
+    std::uint64_t interval;
+    std::uint64_t tolerance;
+    std::size_t mask;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> table;
+};
+
+/*
+ * Recently rejected tokens, so a client replaying a bad token is turned
+ * away without a cache shard lock or a database query. Direct mapped:
+ * a newer rejection simply overwrites whatever shared its slot. Only a
+ * 64 bit fingerprint is kept; a stale expiry read next to a fresh
+ * fingerprint can at worst let one bad token through to the database.
+ */
+class NegativeCache
+{
+  public:
+    NegativeCache(std::size_t slots, std::chrono::seconds ttl)
+        : ttl(std::chrono::duration_cast<std::chrono::nanoseconds>(ttl)
+                  .count()),
+          mask(slots ? std::bit_ceil(slots) - 1 : 0),
+          table(slots ? std::make_unique<Slot[]>(mask + 1) : nullptr)
+    {
+    }
+
+    bool enabled() const
+    {
+        return table != nullptr;
+    }
+
+    void insert(std::string_view token, std::uint64_t now = admission_now())
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        auto h = admission_hash(token);
+        auto &slot = table[h & mask];
+        slot.fingerprint.store(h, std::memory_order_relaxed);
+        slot.expires.store(now + ttl, std::memory_order_release);
+    }
+
+    bool contains(std::string_view token,
+                  std::uint64_t now = admission_now()) const
+    {
+        if (!enabled())
+        {
+            return false;
+        }
+        auto h = admission_hash(token);
+        const auto &slot = table[h & mask];
+        return slot.expires.load(std::memory_order_acquire) > now &&
+               slot.fingerprint.load(std::memory_order_relaxed) == h;
+    }
+
+  private:
+    struct Slot
+    {
+        std::atomic<std::uint64_t> fingerprint{0};
+        std::atomic<std::uint64_t> expires{0};
+    };
+
+    std::uint64_t ttl;
+    std::size_t mask;
+    std::unique_ptr<Slot[]> table;
+};
+
+/*
+ * The client a request comes from, for limits keyed by address. A request
+ * relayed by one of the `trusted` proxies is keyed on the rightmost
+ * X-Forwarded-For entry no trusted proxy added, so all clients of a proxy
+ * do not share its budget. Empty when a trusted proxy did not say who the
+ * client was. Entries left of that one are client supplied and ignored.
+ */
+inline std::string_view client_address(std::string_view peer,
+                                       std::string_view forwarded_for,
+                                       const std::vector<std::string> &trusted)
+{
+    auto is_trusted = [&](std::string_view address) {
+        return std::find(trusted.begin(), trusted.end(), address) !=
+               trusted.end();
+    };
+    if (!is_trusted(peer))
+    {
+        return peer;
+    }
+    while (!forwarded_for.empty())
+    {
+        auto comma = forwarded_for.rfind(',');
+        auto entry = comma == std::string_view::npos
+                         ? forwarded_for
+                         : forwarded_for.substr(comma + 1);
+        forwarded_for = forwarded_for.substr(
+            0, comma == std::string_view::npos ? 0 : comma);
+        auto first = entry.find_first_not_of(' ');
+        auto last = entry.find_last_not_of(' ');
+        if (first == std::string_view::npos)
+        {
+            continue;
+        }
+        entry = entry.substr(first, last - first + 1);
+        if (!is_trusted(entry))
+        {
+            return entry;
+        }
+    }
+    return {};
+}
+
+}  // namespace nckd
@@ -0,0 +1,380 @@
+#pragma once
+#include "hash_pool.hpp"
+#include "pg_executor.hpp"
+#include "utils.hpp"
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace nckd
+{
+struct ImportStats
+{
+    std::uint64_t imported = 0;
+    std::uint64_t duplicates = 0;
+    std::uint64_t invalid = 0;
+    std::uint64_t failed = 0;
+};
+
+/*
+ * Bulk provisioning from NDJSON, one {"email": ..., "password": ...} per
+ * line, applying the same checks as /register/.
+ *
+ * Input is taken in batches. Per batch, emails already seen in the file
+ * are dropped and the rest are checked against the table with a single
+ * emails_existing query, so their passwords are not hashed for nothing.
+ * The survivors are hashed on the HashPool threads, keeping its queue
+ * full, and loaded in one transaction per batch: COPY into a temporary
+ * table, then INSERT ... ON CONFLICT (email) DO NOTHING into users.
+ *
+ * Every rejected line is written to `report` as an NDJSON object with its
+ * line number and reason. An email /register/ inserted after the check is
+ * skipped by the INSERT and reported as already registered; the rest of
+ * its batch still loads. Only a batch whose transaction fails is reported
+ * line by line as failed, and nothing of it is loaded.
+ */
+class BulkImporter
+{
+  public:
+    BulkImporter(cpool::PGConnection &connection,
+                 HashPool &hash_pool,
+                 std::ostream &report,
+                 std::size_t batch_size = 1000)
+        : connection(connection),
+          hash_pool(hash_pool),
+          report(report),
+          batch_size(std::max<std::size_t>(batch_size, 1))
+    {
+    }
+
+    ImportStats run(std::istream &in)
+    {
+        std::string line;
+        std::uint64_t line_no = 0;
+        std::vector<Record> batch;
+        while (std::getline(in, line))
+        {
+            ++line_no;
+            if (line.empty())
+            {
+                continue;
+            }
+            if (auto record = parse(line, line_no))
+            {
+                batch.push_back(std::move(*record));
+            }
+            if (batch.size() == batch_size)
+            {
+                load(batch);
+                batch.clear();
+            }
+        }
+        load(batch);
+        return stats;
+    }
+
+    /* COPY text format, escaping the few characters it treats specially. */
+    static void append_field(std::string &out, std::string_view field)
+    {
+        for (char c : field)
+        {
+            switch (c)
+            {
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            default:
+                out += c;
+            }
+        }
+    }
+
+  private:
+    struct Record
+    {
+        std::uint64_t line;
+        std::string email;
+        std::string password;
+        std::string encoded;
+    };
+
+    std::optional<Record> parse(const std::string &line, std::uint64_t no)
+    {
+        auto doc = nlohmann::json::parse(line, nullptr, false);
+        if (doc.is_discarded() || !doc.is_object() ||
+            !doc.contains("email") || !doc["email"].is_string() ||
+            !doc.contains("password") || !doc["password"].is_string())
+        {
+            reject(no, "", "malformed", stats.invalid);
+            return std::nullopt;
+        }
+        Record r{no, doc["email"], doc["password"], {}};
+        if (!is_valid(r.email))
+        {
+            reject(no, r.email, "invalid email", stats.invalid);
+            return std::nullopt;
+        }
+        if (r.password.length() < 6)
+        {
+            reject(no, r.email, "password too short", stats.invalid);
+            return std::nullopt;
+        }
+        if (!seen.insert(r.email).second)
+        {
+            reject(no, r.email, "duplicate in input", stats.duplicates);
+            return std::nullopt;
+        }
+        return r;
+    }
+
+    void reject(std::uint64_t line,
+                const std::string &email,
+                const char *reason,
+                std::uint64_t &counter)
+    {
+        ++counter;
+        report << nlohmann::json{{"line", line},
+                                 {"email", email},
+                                 {"reason", reason}}
+                      .dump()
+               << "\n";
+    }
+
+    void load(std::vector<Record> &batch)
+    {
+        if (batch.empty())
+        {
+            return;
+        }
+        drop_existing(batch);
+        hash(batch);
+        std::erase_if(batch,
+                      [](const Record &r) { return r.encoded.empty(); });
+        if (batch.empty())
+        {
+            return;
+        }
+        std::unordered_set<std::string> inserted;
+        std::string error;
+        if (!copy(batch, inserted, error))
+        {
+            SPDLOG_WARN("import of {} users failed: {}", batch.size(), error);
+            for (const auto &r : batch)
+            {
+                reject(r.line, r.email, "copy failed", stats.failed);
+            }
+            return;
+        }
+        stats.imported += inserted.size();
+        for (const auto &r : batch)
+        {
+            if (!inserted.count(r.email))
+            {
+                reject(r.line,
+                       r.email,
+                       "already registered",
+                       stats.duplicates);
+            }
+        }
+    }
+
+    void drop_existing(std::vector<Record> &batch)
+    {
+        std::vector<std::string_view> emails;
+        for (const auto &r : batch)
+        {
+            emails.push_back(r.email);
+        }
+        auto array = pg_array_literal(emails);
+        auto res = PGExecutor(connection).run(cpool::Stmt::EmailsExisting,
+                                              {array.c_str()});
+        if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+        {
+            /* COPY will fail on them anyway and say so */
+            SPDLOG_WARN("duplicate check failed: {}",
+                        PQresultErrorMessage(res.get()));
+            return;
+        }
+        std::unordered_set<std::string_view> existing;
+        for (int k = 0; k < PQntuples(res.get()); ++k)
+        {
+            existing.insert(PQgetvalue(res.get(), k, 0));
+        }
+        std::erase_if(batch, [&](const Record &r) {
+            if (!existing.count(r.email))
+            {
+                return false;
+            }
+            reject(r.line, r.email, "already registered", stats.duplicates);
+            return true;
+        });
+    }
+
+    /* Keep the hash pool's queue full, waiting on the oldest job. */
+    void hash(std::vector<Record> &batch)
+    {
+        std::deque<std::pair<Record *, std::future<HashResult>>> pending;
+        auto finish_oldest = [&] {
+            auto &[record, future] = pending.front();
+            auto result = future.get();
+            if (result.code == ARGON2_OK)
+            {
+                record->encoded = std::move(result.encoded);
+            }
+            else
+            {
+                reject(record->line,
+                       record->email,
+                       "hash failed",
+                       stats.failed);
+            }
+            pending.pop_front();
+        };
+        for (auto &r : batch)
+        {
+            for (;;)
+            {
+                auto job = hash_pool.hash(
+                    r.password,
+                    random_string(hash_pool.parameters().salt_len));
+                if (job)
+                {
+                    pending.emplace_back(&r, std::move(*job));
+                    break;
+                }
+                if (pending.empty())
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                finish_oldest();
+            }
+        }
+        while (!pending.empty())
+        {
+            finish_oldest();
+        }
+    }
+
+    /* Runs one statement of the import transaction, expecting `status`. */
+    static PGResultPtr exec(PGconn *conn,
+                            const char *sql,
+                            ExecStatusType status,
+                            std::string &error)
+    {
+        PGResultPtr res(PQexec(conn, sql));
+        if (PQresultStatus(res.get()) != status)
+        {
+            error = PQerrorMessage(conn);
+            return nullptr;
+        }
+        return res;
+    }
+
+    /*
+     * Loads `batch` in one transaction and fills `inserted` with the
+     * emails the INSERT actually added; the others were taken already.
+     */
+    bool copy(const std::vector<Record> &batch,
+              std::unordered_set<std::string> &inserted,
+              std::string &error)
+    {
+        if (!connection.ensure_ready())
+        {
+            error = "no connection";
+            return false;
+        }
+        PGconn *conn = connection.acquire();
+        bool ok = stage(conn, batch, error);
+        PGResultPtr res;
+        if (ok)
+        {
+            res = exec(conn,
+                       "INSERT INTO users (email, password) "
+                       "SELECT email, password FROM import_batch "
+                       "ON CONFLICT (email) DO NOTHING RETURNING email",
+                       PGRES_TUPLES_OK,
+                       error);
+            ok = res && exec(conn, "COMMIT", PGRES_COMMAND_OK, error);
+        }
+        if (!ok)
+        {
+            PQclear(PQexec(conn, "ROLLBACK"));
+            return false;
+        }
+        for (int k = 0; k < PQntuples(res.get()); ++k)
+        {
+            inserted.emplace(PQgetvalue(res.get(), k, 0));
+        }
+        return true;
+    }
+
+    /* Opens the transaction and COPYs `batch` into a temporary table. */
+    bool stage(PGconn *conn,
+               const std::vector<Record> &batch,
+               std::string &error)
+    {
+        if (!exec(conn,
+                  "BEGIN; CREATE TEMP TABLE import_batch "
+                  "(email text, password text) ON COMMIT DROP",
+                  PGRES_COMMAND_OK,
+                  error) ||
+            !exec(conn,
+                  "COPY import_batch (email, password) FROM STDIN",
+                  PGRES_COPY_IN,
+                  error))
+        {
+            return false;
+        }
+        std::string data;
+        for (const auto &r : batch)
+        {
+            append_field(data, r.email);
+            data += '\t';
+            append_field(data, r.encoded);
+            data += '\n';
+        }
+        bool ok = PQputCopyData(conn, data.data(), data.size()) == 1;
+        if (PQputCopyEnd(conn, ok ? nullptr : "client error") != 1)
+        {
+            ok = false;
+        }
+        while (PGresult *res = PQgetResult(conn))
+        {
+            if (PQresultStatus(res) != PGRES_COMMAND_OK)
+            {
+                ok = false;
+                error = PQresultErrorMessage(res);
+            }
+            PQclear(res);
+        }
+        return ok;
+    }
+
+    cpool::PGConnection &connection;
+    HashPool &hash_pool;
+    std::ostream &report;
+    std::size_t batch_size;
+    std::unordered_set<std::string> seen;
+    ImportStats stats;
+};
+
+}  // namespace nckd
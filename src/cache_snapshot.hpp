@@ -0,0 +1,261 @@
+#pragma once
+#include "token_cache.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nckd
+{
+/*
+ * On-disk TokenCache snapshot, native byte order:
+ *
+ *   header  magic "NCKDSNAP", version, entry count, payload size and an
+ *           FNV-1a checksum of the payload
+ *   entry   expiry as unix milliseconds, token/role/uid lengths (u16
+ *           each, plus padding), then the three strings back to back
+ *
+ * Expiry is stored in wall clock time since steady_clock does not survive
+ * a restart. The file holds live session tokens, so it is created 0600.
+ * Rotations that happened while the node was down are not in it, so the
+ * restored entries are only served after revalidate_snapshot() checked
+ * them against the database.
+ */
+struct SnapshotHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    std::uint64_t count;
+    std::uint64_t payload_size;
+    std::uint64_t checksum;
+};
+
+struct SnapshotEntry
+{
+    std::int64_t expires_ms;
+    std::uint16_t token_len;
+    std::uint16_t role_len;
+    std::uint16_t uid_len;
+    std::uint16_t reserved;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'N', 'C', 'K', 'D', 'S', 'N', 'A', 'P'};
+constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+inline std::uint64_t fnv1a(const char *data, std::size_t n)
+{
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        h ^= static_cast<unsigned char>(data[k]);
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+/* Write to `path`.tmp and rename, so a crash never leaves half a file. */
+inline bool save_snapshot(const TokenCache &cache, const std::string &path)
+{
+    auto sys_now = std::chrono::system_clock::now();
+    auto steady_now = TokenCache::clock::now();
+    std::string payload;
+    std::uint64_t count = 0;
+    cache.for_each([&](std::string_view token,
+                       const AuthEntry &entry,
+                       TokenCache::clock::time_point expires) {
+        if (token.size() > UINT16_MAX || entry.role.size() > UINT16_MAX ||
+            entry.uid.size() > UINT16_MAX)
+        {
+            return;
+        }
+        auto wall = sys_now + std::chrono::duration_cast<
+                                  std::chrono::system_clock::duration>(
+                                  expires - steady_now);
+        SnapshotEntry e{};
+        e.expires_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           wall.time_since_epoch())
+                           .count();
+        e.token_len = static_cast<std::uint16_t>(token.size());
+        e.role_len = static_cast<std::uint16_t>(entry.role.size());
+        e.uid_len = static_cast<std::uint16_t>(entry.uid.size());
+        payload.append(reinterpret_cast<const char *>(&e), sizeof(e));
+        payload.append(token).append(entry.role).append(entry.uid);
+        ++count;
+    });
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.count = count;
+    header.payload_size = payload.size();
+    header.checksum = fnv1a(payload.data(), payload.size());
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        SPDLOG_WARN("can not write snapshot {}: {}", tmp, strerror(errno));
+        return false;
+    }
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+    std::size_t done = 0;
+    while (ok && done < payload.size())
+    {
+        ssize_t n = write(fd, payload.data() + done, payload.size() - done);
+        ok = n > 0;
+        done += ok ? n : 0;
+    }
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        SPDLOG_WARN("snapshot {} not written: {}", path, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    SPDLOG_INFO("saved {} cached tokens to {}", count, path);
+    return true;
+}
+
+/*
+ * Map `path` and insert its unexpired entries into `cache`. A missing,
+ * truncated, foreign or corrupt file loads nothing. Returns the number of
+ * entries restored and adds their tokens to `restored`.
+ */
+inline std::size_t load_snapshot(TokenCache &cache,
+                                 const std::string &path,
+                                 std::vector<std::string> *restored = nullptr)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return 0;
+    }
+    std::size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+    const char *base = static_cast<const char *>(map);
+    SnapshotHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    const char *payload = base + sizeof(header);
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+        header.version != SNAPSHOT_VERSION ||
+        header.payload_size != size - sizeof(header) ||
+        header.checksum != fnv1a(payload, header.payload_size))
+    {
+        SPDLOG_WARN("ignoring invalid snapshot {}", path);
+        munmap(map, size);
+        return 0;
+    }
+
+    auto sys_now = std::chrono::system_clock::now();
+    auto steady_now = TokenCache::clock::now();
+    std::size_t loaded = 0;
+    std::size_t pos = 0;
+    for (std::uint64_t k = 0; k < header.count; ++k)
+    {
+        SnapshotEntry e;
+        if (header.payload_size - pos < sizeof(e))
+        {
+            break;
+        }
+        std::memcpy(&e, payload + pos, sizeof(e));
+        pos += sizeof(e);
+        std::size_t len = std::size_t(e.token_len) + e.role_len + e.uid_len;
+        if (header.payload_size - pos < len)
+        {
+            break;
+        }
+        std::string_view token(payload + pos, e.token_len);
+        AuthEntry entry{std::string(payload + pos + e.token_len, e.role_len),
+                        std::string(payload + pos + e.token_len + e.role_len,
+                                    e.uid_len)};
+        pos += len;
+        auto wall = std::chrono::system_clock::time_point(
+            std::chrono::milliseconds(e.expires_ms));
+        auto expires =
+            steady_now +
+            std::chrono::duration_cast<TokenCache::clock::duration>(
+                wall - sys_now);
+        if (cache.put_until(
+                token, std::move(entry), expires, cache.epoch(token)))
+        {
+            ++loaded;
+            if (restored)
+            {
+                restored->emplace_back(token);
+            }
+        }
+    }
+    munmap(map, size);
+    SPDLOG_INFO("restored {} cached tokens from {}", loaded, path);
+    return loaded;
+}
+
+/*
+ * Erase restored entries that the database no longer backs: tokens that
+ * were rotated or revoked while the node was down, or whose user changed.
+ * `lookup(batch, live)` fills `live` with the current entry of every token
+ * in `batch` that still exists and returns false if it could not ask, in
+ * which case all restored entries are dropped. Returns the number kept.
+ */
+template <class Lookup>
+std::size_t revalidate_snapshot(TokenCache &cache,
+                                const std::vector<std::string> &tokens,
+                                Lookup &&lookup,
+                                std::size_t batch_size = 4096)
+{
+    std::size_t kept = 0;
+    std::vector<std::string_view> batch;
+    std::unordered_map<std::string, AuthEntry> live;
+    for (std::size_t first = 0; first < tokens.size(); first += batch_size)
+    {
+        auto last = std::min(tokens.size(), first + batch_size);
+        batch.assign(tokens.begin() + first, tokens.begin() + last);
+        live.clear();
+        bool asked = lookup(batch, live);
+        for (auto token : batch)
+        {
+            auto cached = cache.get(token);
+            if (!cached)
+            {
+                continue;
+            }
+            auto it = asked ? live.find(std::string(token)) : live.end();
+            if (it == live.end() || it->second.role != cached->role ||
+                it->second.uid != cached->uid)
+            {
+                cache.erase(token);
+                continue;
+            }
+            ++kept;
+        }
+    }
+    SPDLOG_INFO("{} of {} restored tokens still valid", kept, tokens.size());
+    return kept;
+}
+
+}  // namespace nckd
@@ -0,0 +1,224 @@
+#pragma once
+#include "metrics.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+namespace nckd
+{
+/* Who gives way first when the limit is reached. */
+enum class Priority
+{
+    High,
+    Normal,
+    Low,
+    Count,
+};
+
+/*
+ * Adaptive cap on the requests in flight, AIMD on their latency.
+ *
+ * Every route keeps a baseline: the lowest latency it has shown recently,
+ * drifting up slowly so it follows a permanent change. A request finishing
+ * within `tolerance` times its route's baseline, or within `slack` of it,
+ * grows the limit by 1/limit, about one per limit's worth of requests. A
+ * slower or failed one shrinks the limit by `backoff`, at most once per
+ * round trip, so one burst of slow answers backs off once rather than
+ * once per answer.
+ *
+ * A priority may only use its share of the limit, so when Postgres or
+ * Argon2 fall behind the low priority routes are refused first. Refusing
+ * costs nothing, so the work that is admitted still finishes in time
+ * instead of everything queueing until the client gives up.
+ */
+class ConcurrencyLimiter
+{
+    static constexpr std::size_t PRIORITIES =
+        static_cast<std::size_t>(Priority::Count);
+    static constexpr std::size_t ROUTES =
+        static_cast<std::size_t>(Route::Count);
+
+  public:
+    struct Options
+    {
+        /* 0 disables the limiter */
+        double max_limit = 0;
+        double min_limit = 4;
+        double backoff = 0.9;
+        double tolerance = 2.0;
+        std::chrono::microseconds slack{5000};
+        std::array<double, PRIORITIES> shares = {1.0, 0.8, 0.5};
+    };
+
+    /* One admitted request; gives its slot back when destroyed. */
+    class Permit
+    {
+      public:
+        Permit() = default;
+        Permit(Permit &&other) noexcept
+            : owner(std::exchange(other.owner, nullptr)),
+              route(other.route),
+              start(other.start)
+        {
+        }
+        Permit &operator=(Permit &&other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                owner = std::exchange(other.owner, nullptr);
+                route = other.route;
+                start = other.start;
+            }
+            return *this;
+        }
+        ~Permit()
+        {
+            release();
+        }
+        explicit operator bool() const
+        {
+            return owner != nullptr;
+        }
+
+        /* Report how the request went, then give the slot back. */
+        void complete(bool failed,
+                      std::uint64_t now = ConcurrencyLimiter::now())
+        {
+            if (owner != nullptr)
+            {
+                owner->sample(route, now - start, failed, now);
+                release();
+            }
+        }
+
+        void release()
+        {
+            if (owner != nullptr)
+            {
+                std::exchange(owner, nullptr)
+                    ->in_flight.fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+      private:
+        friend ConcurrencyLimiter;
+        Permit(ConcurrencyLimiter *owner,
+               std::size_t route,
+               std::uint64_t start)
+            : owner(owner), route(route), start(start)
+        {
+        }
+        ConcurrencyLimiter *owner = nullptr;
+        std::size_t route = 0;
+        std::uint64_t start = 0;
+    };
+
+    explicit ConcurrencyLimiter(const Options &options)
+        : options(options),
+          current(std::max(options.min_limit, options.max_limit / 2))
+    {
+        for (auto &b : baseline)
+        {
+            b.store(UINT64_MAX, std::memory_order_relaxed);
+        }
+    }
+
+    bool enabled() const
+    {
+        return options.max_limit > 0;
+    }
+
+    static std::uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /* An empty Permit when `priority` has used up its share. */
+    Permit try_acquire(Priority priority,
+                       Route route,
+                       std::uint64_t now = ConcurrencyLimiter::now())
+    {
+        auto r = static_cast<std::size_t>(route);
+        if (!enabled())
+        {
+            return {};
+        }
+        auto cap = current.load(std::memory_order_relaxed) *
+                   options.shares[static_cast<std::size_t>(priority)];
+        auto n = in_flight.fetch_add(1, std::memory_order_acquire);
+        if (n >= std::max(cap, 1.0))
+        {
+            in_flight.fetch_sub(1, std::memory_order_release);
+            return {};
+        }
+        return Permit(this, r, now);
+    }
+
+    double limit() const
+    {
+        return current.load(std::memory_order_relaxed);
+    }
+
+    std::size_t active() const
+    {
+        return in_flight.load(std::memory_order_relaxed);
+    }
+
+  private:
+    void sample(std::size_t route,
+                std::uint64_t latency,
+                bool failed,
+                std::uint64_t now)
+    {
+        auto &b = baseline[route];
+        auto base = b.load(std::memory_order_relaxed);
+        /* follow drops at once and rises by 1/256 per sample */
+        auto next = latency <= base ? latency : base + (latency - base) / 256;
+        b.store(next, std::memory_order_relaxed);
+        if (base == UINT64_MAX)
+        {
+            return;
+        }
+        auto slack = static_cast<std::uint64_t>(
+            std::chrono::nanoseconds(options.slack).count());
+        bool slow = latency > std::max(
+                                  static_cast<std::uint64_t>(
+                                      base * options.tolerance),
+                                  base + slack);
+        bool shrink = failed || slow;
+        if (shrink)
+        {
+            auto allowed = next_decrease.load(std::memory_order_relaxed);
+            if (now < allowed ||
+                !next_decrease.compare_exchange_strong(
+                    allowed, now + latency, std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+        double limit = current.load(std::memory_order_relaxed);
+        double updated;
+        do
+        {
+            updated = shrink
+                          ? std::max(options.min_limit,
+                                     limit * options.backoff)
+                          : std::min(options.max_limit, limit + 1 / limit);
+        } while (!current.compare_exchange_weak(
+            limit, updated, std::memory_order_relaxed));
+    }
+
+    Options options;
+    std::atomic<double> current;
+    std::atomic<std::size_t> in_flight{0};
+    std::atomic<std::uint64_t> next_decrease{0};
+    std::array<std::atomic<std::uint64_t>, ROUTES> baseline;
+};
+
+}  // namespace nckd
@@ -0,0 +1,121 @@
+#pragma once
+#include "metrics.hpp"
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+namespace nckd
+{
+/* Error codes the handlers answer with, in the order of ERROR_CODES. */
+enum class ErrorCode : std::uint8_t
+{
+    /* 10 01 XX database */
+    DbBusy,
+    DbConnect,
+    DbQuery,
+    /* 10 02 XX parameters */
+    BadEmail,
+    BadPassword,
+    /* 10 03 XX business */
+    UnknownUser,
+    WrongPassword,
+    EmailTaken,
+    WeakPassword,
+    BadToken,
+    /* 10 04 XX busy, worth retrying */
+    Busy,
+    TooManyAttempts,
+    Overloaded,
+    Count,
+};
+
+struct ErrorResponse
+{
+    int status;
+    /* empty for no body */
+    std::string_view body;
+};
+
+/* Built at compile time so a rejection formats nothing. */
+constexpr ErrorResponse ERROR_RESPONSES[] = {
+    {200, "{\"code\": 100101}"},
+    {200, "{\"code\": 100102}"},
+    {200, "{\"code\": 100103}"},
+    {200, "{\"code\": 100201}"},
+    {200, "{\"code\": 100202}"},
+    {200, "{\"code\": 100301}"},
+    {200, "{\"code\": 100302}"},
+    {200, "{\"code\": 100303}"},
+    {200, "{\"code\": 100304}"},
+    {401, ""},
+    {503, "{\"code\": 100401}"},
+    {429, "{\"code\": 100402}"},
+    {503, "{\"code\": 100403}"},
+};
+
+static_assert(std::size(ERROR_RESPONSES) ==
+              static_cast<std::size_t>(ErrorCode::Count));
+static_assert(ERROR_CODE_COUNT ==
+              static_cast<std::size_t>(ErrorCode::Count) + 1);
+static_assert(std::string_view(ERROR_CODES[static_cast<std::size_t>(
+                  ErrorCode::BadToken)]) == "100305");
+
+constexpr const ErrorResponse &error_response(ErrorCode code)
+{
+    return ERROR_RESPONSES[static_cast<std::size_t>(code)];
+}
+
+constexpr const char *error_name(ErrorCode code)
+{
+    return ERROR_CODES[static_cast<std::size_t>(code)];
+}
+
+inline Counter &error_counter(ErrorCode code)
+{
+    return metrics().errors[static_cast<std::size_t>(code)];
+}
+
+/*
+ * A value or the ErrorCode explaining why there is none, so that handlers
+ * return a rejection instead of throwing it. Unwinding costs far more than
+ * the rest of a rejected request, and a token or credential flood is
+ * mostly rejections.
+ */
+template <class T>
+class [[nodiscard]] Expected
+{
+  public:
+    Expected(T value) : state(std::in_place_index<0>, std::move(value))
+    {
+    }
+    Expected(ErrorCode code) : state(std::in_place_index<1>, code)
+    {
+    }
+
+    explicit operator bool() const
+    {
+        return state.index() == 0;
+    }
+    T &operator*()
+    {
+        return *std::get_if<0>(&state);
+    }
+    const T &operator*() const
+    {
+        return *std::get_if<0>(&state);
+    }
+    T *operator->()
+    {
+        return std::get_if<0>(&state);
+    }
+    ErrorCode error() const
+    {
+        return *std::get_if<1>(&state);
+    }
+
+  private:
+    std::variant<T, ErrorCode> state;
+};
+
+}  // namespace nckd
@@ -0,0 +1,362 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "argon2.h"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+#define OUT_LEN 32
+#define ENCODED_LEN 128
+
+namespace nckd
+{
+struct Argon2Params
+{
+    std::uint32_t t_cost = 2;
+    /* KiB */
+    std::uint32_t m_cost = 1 << 16;
+    std::uint32_t parallelism = 1;
+    /* bytes, between 8 and 32 so the encoded hash fits ENCODED_LEN */
+    std::uint32_t salt_len = 16;
+};
+
+/*
+ * Cost parameters of an "$argon2id$v=..$m=..,t=..,p=..$salt$hash" string,
+ * nullopt for anything else. salt_len is the decoded salt length.
+ */
+inline std::optional<Argon2Params> parse_argon2(std::string_view encoded)
+{
+    auto take = [&](std::string_view prefix) {
+        if (encoded.substr(0, prefix.size()) != prefix)
+        {
+            return false;
+        }
+        encoded.remove_prefix(prefix.size());
+        return true;
+    };
+    auto number = [&](std::uint32_t &out) {
+        auto [end, ec] = std::from_chars(
+            encoded.data(), encoded.data() + encoded.size(), out);
+        if (ec != std::errc())
+        {
+            return false;
+        }
+        encoded.remove_prefix(end - encoded.data());
+        return true;
+    };
+    Argon2Params params;
+    std::uint32_t version;
+    if (!take("$argon2id$v=") || !number(version) || !take("$m=") ||
+        !number(params.m_cost) || !take(",t=") || !number(params.t_cost) ||
+        !take(",p=") || !number(params.parallelism) || !take("$"))
+    {
+        return std::nullopt;
+    }
+    auto salt_end = encoded.find('$');
+    if (salt_end == std::string_view::npos || salt_end == 0)
+    {
+        return std::nullopt;
+    }
+    /* unpadded base64 */
+    params.salt_len = static_cast<std::uint32_t>(salt_end * 3 / 4);
+    return params;
+}
+
+/* True when `encoded` was made with other costs or a shorter salt. */
+inline bool needs_rehash(std::string_view encoded, const Argon2Params &params)
+{
+    auto stored = parse_argon2(encoded);
+    return stored && (stored->t_cost != params.t_cost ||
+                      stored->m_cost != params.m_cost ||
+                      stored->parallelism != params.parallelism ||
+                      stored->salt_len < params.salt_len);
+}
+
+/*
+ * Parameters for this host: `start` with the largest t_cost whose hash
+ * takes at most `target`. m_cost is the memory budget of one hash and is
+ * only halved, down to 1 MiB, when even t_cost 1 is over the target.
+ * Each setting is timed as the best of three runs.
+ */
+inline Argon2Params calibrate_argon2(std::chrono::milliseconds target,
+                                     Argon2Params start)
+{
+    auto time = [](const Argon2Params &p) {
+        auto best = std::chrono::steady_clock::duration::max();
+        const char password[] = "calibration";
+        const char salt[] = "calibration-salt";
+        for (int k = 0; k < 3; ++k)
+        {
+            unsigned char out[OUT_LEN];
+            auto begin = std::chrono::steady_clock::now();
+            argon2_hash(p.t_cost,
+                        p.m_cost,
+                        p.parallelism,
+                        password,
+                        sizeof(password) - 1,
+                        salt,
+                        sizeof(salt) - 1,
+                        out,
+                        OUT_LEN,
+                        nullptr,
+                        0,
+                        Argon2_id,
+                        ARGON2_VERSION_10);
+            best = std::min(best, std::chrono::steady_clock::now() - begin);
+        }
+        return best;
+    };
+    Argon2Params p = start;
+    p.t_cost = 1;
+    auto min_memory = std::max<std::uint32_t>(8 * p.parallelism, 1024);
+    auto once = time(p);
+    while (once > target && p.m_cost / 2 >= min_memory)
+    {
+        p.m_cost /= 2;
+        once = time(p);
+    }
+    /* time grows about linearly with t_cost; estimate, then confirm */
+    auto ticks = std::max<std::chrono::steady_clock::rep>(once.count(), 1);
+    p.t_cost = static_cast<std::uint32_t>(std::clamp<long long>(
+        std::chrono::steady_clock::duration(target).count() / ticks, 1, 64));
+    while (p.t_cost > 1 && time(p) > target)
+    {
+        --p.t_cost;
+    }
+    return p;
+}
+
+struct HashResult
+{
+    int code;
+    std::string encoded;
+};
+
+/*
+ * Fixed set of threads that run Argon2 away from the HTTP workers.
+ *
+ * Every hash holds m_cost KiB while it runs, so the number of workers is
+ * capped by `memory_budget_kib / m_cost`. Jobs wait in a bounded queue;
+ * once it is full try_submit() refuses new work immediately and the
+ * handler answers "busy" instead of parking another HTTP thread.
+ *
+ * A handler still waits on its future, so each of its jobs, queued or
+ * running, holds one HTTP worker. Such jobs are submitted to a lane, one
+ * per group of HTTP workers, and each lane has at most `lane_jobs` of them
+ * at once, which caps the workers of that group that hashing can tie up.
+ * Jobs nobody waits on, like background rehashes, go without a lane and
+ * only count against the queue. `lane_jobs` 0 leaves only the queue bound.
+ */
+class HashPool
+{
+  public:
+    /* lane of a job that holds no HTTP worker */
+    static constexpr std::size_t NO_LANE = SIZE_MAX;
+
+    HashPool(std::size_t num_threads,
+             std::size_t queue_capacity,
+             std::size_t memory_budget_kib,
+             Argon2Params params = {},
+             std::size_t lane_jobs = 0,
+             std::size_t lanes = 1)
+        : params(params),
+          queue_capacity(queue_capacity),
+          lane_jobs(lane_jobs),
+          in_lane(std::max<std::size_t>(lanes, 1))
+    {
+        std::size_t by_memory =
+            memory_budget_kib / std::max<std::uint32_t>(params.m_cost, 1);
+        std::size_t n = std::max<std::size_t>(
+            1, std::min(num_threads == 0 ? 1 : num_threads, by_memory));
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+    HashPool(const HashPool &) = delete;
+    HashPool &operator=(const HashPool &) = delete;
+    ~HashPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &t : workers)
+        {
+            t.join();
+        }
+    }
+
+    std::size_t size() const
+    {
+        return workers.size();
+    }
+
+    std::size_t queued()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size();
+    }
+
+    /* Jobs queued or running. */
+    std::size_t in_flight()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size() + running;
+    }
+
+    /* Jobs of `lane` queued or running. */
+    std::size_t in_flight(std::size_t lane)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return in_lane[lane];
+    }
+
+    const Argon2Params &parameters() const
+    {
+        return params;
+    }
+
+    template <class F>
+    auto try_submit(F &&f, std::size_t lane = NO_LANE)
+        -> std::optional<std::future<std::invoke_result_t<F>>>
+    {
+        using R = std::invoke_result_t<F>;
+        auto task =
+            std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping || jobs.size() >= queue_capacity ||
+                (lane != NO_LANE && lane_jobs != 0 &&
+                 in_lane[lane] >= lane_jobs))
+            {
+                return std::nullopt;
+            }
+            if (lane != NO_LANE)
+            {
+                ++in_lane[lane];
+            }
+            jobs.push_back({[task] { (*task)(); }, lane});
+        }
+        cv.notify_one();
+        return future;
+    }
+
+    /* argon2id with the pool's parameters; `salt` is used as given. */
+    std::optional<std::future<HashResult>> hash(std::string password,
+                                                std::string salt,
+                                                std::size_t lane = NO_LANE)
+    {
+        auto job = [this,
+                    password = std::move(password),
+                    salt = std::move(salt),
+                    request = trace_request] {
+            TraceAdopt adopt(request);
+            TRACE_SPAN("argon2_hash");
+            return compute(password, salt);
+        };
+        return try_submit(std::move(job), lane);
+    }
+
+    /* The same hash on the calling thread, for jobs already on the pool. */
+    HashResult compute(std::string_view password, std::string_view salt) const
+    {
+        ScopedTimer timer(metrics().argon2_hash);
+        unsigned char out[OUT_LEN];
+        char encoded[ENCODED_LEN];
+        int code = argon2_hash(params.t_cost,
+                               params.m_cost,
+                               params.parallelism,
+                               password.data(),
+                               password.size(),
+                               salt.data(),
+                               salt.size(),
+                               out,
+                               OUT_LEN,
+                               encoded,
+                               ENCODED_LEN,
+                               Argon2_id,
+                               ARGON2_VERSION_10);
+        return HashResult{code, code == ARGON2_OK ? encoded : ""};
+    }
+
+    std::optional<std::future<int>> verify(std::string encoded,
+                                           std::string password,
+                                           std::size_t lane = NO_LANE)
+    {
+        auto job = [encoded = std::move(encoded),
+                    password = std::move(password),
+                    request = trace_request] {
+            TraceAdopt adopt(request);
+            TRACE_SPAN("argon2_verify");
+            ScopedTimer timer(metrics().argon2_verify);
+            return argon2_verify(
+                encoded.c_str(), password.data(), password.size(), Argon2_id);
+        };
+        return try_submit(std::move(job), lane);
+    }
+
+  private:
+    struct Job
+    {
+        std::function<void()> run;
+        std::size_t lane;
+    };
+
+    void run()
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                ++running;
+            }
+            job.run();
+            std::lock_guard<std::mutex> lock(mutex);
+            --running;
+            if (job.lane != NO_LANE)
+            {
+                --in_lane[job.lane];
+            }
+        }
+    }
+
+    Argon2Params params;
+    std::size_t queue_capacity;
+    std::size_t lane_jobs;
+    std::size_t running = 0;
+    /* jobs queued or running, per lane */
+    std::vector<std::size_t> in_lane;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+}  // namespace nckd
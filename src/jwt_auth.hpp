@@ -0,0 +1,215 @@
+#pragma once
+#include "random.hpp"
+#include "token_cache.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <jwt-cpp/jwt.h>
+#include <jwt-cpp/traits/nlohmann-json/traits.h>
+
+namespace nckd
+{
+/* Payload is "<jti> <exp>", exp in unix seconds and optional. */
+constexpr const char *JWT_REVOKE_CHANNEL = "nckd_jwt_revoke";
+
+struct JwtKey
+{
+    std::string kid;
+    std::string secret;
+};
+
+/*
+ * Reads one `kid=secret` per line, blank lines and `#` comments are
+ * skipped. The first key signs new tokens, every key verifies, so a key
+ * is rotated by putting its successor on top and dropping it once the
+ * tokens it signed have expired.
+ */
+inline std::vector<JwtKey> load_jwt_keys(const std::string &path)
+{
+    std::vector<JwtKey> keys;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        auto eq = line.find('=');
+        if (eq == 0 || eq == std::string::npos || eq + 1 == line.size())
+        {
+            continue;
+        }
+        keys.push_back({line.substr(0, eq), line.substr(eq + 1)});
+    }
+    return keys;
+}
+
+/*
+ * Token ids revoked before their expiry. Entries are only kept until the
+ * token would have expired anyway. The common case is an empty list,
+ * which is answered without touching the lock.
+ */
+class RevocationList
+{
+  public:
+    using clock = std::chrono::system_clock;
+
+    void revoke(std::string jti, clock::time_point until)
+    {
+        std::unique_lock lock(mutex);
+        entries[std::move(jti)] = until;
+        if (entries.size() >= purge_at)
+        {
+            auto now = clock::now();
+            std::erase_if(entries,
+                          [now](const auto &e) { return e.second <= now; });
+            purge_at = std::max<std::size_t>(64, entries.size() * 2);
+        }
+        count.store(entries.size(), std::memory_order_release);
+    }
+
+    /* Parse a JWT_REVOKE_CHANNEL payload. */
+    void revoke(const char *payload, std::chrono::seconds max_ttl)
+    {
+        std::string_view p(payload);
+        auto space = p.find(' ');
+        auto until = clock::now() + max_ttl;
+        if (space != std::string_view::npos)
+        {
+            until = clock::time_point(
+                std::chrono::seconds(std::atoll(payload + space + 1)));
+        }
+        revoke(std::string(p.substr(0, space)), until);
+    }
+
+    bool revoked(const std::string &jti) const
+    {
+        if (count.load(std::memory_order_acquire) == 0)
+        {
+            return false;
+        }
+        std::shared_lock lock(mutex);
+        auto it = entries.find(jti);
+        return it != entries.end() && it->second > clock::now();
+    }
+
+    std::size_t size() const
+    {
+        return count.load(std::memory_order_relaxed);
+    }
+
+  private:
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string, clock::time_point> entries;
+    std::size_t purge_at = 64;
+    std::atomic<std::size_t> count{0};
+};
+
+/*
+ * Stateless session tokens: HS256 JWTs carrying the role and user id, so
+ * /webhook/ can answer without a database round trip. One verifier per
+ * key id is built up front and shared read-only by all request threads.
+ */
+class JwtAuth
+{
+  public:
+    using traits = jwt::traits::nlohmann_json;
+    using verifier_type = jwt::verifier<jwt::default_clock, traits>;
+
+    static constexpr const char *ISSUER = "nckd";
+    /* clock skew tolerated between the nodes, in seconds */
+    static constexpr std::size_t LEEWAY = 5;
+
+    JwtAuth(const std::vector<JwtKey> &keys, std::chrono::seconds ttl)
+        : ttl(ttl),
+          signing_kid(keys.at(0).kid),
+          signer(keys.at(0).secret)
+    {
+        for (const auto &key : keys)
+        {
+            auto v = jwt::verify<jwt::default_clock, traits>(
+                jwt::default_clock{});
+            v.allow_algorithm(jwt::algorithm::hs256(key.secret))
+                .with_issuer(ISSUER)
+                .leeway(LEEWAY);
+            verifiers.emplace(key.kid, std::move(v));
+        }
+    }
+
+    std::string issue(const AuthEntry &entry) const
+    {
+        auto now = std::chrono::system_clock::now();
+        return jwt::create<traits>()
+            .set_type("JWT")
+            .set_key_id(signing_kid)
+            .set_issuer(ISSUER)
+            .set_id(random_alnum(24))
+            .set_issued_at(now)
+            .set_expires_at(now + ttl)
+            .set_payload_claim("role", jwt::basic_claim<traits>(entry.role))
+            .set_payload_claim("uid", jwt::basic_claim<traits>(entry.uid))
+            .sign(signer);
+    }
+
+    /* nullopt for anything malformed, forged, expired or revoked. */
+    std::optional<AuthEntry> verify(const std::string &token) const
+    {
+        try
+        {
+            auto decoded = jwt::decode<traits>(token);
+            if (!decoded.has_key_id() || !decoded.has_id() ||
+                !decoded.has_expires_at())
+            {
+                return std::nullopt;
+            }
+            auto it = verifiers.find(decoded.get_key_id());
+            if (it == verifiers.end())
+            {
+                return std::nullopt;
+            }
+            std::error_code ec;
+            it->second.verify(decoded, ec);
+            if (ec || revocations.revoked(decoded.get_id()))
+            {
+                return std::nullopt;
+            }
+            return AuthEntry{decoded.get_payload_claim("role").as_string(),
+                             decoded.get_payload_claim("uid").as_string()};
+        }
+        catch (const std::exception &)
+        {
+            return std::nullopt;
+        }
+    }
+
+    /* Cheap shape check to tell JWTs from the opaque 48 char tokens. */
+    static bool looks_like_jwt(std::string_view token)
+    {
+        return std::count(token.begin(), token.end(), '.') == 2;
+    }
+
+    std::chrono::seconds lifetime() const
+    {
+        return ttl;
+    }
+
+    RevocationList revocations;
+
+  private:
+    std::chrono::seconds ttl;
+    std::string signing_kid;
+    jwt::algorithm::hs256 signer;
+    std::unordered_map<std::string, verifier_type> verifiers;
+};
+
+}  // namespace nckd
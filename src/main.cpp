@@ -1,16 +1,35 @@
 #include "utils.hpp"
+#include "token_cache.hpp"
+#include "pg_listener.hpp"
+#include "pg_executor.hpp"
+#include "pg_async.hpp"
+#include "jwt_auth.hpp"
+#include "admission.hpp"
+#include "concurrency.hpp"
+#include "token_batch.hpp"
+#include "bulk_import.hpp"
+#include "sharding.hpp"
+#include "cache_snapshot.hpp"
+#include "replica.hpp"
+#include "pg_user_store.hpp"
+#include "memory_user_store.hpp"
+#include "trace.hpp"
+#include "errors.hpp"
+#include "routes.hpp"
+#include "request_context.hpp"
 #include <boost/program_options.hpp>
+#include <csignal>
 #include <cstdio>
 #include <filesystem>
+#include <fstream>
 #include <httplib.h>
 #include <iostream>
 #include <libpq-fe.h>
 #include <spdlog/spdlog.h>
 #include <nlohmann/json.hpp>
-#include "argon2.h"
-
-#define OUT_LEN 32
-#define ENCODED_LEN 108
+#include "hash_pool.hpp"
+#include "access_log.hpp"
+#include "metrics.hpp"
 
 using json = nlohmann::json;
 
@@ -24,6 +43,57 @@ int main(int argc, const char *argv[])
     int port;
     string host;
     string database_url;
+    std::uint16_t pool_min;
+    std::uint16_t pool_max;
+    std::uint16_t pool_background;
+    int pool_acquire_timeout;
+    int pool_validate_interval;
+    size_t token_cache_size;
+    int token_cache_ttl;
+    bool token_cache_notify;
+    size_t argon2_threads;
+    size_t argon2_queue;
+    size_t argon2_memory;
+    double argon2_worker_share;
+    std::uint32_t argon2_t;
+    std::uint32_t argon2_m;
+    std::uint32_t argon2_p;
+    std::uint32_t argon2_salt_len;
+    int argon2_calibrate;
+    bool argon2_rehash;
+    size_t async_connections;
+    double access_log_sample;
+    string access_log_level;
+    bool access_log_bodies;
+    string jwt_keys;
+    int jwt_ttl;
+    bool jwt_revocation;
+    double rate_limit_ip;
+    double rate_limit_ip_burst;
+    double rate_limit_email;
+    size_t negative_cache_size;
+    int negative_cache_ttl;
+    int token_batch_window;
+    size_t token_batch_size;
+    string import_users;
+    size_t import_batch;
+    size_t shards;
+    size_t shard_threads;
+    bool pin_cpus;
+    string cache_snapshot;
+    std::vector<string> replica_urls;
+    std::vector<string> trusted_proxies;
+    std::uint16_t replica_pool_max;
+    int replica_max_lag;
+    int replica_check_interval;
+    double trace_sample;
+    int trace_slow;
+    string trace_dir;
+    double concurrency_max;
+    double concurrency_min;
+    string user_store;
+    string user_log;
+    bool user_log_sync;
     po::options_description desc("Allowed options");
     desc.add_options()("help,h", "produce help message")(
         "port,p",
@@ -36,7 +106,169 @@ int main(int argc, const char *argv[])
         po::value<string>(&database_url)
             ->default_value("user=postgres dbname=postgres password=postgres "
                             "host=127.0.0.1 port=5432"),
-        "The database config file to use.");
+        "The database config file to use.")(
+        "pool-min",
+        po::value<std::uint16_t>(&pool_min)->default_value(2),
+        "Connections opened at startup.")(
+        "pool-max",
+        po::value<std::uint16_t>(&pool_max)->default_value(8),
+        "Connections the pool may open in total.")(
+        "pool-background",
+        po::value<std::uint16_t>(&pool_background)->default_value(1),
+        "Connections kept apart from --pool-max for the token batch writer, "
+        "snapshot checks and bulk import.")(
+        "pool-acquire-timeout",
+        po::value<int>(&pool_acquire_timeout)->default_value(200),
+        "Milliseconds a request waits for a free connection.")(
+        "pool-validate-interval",
+        po::value<int>(&pool_validate_interval)->default_value(10),
+        "Seconds between probes of idle connections, 0 disables them.")(
+        "token-cache-size",
+        po::value<size_t>(&token_cache_size)->default_value(65536),
+        "Max tokens cached by /webhook/, 0 disables the cache.")(
+        "token-cache-ttl",
+        po::value<int>(&token_cache_ttl)->default_value(60),
+        "Seconds a cached token stays valid.")(
+        "token-cache-notify",
+        po::value<bool>(&token_cache_notify)->default_value(true),
+        "LISTEN for token rotations made by other nodes.")(
+        "argon2-threads",
+        po::value<size_t>(&argon2_threads)
+            ->default_value(
+                std::max(1u, std::thread::hardware_concurrency() / 2)),
+        "Threads dedicated to password hashing.")(
+        "argon2-queue",
+        po::value<size_t>(&argon2_queue)->default_value(64),
+        "Hash jobs allowed to wait before requests are refused.")(
+        "argon2-memory",
+        po::value<size_t>(&argon2_memory)->default_value(1024),
+        "MiB the hashing threads may use at once.")(
+        "argon2-worker-share",
+        po::value<double>(&argon2_worker_share)->default_value(0.5),
+        "Share of each shard's HTTP workers that may wait on password "
+        "hashing.")(
+        "argon2-t",
+        po::value<std::uint32_t>(&argon2_t)->default_value(2),
+        "Argon2 passes for new hashes.")(
+        "argon2-m",
+        po::value<std::uint32_t>(&argon2_m)->default_value(1 << 16),
+        "KiB one new hash may use.")(
+        "argon2-p",
+        po::value<std::uint32_t>(&argon2_p)->default_value(1),
+        "Argon2 lanes for new hashes.")(
+        "argon2-salt-len",
+        po::value<std::uint32_t>(&argon2_salt_len)->default_value(16),
+        "Salt bytes for new hashes, 8 to 32.")(
+        "argon2-calibrate-ms",
+        po::value<int>(&argon2_calibrate)->default_value(0),
+        "Benchmark Argon2 at startup and pick the passes, and if need be "
+        "less memory than --argon2-m, for a hash of this many ms. 0 off.")(
+        "argon2-rehash",
+        po::value<bool>(&argon2_rehash)->default_value(true),
+        "Rehash a password stored with other parameters on login.")(
+        "async-connections",
+        po::value<size_t>(&async_connections)->default_value(2),
+        "Non-blocking connections serving /webhook/, 0 uses the pool.")(
+        "access-log-sample",
+        po::value<double>(&access_log_sample)->default_value(1.0),
+        "Fraction of successful requests written to the access log.")(
+        "access-log-level",
+        po::value<string>(&access_log_level)->default_value("info"),
+        "Access log level: off, warn, info, or debug for full dumps.")(
+        "access-log-bodies",
+        po::value<bool>(&access_log_bodies)->default_value(false),
+        "Include request and response bodies in the access log.")(
+        "jwt-keys",
+        po::value<string>(&jwt_keys)->default_value(""),
+        "File of kid=secret lines; /login/ then issues signed JWTs.")(
+        "jwt-ttl",
+        po::value<int>(&jwt_ttl)->default_value(300),
+        "Seconds an issued JWT stays valid.")(
+        "jwt-revocation",
+        po::value<bool>(&jwt_revocation)->default_value(true),
+        "LISTEN for revoked JWT ids.")(
+        "rate-limit-ip",
+        po::value<double>(&rate_limit_ip)->default_value(20),
+        "Per client IP: /login/ and /register/ calls, and failed "
+        "/webhook/ calls, per second. 0 disables.")(
+        "rate-limit-ip-burst",
+        po::value<double>(&rate_limit_ip_burst)->default_value(40),
+        "Calls a client IP may make at once before being limited.")(
+        "rate-limit-email",
+        po::value<double>(&rate_limit_email)->default_value(10),
+        "/login/ attempts per email per minute, 0 disables.")(
+        "negative-cache-size",
+        po::value<size_t>(&negative_cache_size)->default_value(65536),
+        "Recently rejected tokens remembered, 0 disables.")(
+        "negative-cache-ttl",
+        po::value<int>(&negative_cache_ttl)->default_value(60),
+        "Seconds a rejected token is answered without a lookup.")(
+        "token-batch-window",
+        po::value<int>(&token_batch_window)->default_value(2000),
+        "Microseconds /login/ token writes wait to share a commit.")(
+        "token-batch-size",
+        po::value<size_t>(&token_batch_size)->default_value(128),
+        "Token writes committed together at most.")(
+        "import-users",
+        po::value<string>(&import_users)->default_value(""),
+        "Load users from an NDJSON file, - for stdin, then exit.")(
+        "import-batch",
+        po::value<size_t>(&import_batch)->default_value(1000),
+        "Users checked, hashed and copied per batch when importing.")(
+        "shards",
+        po::value<size_t>(&shards)->default_value(1),
+        "Listeners sharing the port via SO_REUSEPORT, each with its own "
+        "workers and slice of the pool.")(
+        "shard-threads",
+        po::value<size_t>(&shard_threads)->default_value(0),
+        "Worker threads per shard, 0 for the httplib default.")(
+        "pin-cpus",
+        po::value<bool>(&pin_cpus)->default_value(true),
+        "Pin each shard and its workers to one CPU when sharded.")(
+        "cache-snapshot",
+        po::value<string>(&cache_snapshot)->default_value(""),
+        "File the token cache is saved to on shutdown and restored from.")(
+        "trusted-proxy",
+        po::value<std::vector<string>>(&trusted_proxies)->composing(),
+        "Proxy whose X-Forwarded-For is believed, e.g. Hasura; may be "
+        "repeated. /webhook/ failures are only limited per client with one.")(
+        "replica-url",
+        po::value<std::vector<string>>(&replica_urls)->composing(),
+        "Read-only server for /webhook/ lookups, may be repeated.")(
+        "replica-pool-max",
+        po::value<std::uint16_t>(&replica_pool_max)->default_value(4),
+        "Connections opened per replica.")(
+        "replica-max-lag",
+        po::value<int>(&replica_max_lag)->default_value(1000),
+        "Milliseconds a replica may lag before the primary answers.")(
+        "replica-check-interval",
+        po::value<int>(&replica_check_interval)->default_value(2000),
+        "Milliseconds between replica health and lag checks.")(
+        "trace-sample",
+        po::value<double>(&trace_sample)->default_value(0),
+        "Fraction of requests traced phase by phase, see /trace.")(
+        "trace-slow-ms",
+        po::value<int>(&trace_slow)->default_value(0),
+        "Write traced requests slower than this to --trace-dir, 0 never.")(
+        "trace-dir",
+        po::value<string>(&trace_dir)->default_value("."),
+        "Directory slow request traces are written to.")(
+        "concurrency-max",
+        po::value<double>(&concurrency_max)->default_value(64),
+        "Upper bound of the adaptive in-flight request limit, 0 disables "
+        "it.")(
+        "concurrency-min",
+        po::value<double>(&concurrency_min)->default_value(4),
+        "Lower bound of the adaptive in-flight request limit.")(
+        "user-store",
+        po::value<string>(&user_store)->default_value("postgres"),
+        "Where users live: postgres, or memory for the embedded store.")(
+        "user-log",
+        po::value<string>(&user_log)->default_value("nckd-users.log"),
+        "Append-only log of the memory user store.")(
+        "user-log-sync",
+        po::value<bool>(&user_log_sync)->default_value(true),
+        "fdatasync the user log after every write.");
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
     po::notify(vm);
@@ -46,375 +278,842 @@ int main(int argc, const char *argv[])
         cout << desc << endl;
         return 0;
     }
-    auto pool = cpool::ConnectionPoolFactory<cpool::PGConnection>::create(
-        4, database_url.c_str());
-    httplib::Server svr;
+    /* 内嵌存储：不连接数据库，只保留连接池对象 */
+    bool embedded = user_store == "memory";
+    if (!embedded && user_store != "postgres")
+    {
+        SPDLOG_ERROR("unknown user store {}", user_store);
+        return -1;
+    }
+    if (embedded)
+    {
+        if (!import_users.empty() || !replica_urls.empty())
+        {
+            SPDLOG_ERROR("--import-users and --replica-url need postgres");
+            return -1;
+        }
+        pool_min = 0;
+        pool_validate_interval = 0;
+        token_cache_notify = false;
+        jwt_revocation = false;
+        async_connections = 0;
+    }
+    /* 在创建任何线程之前屏蔽，由专门的线程 sigwait 后正常关闭 */
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    cpool::PGPool::Options pool_options;
+    pool_options.min_size = pool_min;
+    pool_options.max_size = pool_max;
+    pool_options.acquire_timeout =
+        std::chrono::milliseconds(pool_acquire_timeout);
+    pool_options.validate_interval =
+        std::chrono::seconds(pool_validate_interval);
+    /*
+     * 每个分片独占一段连接池，分片之间不争用同一把锁。
+     * 余数分给前几个分片，各段加起来正好是 --pool-min 和 --pool-max
+     */
+    shards = std::max<size_t>(shards, 1);
+    if (shards > pool_max)
+    {
+        SPDLOG_ERROR("--shards {} needs --pool-max of at least {}",
+                     shards,
+                     shards);
+        return -1;
+    }
+    auto share = [&](size_t total, size_t k) {
+        return static_cast<std::uint16_t>(total / shards +
+                                          (k < total % shards ? 1 : 0));
+    };
+    std::vector<std::unique_ptr<cpool::PGPool>> pg_pools;
+    for (size_t k = 0; k < shards; ++k)
+    {
+        auto slice = pool_options;
+        slice.min_size = share(pool_min, k);
+        slice.max_size = share(pool_max, k);
+        pg_pools.push_back(std::make_unique<cpool::PGPool>(
+            database_url.c_str(), slice));
+    }
+    /*
+     * 后台写入、快照核对和批量导入使用单独的连接池，
+     * 不占用任何分片的连接，批量写入慢时也不会让请求等待连接
+     */
+    auto background_options = pool_options;
+    background_options.min_size = std::max<std::uint16_t>(pool_background, 1);
+    background_options.max_size = background_options.min_size;
+    cpool::PGPool pg_pool(database_url.c_str(), background_options);
+    auto shard_pool = [&]() -> cpool::PGPool & {
+        return *pg_pools[nckd::current_shard];
+    };
+    nckd::TokenBatchWriter::Options batch_options;
+    batch_options.window = std::chrono::microseconds(token_batch_window);
+    batch_options.max_batch = std::max<size_t>(token_batch_size, 1);
+    nckd::TokenBatchWriter token_writer(pg_pool, batch_options);
+    nckd::TokenCache token_cache(token_cache_size,
+                                 std::chrono::seconds(token_cache_ttl));
+    /* 重启后从快照预热，避免所有请求同时打到数据库；开始服务前再核对 */
+    std::vector<std::string> restored_tokens;
+    if (!cache_snapshot.empty() && token_cache.enabled())
+    {
+        nckd::load_snapshot(token_cache, cache_snapshot, &restored_tokens);
+    }
+    std::unique_ptr<nckd::PGListener> token_listener;
+    if (token_cache.enabled() && token_cache_notify)
+    {
+        token_listener = std::make_unique<nckd::PGListener>(
+            database_url,
+            nckd::TOKEN_INVALIDATE_CHANNEL,
+            [&](const char *token) { token_cache.erase(token); },
+            /* rotations missed while disconnected */
+            [&] { token_cache.clear(); });
+        token_listener->start();
+    }
+    /* JWT 模式：/webhook/ 不再查询数据库 */
+    std::unique_ptr<nckd::JwtAuth> jwt_auth;
+    std::unique_ptr<nckd::PGListener> revocation_listener;
+    if (!jwt_keys.empty())
+    {
+        auto keys = nckd::load_jwt_keys(jwt_keys);
+        if (keys.empty())
+        {
+            SPDLOG_ERROR("no keys found in {}", jwt_keys);
+            return -1;
+        }
+        jwt_auth = std::make_unique<nckd::JwtAuth>(
+            keys, std::chrono::seconds(jwt_ttl));
+        if (jwt_revocation)
+        {
+            revocation_listener = std::make_unique<nckd::PGListener>(
+                database_url,
+                nckd::JWT_REVOKE_CHANNEL,
+                [&](const char *payload) {
+                    jwt_auth->revocations.revoke(payload,
+                                                 jwt_auth->lifetime());
+                });
+            revocation_listener->start();
+        }
+    }
+    /* 准入控制：在占用连接池和 Argon2 之前拒绝滥用请求 */
+    nckd::RateLimiter credential_limiter(rate_limit_ip, rate_limit_ip_burst);
+    nckd::RateLimiter webhook_failures(rate_limit_ip, rate_limit_ip_burst);
+    nckd::RateLimiter email_limiter(rate_limit_email / 60.0,
+                                    rate_limit_email);
+    nckd::NegativeCache negative_tokens(
+        negative_cache_size, std::chrono::seconds(negative_cache_ttl));
+    /* 自适应并发上限：/webhook/ 优先，/register/ 最先被拒绝 */
+    nckd::ConcurrencyLimiter::Options concurrency_options;
+    concurrency_options.max_limit = concurrency_max;
+    concurrency_options.min_limit =
+        std::min(std::max(concurrency_min, 1.0), concurrency_max);
+    nckd::ConcurrencyLimiter concurrency(concurrency_options);
+    /*
+     * 限流按客户端地址：经可信代理转发的请求取 X-Forwarded-For 里的地址。
+     * /webhook/ 只由 Hasura 调用，不配置 --trusted-proxy 时不按地址限制失败，
+     * 否则一个用户的坏 token 会让经 Hasura 的全部请求被拒绝，只靠 negative_tokens
+     */
+    auto client_of = [&](const Request &req) {
+        return nckd::client_address(
+            req.remote_addr,
+            nckd::request_context.header(nckd::Header::XForwardedFor),
+            trusted_proxies);
+    };
+    auto webhook_client = [&](const Request &req) {
+        return trusted_proxies.empty() ? std::string_view() : client_of(req);
+    };
+    auto reject_token = [&](const Request &req, std::string_view token) {
+        negative_tokens.insert(token);
+        if (auto client = webhook_client(req); !client.empty())
+        {
+            webhook_failures.allow(client);
+        }
+        // 错误码：业务错误为10 03 XX token 错误
+        return nckd::ErrorCode::BadToken;
+    };
+    /* 先于 hash_pool 声明：后台重新哈希的任务在 hash_pool 析构时仍会写入 */
+    std::unique_ptr<nckd::UserStore> store;
+    nckd::Argon2Params argon2_params;
+    argon2_params.t_cost = std::max(argon2_t, 1u);
+    argon2_params.m_cost = argon2_m;
+    argon2_params.parallelism = std::max(argon2_p, 1u);
+    argon2_params.salt_len = std::clamp(argon2_salt_len, 8u, 32u);
+    /* 按本机速度选择 Argon2 参数，不需要重新编译 */
+    if (argon2_calibrate > 0)
+    {
+        argon2_params = nckd::calibrate_argon2(
+            std::chrono::milliseconds(argon2_calibrate), argon2_params);
+    }
+    SPDLOG_INFO("argon2id t={} m={} KiB p={} salt={}",
+                argon2_params.t_cost,
+                argon2_params.m_cost,
+                argon2_params.parallelism,
+                argon2_params.salt_len);
+    nckd::ShardedServer::Options server_options;
+    server_options.shards = shards;
+    server_options.threads = shard_threads;
+    server_options.pin = shards > 1 && pin_cpus;
+    /*
+     * 登录和注册在等待哈希结果时占用一个 HTTP 工作线程。每个分片排队和计算
+     * 中的任务合计不超过该分片工作线程的 argon2_worker_share，其余线程留给
+     * /webhook/；后台重新哈希不占工作线程，不计入
+     */
+    auto http_workers =
+        nckd::ShardedServer::worker_threads(server_options) / shards;
+    auto argon2_jobs = std::max<std::size_t>(
+        1,
+        static_cast<std::size_t>(std::clamp(argon2_worker_share, 0.0, 1.0) *
+                                 http_workers));
+    SPDLOG_INFO("argon2 jobs capped at {} of {} http workers per shard",
+                argon2_jobs,
+                http_workers);
+    nckd::HashPool hash_pool(argon2_threads,
+                             argon2_queue,
+                             argon2_memory * 1024,
+                             argon2_params,
+                             argon2_jobs,
+                             shards);
+    /* 批量导入模式：逐行报告被拒绝的用户，完成后退出 */
+    if (!import_users.empty())
+    {
+        /* 导入期间 Ctrl-C 直接终止 */
+        pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
+        std::ifstream file;
+        if (import_users != "-")
+        {
+            file.open(import_users);
+            if (!file)
+            {
+                SPDLOG_ERROR("can not open {}", import_users);
+                return -1;
+            }
+        }
+        auto connection = pg_pool.acquire(std::chrono::seconds(30));
+        if (!connection)
+        {
+            SPDLOG_ERROR("no database connection for the import");
+            return -1;
+        }
+        nckd::BulkImporter importer(
+            *connection, hash_pool, std::cout, import_batch);
+        auto stats = importer.run(import_users == "-" ? std::cin : file);
+        SPDLOG_INFO("imported {}, duplicates {}, invalid {}, failed {}",
+                    stats.imported,
+                    stats.duplicates,
+                    stats.invalid,
+                    stats.failed);
+        return stats.failed == 0 ? 0 : 1;
+    }
+    std::unique_ptr<nckd::AsyncPGEngine> async_engine;
+    if (async_connections > 0)
+    {
+        /* 与连接池相同的等待上限，超时按繁忙处理 */
+        nckd::AsyncPGEngine::Options engine_options;
+        engine_options.timeout = pool_options.acquire_timeout;
+        async_engine = std::make_unique<nckd::AsyncPGEngine>(
+            database_url, async_connections, engine_options);
+        if (!async_engine->start())
+        {
+            SPDLOG_WARN("async engine unavailable, /webhook/ uses the pool");
+            async_engine.reset();
+        }
+    }
+    /* 只读查询分流到从库，主库只承担写入 */
+    nckd::ReplicaRouter::Options replica_options;
+    replica_options.pool = pool_options;
+    replica_options.pool.min_size = std::min(pool_min, replica_pool_max);
+    replica_options.pool.max_size = replica_pool_max;
+    replica_options.async_connections = async_connections;
+    replica_options.max_lag = std::chrono::milliseconds(replica_max_lag);
+    replica_options.check_interval =
+        std::chrono::milliseconds(replica_check_interval);
+    nckd::ReplicaRouter replicas(replica_urls, replica_options);
+    if (embedded)
+    {
+        nckd::MemoryUserStore::Options store_options;
+        store_options.path = user_log;
+        store_options.sync = user_log_sync;
+        auto memory = std::make_unique<nckd::MemoryUserStore>(store_options);
+        if (!memory->open())
+        {
+            return -1;
+        }
+        store = std::move(memory);
+    }
+    else
+    {
+        store = std::make_unique<nckd::PGUserStore>(
+            shard_pool, async_engine.get(), replicas, token_writer);
+    }
+    /*
+     * 快照里可能有停机期间已轮换或撤销的 token：监听已经启动，
+     * 这里按批查询一次数据库，删除不再有效的条目
+     */
+    nckd::revalidate_snapshot(
+        token_cache,
+        restored_tokens,
+        [&](const std::vector<std::string_view> &batch,
+            std::unordered_map<std::string, nckd::AuthEntry> &live) {
+            if (embedded)
+            {
+                for (auto token : batch)
+                {
+                    nckd::AuthEntry entry;
+                    bool from_replica = false;
+                    if (store->find_by_token(token, entry, from_replica) ==
+                        nckd::StoreStatus::Ok)
+                    {
+                        live.emplace(token, std::move(entry));
+                    }
+                }
+                return true;
+            }
+            auto connection = pg_pool.acquire();
+            if (!connection)
+            {
+                return false;
+            }
+            auto tokens = nckd::pg_array_literal(batch);
+            auto res = nckd::PGExecutor(*connection)
+                           .run(cpool::Stmt::FindTokens, {tokens.c_str()});
+            if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+            {
+                return false;
+            }
+            for (int k = 0; k < PQntuples(res.get()); ++k)
+            {
+                live.emplace(PQgetvalue(res.get(), k, 0),
+                             nckd::AuthEntry{PQgetvalue(res.get(), k, 1),
+                                             PQgetvalue(res.get(), k, 2)});
+            }
+            return true;
+        });
+    restored_tokens.clear();
+    restored_tokens.shrink_to_fit();
+    /* 存储层状态转换为错误码：busy 为取不到连接或队列已满，error 为查询失败 */
+    auto check =
+        [](nckd::StoreStatus status,
+           nckd::ErrorCode busy = nckd::ErrorCode::DbBusy,
+           nckd::ErrorCode error =
+               nckd::ErrorCode::DbQuery) -> nckd::Expected<nckd::StoreStatus> {
+        switch (status)
+        {
+        case nckd::StoreStatus::Busy:
+            return busy;
+        case nckd::StoreStatus::Error:
+            // 错误码：数据库连接为10 01 XX
+            return error;
+        default:
+            return status;
+        }
+    };
+    /* 拒绝请求：状态码和响应体都是预先生成的，不抛异常也不格式化 */
+    auto reject = [](Response &res, nckd::ErrorCode code) {
+        const auto &response = nckd::error_response(code);
+        nckd::error_counter(code).add();
+        res.status = response.status;
+        if (response.status == 429 || response.status == 503)
+        {
+            res.set_header("Retry-After", "1");
+        }
+        if (!response.body.empty())
+        {
+            res.set_content(response.body.data(),
+                            response.body.size(),
+                            "application/json");
+        }
+    };
+    auto respond = [&](Response &res, nckd::Expected<std::string> content) {
+        if (content)
+        {
+            res.set_content(std::move(*content), "application/json");
+        }
+        else
+        {
+            reject(res, content.error());
+        }
+    };
+    nckd::Tracer::Options trace_options;
+    trace_options.sample_rate = trace_sample;
+    trace_options.slow = std::chrono::milliseconds(trace_slow);
+    trace_options.slow_dir = trace_dir;
+    nckd::tracer().configure(trace_options);
+    nckd::AccessLogOptions access_log_options;
+    access_log_options.sample_rate = access_log_sample;
+    access_log_options.level = spdlog::level::from_str(access_log_level);
+    access_log_options.log_bodies = access_log_bodies;
+    nckd::AccessLog access_log(access_log_options);
+    nckd::ShardedServer svr(server_options);
 
     if (!svr.is_valid())
     {
         SPDLOG_INFO("server has an error...\n");
         return -1;
     }
+    /*
+     * 静态路由表：GET 请求在路由前查表直接处理，不走 httplib 的正则匹配。
+     * POST 的请求体在路由前还没有读取，仍由 httplib 路由；HEAD 也交给它。
+     */
+    std::array<Server::Handler, nckd::ROUTE_TABLE.size()> static_handlers;
+    auto serve = [&](nckd::Endpoint endpoint, Server::Handler handler) {
+        auto k = static_cast<std::size_t>(endpoint);
+        const auto &spec = nckd::ROUTE_TABLE[k];
+        if (spec.method == "GET")
+        {
+            static_handlers[k] = handler;
+            svr.Get(std::string(spec.path), std::move(handler));
+        }
+        else
+        {
+            svr.Post(std::string(spec.path), std::move(handler));
+        }
+    };
 
-    svr.Get("/webhook/", [&](const auto &req, auto &ret) {
-        auto headers = req.headers;
-        auto token = "";
-        for (auto it = headers.begin(); it != headers.end(); ++it)
+    /* 响应体在请求的内存池里拼接，命中缓存时整个处理过程不分配堆内存 */
+    auto hasura = [](std::string_view role, std::string_view uid) {
+        return nckd::request_context.arena.concat({"{\"X-Hasura-Role\": \"",
+                                                   role,
+                                                   "\", ",
+                                                   "\"X-Hasura-User-Id\": \"",
+                                                   uid,
+                                                   "\"}"});
+    };
+    auto webhook =
+        [&](const Request &req) -> nckd::Expected<std::string_view> {
+        auto token =
+            nckd::request_context.header(nckd::Header::Authorization);
+        if (jwt_auth && nckd::JwtAuth::looks_like_jwt(token))
         {
-            const auto &x = *it;
-            if (x.first == "authorization")
+            auto claims = jwt_auth->verify(std::string(token));
+            if (!claims)
             {
-                token = x.second.c_str();
+                return reject_token(req, token);
             }
+            return hasura(claims->role, claims->uid);
         }
-        if (strlen(token) == 48)
+        else if (token.size() == nckd::TOKEN_LENGTH)
         {
-            auto connection = pool->get_connection();
-            if (!connection.valid())
+            if (auto hit = token_cache.get(token))
             {
-                // 错误码：数据库连接为10 01 XX
-                throw std::runtime_error("100101");
+                return hasura(hit->role, hit->uid);
             }
-            auto &pg_conn = dynamic_cast<PGConnection &>(*connection);
-            auto conn = pg_conn.acquire();
-            PGresult *res;
-            /* 开始一个事务块 */
-            res = PQexec(conn, "BEGIN");
-            if (PQresultStatus(res) != PGRES_COMMAND_OK)
+            auto cache_epoch = token_cache.epoch(token);
+            nckd::AuthEntry found;
+            bool replica = false;
+            auto status = check(store->find_by_token(token, found, replica));
+            if (!status)
             {
-                fprintf(stderr,
-                        "BEGIN command failed: %s",
-                        PQerrorMessage(conn));
-                PQclear(res);
-                /* 结束事务 */
-                res = PQexec(conn, "END");
-                pool->release_connection(std::move(connection));
-                // 错误码：数据库连接为10 01 XX
-                throw std::runtime_error("100102");
+                return status.error();
             }
-            PQclear(res);
-            const char *paramValues[1];
-            paramValues[0] = token;
-            res = PQexecParams(conn,
-                               "SELECT role, id FROM users WHERE token=$1;",
-                               1,    /* one param */
-                               NULL, /* let the backend deduce param type */
-                               paramValues,
-                               NULL, /* don't need param lengths since text */
-                               NULL, /* default to all text params */
-                               0);
-            if (PQresultStatus(res) != PGRES_TUPLES_OK)
+            if (*status != nckd::StoreStatus::Ok)
             {
-                fprintf(stderr, "FETCH ALL failed: %s", PQerrorMessage(conn));
-                PQclear(res);
-                /* 结束事务 */
-                res = PQexec(conn, "END");
-                pool->release_connection(std::move(connection));
-                // 错误码：数据库连接为10 01 XX
-                throw std::runtime_error("100103");
+                return reject_token(req, token);
             }
-            if (PQntuples(res) != 1)
+            if (!replica)
+            {
+                token_cache.put(token, found, cache_epoch);
+            }
+            else
             {
-                PQclear(res);
-                /* 结束事务 */
-                res = PQexec(conn, "END");
-                pool->release_connection(std::move(connection));
-                // 错误码：业务错误为10 03 XX token 错误
-                throw std::runtime_error("100305");
+                /*
+                 * 副本可能还没应用主库已经通知的 token 轮换，缓存的旧 token
+                 * 最多再有效 replica_max_lag 毫秒，不是整个 token_cache_ttl
+                 */
+                token_cache.put_until(
+                    token,
+                    found,
+                    nckd::TokenCache::clock::now() +
+                        std::min<std::chrono::milliseconds>(
+                            std::chrono::milliseconds(replica_max_lag),
+                            std::chrono::seconds(token_cache_ttl)),
+                    cache_epoch);
             }
-            auto role = std::string(PQgetvalue(res, 0, 0));
-            auto uid = std::string(PQgetvalue(res, 0, 1));
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
-            std::string content = "{\"X-Hasura-Role\": \"";
-            content.append(role).append("\", ");
-            content.append("\"X-Hasura-User-Id\": \"");
-            content.append(uid).append("\"}");
-            ret.set_content(content, "application/json");
+            return hasura(found.role, found.uid);
         }
         else
         {
-            std::string content = "{\"X-Hasura-Role\": \"anoymous\",";
-            content.append("\"X-Hasura-User-Id\": \"0\"}");
-            ret.set_content(content, "application/json");
+            return std::string_view("{\"X-Hasura-Role\": \"anoymous\","
+                                    "\"X-Hasura-User-Id\": \"0\"}");
         }
+    };
+    serve(nckd::Endpoint::Webhook, [&](const Request &req, Response &res) {
+        auto content = webhook(req);
+        if (!content)
+        {
+            reject(res, content.error());
+            return;
+        }
+        static const std::string json_type = "application/json";
+        res.set_content(content->data(), content->size(), json_type);
     });
 
-    svr.Post("/login/", [&](const auto &req, auto &ret) {
-        auto req_json = json::parse(req.body);
-        std::string email = req_json["email"];
-        if (!is_valid(email))
+    /* 请求体不是 JSON 时得到 discarded 值，不抛异常 */
+    auto parse_body = [](const Request &req) {
+        TRACE_SPAN("json_parse");
+        return json::parse(req.body, nullptr, false);
+    };
+    /* 字段缺失或不是字符串时返回 false */
+    auto field = [](const json &body, const char *key, std::string &out) {
+        auto it = body.find(key);
+        if (it == body.end() || !it->is_string())
+        {
+            return false;
+        }
+        out = it->get_ref<const std::string &>();
+        return true;
+    };
+    auto login = [&](const Request &req) -> nckd::Expected<std::string> {
+        auto req_json = parse_body(req);
+        std::string email;
+        if (!field(req_json, "email", email) || !is_valid(email))
         {
             // 错误码：参数错误为10 02 XX
-            throw std::runtime_error("100201");
+            return nckd::ErrorCode::BadEmail;
         }
-        std::string passwd = req_json["password"];
-        if (passwd.length() < 6)
+        std::string passwd;
+        if (!field(req_json, "password", passwd) || passwd.length() < 6)
         {
             // 错误码：参数错误为10 02 XX
-            throw std::runtime_error("100202");
+            return nckd::ErrorCode::BadPassword;
         }
-        auto connection = pool->get_connection();
-        if (!connection.valid())
+        if (!email_limiter.allow(email))
         {
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100101");
-        }
-        auto &pg_conn = dynamic_cast<PGConnection &>(*connection);
-        auto conn = pg_conn.acquire();
-        PGresult *res;
-        /* 开始一个事务块 */
-        res = PQexec(conn, "BEGIN");
-        if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        {
-            fprintf(stderr, "BEGIN command failed: %s", PQerrorMessage(conn));
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100102");
-        }
-        PQclear(res);
-        const char *paramValues[1];
-        paramValues[0] = email.c_str();
-        res = PQexecParams(conn,
-                           "SELECT password, id FROM users WHERE email=$1;",
-                           1,    /* one param */
-                           NULL, /* let the backend deduce param type */
-                           paramValues,
-                           NULL, /* don't need param lengths since text */
-                           NULL, /* default to all text params */
-                           0);
-        if (PQresultStatus(res) != PGRES_TUPLES_OK)
-        {
-            fprintf(stderr, "FETCH ALL failed: %s", PQerrorMessage(conn));
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100103");
+            // 错误码：服务繁忙为10 04 XX 尝试过于频繁
+            return nckd::ErrorCode::TooManyAttempts;
+        }
+        nckd::UserRecord user;
+        auto found = check(store->find_by_email(email, user));
+        if (!found)
+        {
+            return found.error();
         }
-        if (PQntuples(res) != 1)
+        if (*found != nckd::StoreStatus::Ok)
         {
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
             // 错误码：业务错误为10 03 XX
-            throw std::runtime_error("100301");
+            return nckd::ErrorCode::UnknownUser;
         }
-        auto pass = std::string(PQgetvalue(res, 0, 0));
-        auto uid = std::string(PQgetvalue(res, 0, 1));
+        auto &pass = user.password;
+        auto &uid = user.id;
+        auto &old_token = user.token;
 
-        if (argon2_verify(pass.c_str(),
-                          passwd.c_str(),
-                          strlen(passwd.c_str()),
-                          Argon2_id) != ARGON2_OK)
-        {
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
+        auto verified = hash_pool.verify(pass, passwd, nckd::current_shard);
+        if (!verified)
+        {
+            // 错误码：服务繁忙为10 04 XX
+            return nckd::ErrorCode::Busy;
+        }
+        int verify_code;
+        {
+            TRACE_SPAN("argon2_wait");
+            verify_code = verified->get();
+        }
+        if (verify_code != ARGON2_OK)
+        {
             // 错误码：业务错误为10 03 XX 密码错误
-            throw std::runtime_error("100302");
-        }
-        PQclear(res);
-        auto token = random_string(48);
-        const char *paramValues2[2];
-        paramValues2[0] = token.c_str();
-        paramValues2[1] = uid.c_str();
-        res = PQexecParams(conn,
-                           "update users set token=$1 where id=$2;",
-                           2,    /* one param */
-                           NULL, /* let the backend deduce param type */
-                           paramValues2,
-                           NULL, /* don't need param lengths since text */
-                           NULL, /* default to all text params */
-                           0);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        {
-            fprintf(stderr, "FETCH ALL failed: %s", PQerrorMessage(conn));
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100103");
+            return nckd::ErrorCode::WrongPassword;
         }
-        else
+        /* 参数变化后的旧哈希：Argon2 队列空闲时在后台重新计算并写回 */
+        if (argon2_rehash && hash_pool.queued() == 0 &&
+            nckd::needs_rehash(pass, hash_pool.parameters()))
+        {
+            hash_pool.try_submit([&store, &hash_pool, uid, passwd, pass] {
+                auto rehashed = hash_pool.compute(
+                    passwd,
+                    random_string(hash_pool.parameters().salt_len));
+                if (rehashed.code == ARGON2_OK &&
+                    store->update_password(uid, rehashed.encoded, pass) ==
+                        nckd::StoreStatus::Ok)
+                {
+                    nckd::metrics().argon2_rehashes.add();
+                }
+            });
+        }
+        if (jwt_auth)
+        {
+            /* 签发 JWT，无需写回数据库 */
+            std::string content = "{\"code\":\"0\", \"data\": {\"token\": \"";
+            content.append(jwt_auth->issue({user.role, uid})).append("\"}}");
+            return content;
+        }
+        /* 线程本地缓冲的随机源，生成 token 不需要系统调用和内存分配 */
+        char token[nckd::TOKEN_LENGTH + 1] = {};
+        nckd::random_alnum(token, nckd::TOKEN_LENGTH);
+        // 错误码：服务繁忙为10 04 XX
+        auto written = check(store->set_token(uid, token, old_token),
+                             nckd::ErrorCode::Busy);
+        if (!written)
+        {
+            return written.error();
+        }
+        if (!old_token.empty())
         {
-            std::cout << "Update counts: " << PQcmdTuples(res) << std::endl;
+            token_cache.erase(old_token);
         }
-        /* 结束事务 */
-        res = PQexec(conn, "END");
-        pool->release_connection(std::move(connection));
 
         std::string content = "{\"code\":\"0\", \"data\": {\"token\": \"";
         content.append(token).append("\"}}");
-        ret.set_content(content, "application/json");
+        return content;
+    };
+    serve(nckd::Endpoint::Login, [&](const Request &req, Response &res) {
+        respond(res, login(req));
     });
-    svr.Post("/register/", [&](const auto &req, auto &ret) {
-        auto sql = "select * from users where email=$1;";
-        auto req_json = json::parse(req.body);
-        std::string email = req_json["email"];
-        if (!is_valid(email))
+    auto register_user =
+        [&](const Request &req) -> nckd::Expected<std::string> {
+        auto req_json = parse_body(req);
+        std::string email;
+        if (!field(req_json, "email", email) || !is_valid(email))
         {
             // 错误码：参数错误为10 02 XX
-            throw std::runtime_error("100201");
+            return nckd::ErrorCode::BadEmail;
         }
-        std::string passwd = req_json["password"];
-        if (passwd.length() < 6)
+        std::string passwd;
+        if (!field(req_json, "password", passwd) || passwd.length() < 6)
         {
             // 错误码：参数错误为10 02 XX
-            throw std::runtime_error("100202");
+            return nckd::ErrorCode::BadPassword;
         }
-        auto connection = pool->get_connection();
-        if (!connection.valid())
+        auto taken = check(store->email_exists(email),
+                           nckd::ErrorCode::DbBusy,
+                           nckd::ErrorCode::DbBusy);
+        if (!taken)
         {
-            pool->release_connection(std::move(connection));
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100101");
-        }
-        auto &pg_conn = dynamic_cast<PGConnection &>(*connection);
-        auto conn = pg_conn.acquire();
-        PGresult *res;
-        /* 开始一个事务块 */
-        res = PQexec(conn, "BEGIN");
-        if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        {
-            fprintf(stderr, "BEGIN command failed: %s", PQerrorMessage(conn));
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100101");
-        }
-        PQclear(res);
-        const char *paramValues[1];
-        paramValues[0] = email.c_str();
-        res = PQexecParams(conn,
-                           sql,
-                           1,    /* one param */
-                           NULL, /* let the backend deduce param type */
-                           paramValues,
-                           NULL, /* don't need param lengths since text */
-                           NULL, /* default to all text params */
-                           0);
-        if (PQresultStatus(res) != PGRES_TUPLES_OK)
-        {
-            fprintf(stderr, "FETCH ALL failed: %s", PQerrorMessage(conn));
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100101");
+            return taken.error();
         }
-        if (PQntuples(res) > 0)
+        if (*taken == nckd::StoreStatus::Ok)
         {
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
             // 错误码：业务错误为10 03 XX 邮件地址重复
-            throw std::runtime_error("100303");
+            return nckd::ErrorCode::EmailTaken;
         }
-        unsigned char out[OUT_LEN];
-        unsigned char hex_out[OUT_LEN * 2 + 4];
-        char encoded[ENCODED_LEN];
-        int hash_ret;
-        auto salt = random_string(8);
+        auto salt = random_string(hash_pool.parameters().salt_len);
 
-        SPDLOG_INFO(salt);
-        SPDLOG_INFO(passwd);
-        hash_ret = argon2_hash(2,
-                               1 << 16,
-                               1,
-                               passwd.c_str(),
-                               strlen(passwd.c_str()),
-                               salt.c_str(),
-                               8,
-                               out,
-                               OUT_LEN,
-                               encoded,
-                               ENCODED_LEN,
-                               Argon2_id,
-                               ARGON2_VERSION_10);
-        if (hash_ret != ARGON2_OK)
-        {
-            SPDLOG_INFO(hash_ret);
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
+        auto hashed = hash_pool.hash(passwd, salt, nckd::current_shard);
+        if (!hashed)
+        {
+            // 错误码：服务繁忙为10 04 XX
+            return nckd::ErrorCode::Busy;
+        }
+        nckd::HashResult hash_ret;
+        {
+            TRACE_SPAN("argon2_wait");
+            hash_ret = hashed->get();
+        }
+        if (hash_ret.code != ARGON2_OK)
+        {
+            SPDLOG_INFO(hash_ret.code);
             // 错误码：业务错误为10 03 XX 密码不合规范
-            throw std::runtime_error("100304");
-        }
-        const char *paramValues2[] = {email.c_str(), encoded};
-        res =
-            PQexecParams(conn,
-                         "insert into users (email, password) values ($1, $2);",
-                         2,    /* one param */
-                         NULL, /* let the backend deduce param type */
-                         paramValues2,
-                         NULL, /* don't need param lengths since text */
-                         NULL, /* default to all text params */
-                         0);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        {
-            fprintf(stderr, "BEGIN command failed: %s", PQerrorMessage(conn));
-            PQclear(res);
-            /* 结束事务 */
-            res = PQexec(conn, "END");
-            pool->release_connection(std::move(connection));
-            // 错误码：数据库连接为10 01 XX
-            throw std::runtime_error("100101");
+            return nckd::ErrorCode::WeakPassword;
+        }
+        auto inserted = check(store->insert_user(email, hash_ret.encoded),
+                              nckd::ErrorCode::DbBusy,
+                              nckd::ErrorCode::DbBusy);
+        if (!inserted)
+        {
+            return inserted.error();
+        }
+        if (*inserted == nckd::StoreStatus::Exists)
+        {
+            // 错误码：业务错误为10 03 XX 邮件地址重复
+            return nckd::ErrorCode::EmailTaken;
         }
-        PQclear(res);
-        /* 结束事务 */
-        res = PQexec(conn, "END");
-        pool->release_connection(std::move(connection));
         std::string content = "{\"code\": 0, \"msg\": \"注册成功\"}";
-        ret.set_content(content, "application/json");
+        return content;
+    };
+    serve(nckd::Endpoint::Register, [&](const Request &req, Response &res) {
+        respond(res, register_user(req));
+    });
+
+    serve(nckd::Endpoint::Metrics, [&](const Request & /*req*/, Response &res) {
+        std::vector<const char *> statements;
+        for (const auto &s : cpool::PG_STATEMENTS)
+        {
+            statements.push_back(s.name);
+        }
+        std::vector<const char *> endpoints;
+        for (std::size_t k = 0; k < nckd::ROUTE_TABLE.size(); ++k)
+        {
+            endpoints.push_back(nckd::ROUTE_TABLE[k].name);
+        }
+        size_t pool_size = pg_pool.size();
+        size_t pool_in_use = pg_pool.size_in_use();
+        for (const auto &pool : pg_pools)
+        {
+            pool_size += pool->size();
+            pool_in_use += pool->size_in_use();
+        }
+        auto body = nckd::render_metrics(
+            nckd::metrics(),
+            statements,
+            {{"nckd_pool_connections", double(pool_size)},
+             {"nckd_pool_connections_in_use", double(pool_in_use)},
+             {"nckd_argon2_queue_depth", double(hash_pool.queued())},
+             {"nckd_argon2_in_flight", double(hash_pool.in_flight())},
+             {"nckd_token_cache_entries", double(token_cache.size())},
+             {"nckd_token_batch_queue", double(token_writer.queued())},
+             {"nckd_replicas_healthy", double(replicas.healthy())},
+             {"nckd_concurrency_limit", concurrency.limit()},
+             {"nckd_concurrency_in_flight", double(concurrency.active())},
+             {"nckd_replica_connections_in_use",
+              double(replicas.size_in_use())}},
+            endpoints);
+        res.set_content(body, "text/plain; version=0.0.4");
+    });
+
+    /* 最近采样请求的各阶段耗时，可直接导入 Perfetto */
+    serve(nckd::Endpoint::Trace, [&](const Request & /*req*/, Response &res) {
+        res.set_content(nckd::tracer().dump(), "application/json");
     });
 
-    svr.Get("/stop",
-            [&](const Request & /*req*/, Response & /*res*/) { svr.stop(); });
+    auto save_cache = [&] {
+        if (!cache_snapshot.empty() && token_cache.enabled())
+        {
+            nckd::save_snapshot(token_cache, cache_snapshot);
+        }
+    };
+    serve(nckd::Endpoint::Stop, [&](const Request & /*req*/, Response & /*res*/) {
+        save_cache();
+        svr.stop();
+    });
 
     svr.set_error_handler([](const Request & /*req*/, Response &res) {
         const char *fmt =
             "<p>Error Status: <span style='color:red;'>%d</span></p>";
         char buf[BUFSIZ];
-        std::cout << res.status << endl;
+        SPDLOG_DEBUG("error status {}", res.status);
         snprintf(buf, sizeof(buf), fmt, res.status);
         res.set_content(buf, "text/html");
     });
 
+    /* 业务错误由处理函数直接返回，这里只剩意料之外的异常 */
     svr.set_exception_handler(
-        [](const auto &req, auto &res, std::exception &e) {
-            SPDLOG_INFO(e.what());
-            if (!std::string(e.what()).compare("100305"))
+        [](const auto & /*req*/, auto &res, std::exception &e) {
+            SPDLOG_ERROR(e.what());
+            nckd::metrics().errors_for("other").add();
+            res.status = 500;
+        });
+    /* 请求耗时：路由前记录开始时间，日志回调里统计 */
+    static thread_local std::chrono::steady_clock::time_point request_start;
+    static thread_local nckd::ConcurrencyLimiter::Permit permit;
+    /* 超过并发上限立即返回 503，不在连接池或 Argon2 队列里排队 */
+    auto admit = [&](nckd::Route route, Response &res) {
+        /* 上一个请求没有走到日志回调时，在这里归还名额 */
+        permit.release();
+        if (!concurrency.enabled())
+        {
+            return true;
+        }
+        auto priority = route == nckd::Route::Webhook ? nckd::Priority::High
+                        : route == nckd::Route::Login ? nckd::Priority::Normal
+                                                      : nckd::Priority::Low;
+        permit = concurrency.try_acquire(priority, route);
+        if (permit)
+        {
+            return true;
+        }
+        reject(res, nckd::ErrorCode::Overloaded);
+        return false;
+    };
+    svr.set_pre_routing_handler([&](const Request &req, Response &res) {
+        request_start = std::chrono::steady_clock::now();
+        nckd::tracer().begin_request();
+        nckd::request_context.begin(req.headers);
+        auto endpoint = nckd::ROUTE_TABLE.find(req.method, req.path);
+        if (endpoint == nckd::ROUTE_TABLE.NONE)
+        {
+            nckd::metrics().route_fallbacks.add();
+            return Server::HandlerResponse::Unhandled;
+        }
+        nckd::metrics().route_matches[endpoint].add();
+        /* /webhook/ 只限制失败的请求 */
+        auto route = nckd::ROUTE_TABLE[endpoint].route;
+        switch (route)
+        {
+        case nckd::Route::Webhook: {
+            auto client = webhook_client(req);
+            if (!client.empty() && webhook_failures.blocked(client))
             {
-                res.status = 401;
+                reject(res, nckd::ErrorCode::TooManyAttempts);
+                return Server::HandlerResponse::Handled;
             }
-            else
+            auto token =
+                nckd::request_context.header(nckd::Header::Authorization);
+            if (!token.empty() && negative_tokens.contains(token))
             {
-                res.status = 200;
-                std::string content = "{\"code\": ";
-                content.append(std::string(e.what()));
-                content.append("}");
-                res.set_content(content, "application/json");
+                reject(res, nckd::ErrorCode::BadToken);
+                return Server::HandlerResponse::Handled;
             }
-        });
-    svr.set_logger([](const Request &req, const Response &res) {
-        printf("%s", log(req, res).c_str());
+            if (!admit(route, res))
+            {
+                return Server::HandlerResponse::Handled;
+            }
+            break;
+        }
+        case nckd::Route::Login:
+        case nckd::Route::Register: {
+            /* 可信代理没有转发客户端地址时按代理限流 */
+            auto client = client_of(req);
+            if (!credential_limiter.allow(
+                    client.empty() ? std::string_view(req.remote_addr)
+                                   : client))
+            {
+                reject(res, nckd::ErrorCode::TooManyAttempts);
+                return Server::HandlerResponse::Handled;
+            }
+            if (!admit(route, res))
+            {
+                return Server::HandlerResponse::Handled;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        if (!static_handlers[endpoint])
+        {
+            return Server::HandlerResponse::Unhandled;
+        }
+        static_handlers[endpoint](req, res);
+        return Server::HandlerResponse::Handled;
+    });
+    svr.set_logger([&](const Request &req, const Response &res) {
+        auto route = static_cast<std::size_t>(nckd::endpoint_route(
+            nckd::ROUTE_TABLE.find(req.method, req.path)));
+        permit.complete(res.status >= 500);
+        auto &m = nckd::metrics();
+        m.requests[route].add();
+        m.latency[route].observe(std::chrono::steady_clock::now() -
+                                 request_start);
+        {
+            TRACE_SPAN("access_log");
+            access_log.record(req, res);
+        }
+        nckd::tracer().end_request(nckd::ROUTE_NAMES[route]);
     });
 
-    svr.listen(host.c_str(), port);
+    std::thread signal_waiter([&] {
+        int sig = 0;
+        sigwait(&stop_signals, &sig);
+        svr.stop();
+    });
+    if (!svr.listen(host, port))
+    {
+        SPDLOG_ERROR("could not listen on {}:{}", host, port);
+    }
+    /* 通过 /stop 退出时唤醒等待信号的线程 */
+    pthread_kill(signal_waiter.native_handle(), SIGTERM);
+    signal_waiter.join();
+    save_cache();
+    if (token_listener)
+    {
+        token_listener->stop();
+    }
+    if (revocation_listener)
+    {
+        revocation_listener->stop();
+    }
+    if (async_engine)
+    {
+        async_engine->stop();
+    }
+    access_log.flush();
     return 0;
 }
@@ -0,0 +1,848 @@
+#pragma once
+#include "user_store.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nckd
+{
+/* CRC-32 (IEEE 802.3), the one zlib and ext4 use. */
+inline std::uint32_t crc32(const void *data, std::size_t n)
+{
+    static constexpr auto table = [] {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t k = 0; k < 256; ++k)
+        {
+            std::uint32_t c = k;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[k] = c;
+        }
+        return t;
+    }();
+    std::uint32_t crc = 0xFFFFFFFFu;
+    auto *p = static_cast<const unsigned char *>(data);
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        crc = table[(crc ^ p[k]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/*
+ * Open addressing hash index from a string key to a record number, with
+ * linear probing and backward shift deletion, so there are no tombstones
+ * to clean up after token rotations. Keys are not stored; `key_of(ref)`
+ * gives the key of record `ref` to compare against. Ref 0 marks an empty
+ * slot.
+ */
+class OpenIndex
+{
+  public:
+    using KeyOf = std::function<std::string_view(std::uint32_t)>;
+
+    explicit OpenIndex(KeyOf key_of) : key_of(std::move(key_of))
+    {
+        slots.resize(16);
+    }
+
+    static std::uint64_t hash(std::string_view key)
+    {
+        std::uint64_t h = std::hash<std::string_view>{}(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /* 0 when absent. */
+    std::uint32_t find(std::string_view key) const
+    {
+        auto h = hash(key);
+        auto mask = slots.size() - 1;
+        for (auto k = h & mask;; k = (k + 1) & mask)
+        {
+            const auto &slot = slots[k];
+            if (slot.ref == 0)
+            {
+                return 0;
+            }
+            if (slot.hash == h && key_of(slot.ref) == key)
+            {
+                return slot.ref;
+            }
+        }
+    }
+
+    /* `key` must not be present yet. */
+    void insert(std::string_view key, std::uint32_t ref)
+    {
+        if ((used + 1) * 10 > slots.size() * 7)
+        {
+            grow();
+        }
+        place(hash(key), ref);
+        ++used;
+    }
+
+    void erase(std::string_view key)
+    {
+        auto h = hash(key);
+        auto mask = slots.size() - 1;
+        auto k = h & mask;
+        for (;; k = (k + 1) & mask)
+        {
+            if (slots[k].ref == 0)
+            {
+                return;
+            }
+            if (slots[k].hash == h && key_of(slots[k].ref) == key)
+            {
+                break;
+            }
+        }
+        /* pull later entries of the probe run back over the hole */
+        for (auto next = (k + 1) & mask; slots[next].ref != 0;
+             next = (next + 1) & mask)
+        {
+            auto home = slots[next].hash & mask;
+            if (((next - home) & mask) >= ((next - k) & mask))
+            {
+                slots[k] = slots[next];
+                k = next;
+            }
+        }
+        slots[k] = {};
+        --used;
+    }
+
+    std::size_t size() const
+    {
+        return used;
+    }
+
+  private:
+    struct Slot
+    {
+        std::uint64_t hash = 0;
+        std::uint32_t ref = 0;
+    };
+
+    void place(std::uint64_t h, std::uint32_t ref)
+    {
+        auto mask = slots.size() - 1;
+        auto k = h & mask;
+        while (slots[k].ref != 0)
+        {
+            k = (k + 1) & mask;
+        }
+        slots[k] = {h, ref};
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (const auto &slot : old)
+        {
+            if (slot.ref != 0)
+            {
+                place(slot.hash, slot.ref);
+            }
+        }
+    }
+
+    KeyOf key_of;
+    std::vector<Slot> slots;
+    std::size_t used = 0;
+};
+
+/*
+ * Embedded UserStore for small deployments and tests: all users in
+ * memory, indexed by email and by token, persisted to an append-only log.
+ *
+ * Every mutation is appended to the log before it is applied, as
+ *
+ *   u32 CRC-32 of the rest, u32 length, u8 type, u64 user id,
+ *   then its strings, each as u16 length and bytes
+ *
+ * in native byte order. open() replays the log and truncates it at the
+ * first record that is short or fails its checksum, which is where a crash
+ * interrupted a write.
+ *
+ * Writers are serialized by `log_mutex` and take the index lock only to
+ * apply their change, so lookups never wait for the disk. With `sync` a
+ * writer then waits until an fdatasync covers its record; writers that
+ * queue up meanwhile share the next one. A write that fails is cut off
+ * the log again, and a failed fdatasync, after which the page cache can
+ * no longer be trusted, makes the store refuse every further write.
+ *
+ * The log grows with every token rotation. Once it is `compact_ratio`
+ * times the size of a log holding just the current state, and at least
+ * `compact_min_bytes`, a background thread rewrites it: it copies the
+ * users under the lock, writes them to a new file without it, then
+ * appends what changed meanwhile and renames the new file over the log.
+ */
+class MemoryUserStore final : public UserStore
+{
+  public:
+    struct Options
+    {
+        std::string path;
+        bool sync = true;
+        std::size_t compact_min_bytes = 1 << 20;
+        double compact_ratio = 2.0;
+    };
+
+    explicit MemoryUserStore(Options options)
+        : options(std::move(options)),
+          by_email([this](std::uint32_t ref) -> std::string_view {
+              return users[ref - 1].email;
+          }),
+          by_token([this](std::uint32_t ref) -> std::string_view {
+              return users[ref - 1].token;
+          })
+    {
+    }
+    MemoryUserStore(const MemoryUserStore &) = delete;
+    MemoryUserStore &operator=(const MemoryUserStore &) = delete;
+    ~MemoryUserStore()
+    {
+        {
+            std::lock_guard lock(compact_mutex);
+            stopping = true;
+        }
+        compact_wakeup.notify_all();
+        if (compactor.joinable())
+        {
+            compactor.join();
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    /* Replay the log, creating it if needed, and start the compactor. */
+    bool open()
+    {
+        fd = ::open(options.path.c_str(),
+                    O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0600);
+        if (fd < 0)
+        {
+            SPDLOG_ERROR("can not open user log {}: {}",
+                         options.path,
+                         strerror(errno));
+            return false;
+        }
+        if (!replay())
+        {
+            return false;
+        }
+        SPDLOG_INFO("loaded {} users from {}", users.size(), options.path);
+        compactor = std::thread([this] { compact_loop(); });
+        return true;
+    }
+
+    StoreStatus find_by_token(std::string_view token,
+                              AuthEntry &out,
+                              bool &from_replica) override
+    {
+        from_replica = false;
+        std::shared_lock lock(mutex);
+        auto ref = by_token.find(token);
+        if (ref == 0)
+        {
+            return StoreStatus::NotFound;
+        }
+        out.role = users[ref - 1].role;
+        out.uid = std::to_string(ref);
+        return StoreStatus::Ok;
+    }
+
+    StoreStatus find_by_email(std::string_view email, UserRecord &out) override
+    {
+        std::shared_lock lock(mutex);
+        auto ref = by_email.find(email);
+        if (ref == 0)
+        {
+            return StoreStatus::NotFound;
+        }
+        const auto &user = users[ref - 1];
+        out.id = std::to_string(ref);
+        out.password = user.password;
+        out.token = user.token;
+        out.role = user.role;
+        return StoreStatus::Ok;
+    }
+
+    StoreStatus email_exists(std::string_view email) override
+    {
+        std::shared_lock lock(mutex);
+        return by_email.find(email) ? StoreStatus::Ok : StoreStatus::NotFound;
+    }
+
+    StoreStatus insert_user(std::string_view email,
+                            std::string_view password) override
+    {
+        std::unique_lock log(log_mutex);
+        if (by_email.find(email) != 0)
+        {
+            return StoreStatus::Exists;
+        }
+        std::uint64_t id = users.size() + 1;
+        auto seq = append(Insert, id, {email, password, DEFAULT_ROLE});
+        if (seq == 0)
+        {
+            return StoreStatus::Error;
+        }
+        {
+            std::unique_lock lock(mutex);
+            apply_insert(email, password, DEFAULT_ROLE);
+        }
+        return written(log, seq);
+    }
+
+    StoreStatus set_token(std::string_view uid,
+                          std::string_view token,
+                          std::string_view /*old_token*/) override
+    {
+        std::unique_lock log(log_mutex);
+        auto ref = parse_id(uid);
+        if (ref == 0)
+        {
+            return StoreStatus::NotFound;
+        }
+        auto owner = by_token.find(token);
+        if (owner != 0 && owner != ref)
+        {
+            return StoreStatus::Error;
+        }
+        auto seq = append(Token, ref, {token});
+        if (seq == 0)
+        {
+            return StoreStatus::Error;
+        }
+        {
+            std::unique_lock lock(mutex);
+            apply_token(ref, token);
+        }
+        return written(log, seq);
+    }
+
+    StoreStatus update_password(std::string_view uid,
+                                std::string_view password,
+                                std::string_view old_password) override
+    {
+        std::unique_lock log(log_mutex);
+        auto ref = parse_id(uid);
+        if (ref == 0 || users[ref - 1].password != old_password)
+        {
+            return StoreStatus::NotFound;
+        }
+        auto seq = append(Password, ref, {password});
+        if (seq == 0)
+        {
+            return StoreStatus::Error;
+        }
+        {
+            std::unique_lock lock(mutex);
+            live_bytes += password.size();
+            live_bytes -= users[ref - 1].password.size();
+            users[ref - 1].password = password;
+        }
+        return written(log, seq);
+    }
+
+    std::size_t size() const
+    {
+        std::shared_lock lock(mutex);
+        return users.size();
+    }
+
+    std::size_t log_size() const
+    {
+        std::lock_guard log(log_mutex);
+        return log_bytes;
+    }
+
+    /* Rewrite the log to the current state now; false if that failed. */
+    bool compact()
+    {
+        std::vector<User> snapshot;
+        {
+            std::lock_guard log(log_mutex);
+            if (compacting)
+            {
+                return false;
+            }
+            compacting = true;
+            side.clear();
+            snapshot = users;
+        }
+        auto tmp = options.path + ".compact";
+        int out = ::open(tmp.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                         0600);
+        bool ok = out >= 0;
+        std::string buffer;
+        for (std::size_t k = 0; ok && k < snapshot.size(); ++k)
+        {
+            const auto &user = snapshot[k];
+            encode(buffer,
+                   Insert,
+                   k + 1,
+                   {user.email, user.password, user.role});
+            if (!user.token.empty())
+            {
+                encode(buffer, Token, k + 1, {user.token});
+            }
+            if (buffer.size() >= 1 << 16)
+            {
+                ok = write_all(out, buffer);
+                buffer.clear();
+            }
+        }
+        ok = ok && write_all(out, buffer);
+
+        std::lock_guard log(log_mutex);
+        compacting = false;
+        ok = ok && write_all(out, side) && fsync(out) == 0 &&
+             rename(tmp.c_str(), options.path.c_str()) == 0;
+        side.clear();
+        if (!ok)
+        {
+            SPDLOG_WARN("compacting {} failed: {}",
+                        options.path,
+                        strerror(errno));
+            if (out >= 0)
+            {
+                close(out);
+            }
+            unlink(tmp.c_str());
+            return false;
+        }
+        sync_directory();
+        {
+            /* the new file is synced up to the last append */
+            std::unique_lock sync(sync_mutex);
+            sync_done.wait(sync, [this] { return !syncing; });
+            close(fd);
+            fd = out;
+            synced = appended;
+        }
+        struct stat st;
+        log_bytes = fstat(fd, &st) == 0 ? st.st_size : live_bytes;
+        return true;
+    }
+
+  private:
+    enum RecordType : std::uint8_t
+    {
+        Insert = 1,
+        Token = 2,
+        Password = 3,
+    };
+
+    struct User
+    {
+        std::string email;
+        std::string password;
+        std::string token;
+        std::string role;
+    };
+
+    static constexpr std::string_view DEFAULT_ROLE = "user";
+    /* crc, length, type, id */
+    static constexpr std::size_t HEADER = 4 + 4 + 1 + 8;
+
+    static void encode(std::string &out,
+                       RecordType type,
+                       std::uint64_t id,
+                       std::initializer_list<std::string_view> fields)
+    {
+        auto start = out.size();
+        out.append(8, '\0');
+        out.push_back(static_cast<char>(type));
+        out.append(reinterpret_cast<const char *>(&id), sizeof(id));
+        for (auto field : fields)
+        {
+            auto len = static_cast<std::uint16_t>(
+                std::min<std::size_t>(field.size(), UINT16_MAX));
+            out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+            out.append(field.data(), len);
+        }
+        auto length = static_cast<std::uint32_t>(out.size() - start - 8);
+        std::memcpy(&out[start + 4], &length, sizeof(length));
+        std::uint32_t crc = crc32(out.data() + start + 4, length + 4);
+        std::memcpy(&out[start], &crc, sizeof(crc));
+    }
+
+    static bool write_all(int out, std::string_view data)
+    {
+        while (!data.empty())
+        {
+            auto n = write(out, data.data(), data.size());
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            data.remove_prefix(n);
+        }
+        return true;
+    }
+
+    /*
+     * Caller holds log_mutex. The record's sequence number for durable(),
+     * 0 when it was not written.
+     */
+    std::uint64_t append(RecordType type,
+                         std::uint64_t id,
+                         std::initializer_list<std::string_view> fields)
+    {
+        if (failed.load(std::memory_order_relaxed))
+        {
+            return 0;
+        }
+        for (auto field : fields)
+        {
+            if (field.size() > UINT16_MAX)
+            {
+                return 0;
+            }
+        }
+        record.clear();
+        encode(record, type, id, fields);
+        if (!write_all(fd, record))
+        {
+            SPDLOG_ERROR("user log write failed: {}", strerror(errno));
+            /* a torn record would hide every later one from replay() */
+            if (ftruncate(fd, log_bytes) != 0)
+            {
+                SPDLOG_ERROR("can not cut user log back, refusing writes: "
+                             "{}",
+                             strerror(errno));
+                failed = true;
+            }
+            return 0;
+        }
+        if (compacting)
+        {
+            side += record;
+        }
+        log_bytes += record.size();
+        std::lock_guard sync(sync_mutex);
+        return ++appended;
+    }
+
+    /*
+     * Group commit: the first writer to get here fdatasyncs everything
+     * appended so far while the others wait for it.
+     */
+    bool durable(std::uint64_t seq)
+    {
+        if (!options.sync)
+        {
+            return true;
+        }
+        std::unique_lock sync(sync_mutex);
+        while (synced < seq)
+        {
+            if (failed.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+            if (syncing)
+            {
+                sync_done.wait(sync);
+                continue;
+            }
+            syncing = true;
+            auto target = appended;
+            int log_fd = fd;
+            sync.unlock();
+            bool ok = fdatasync(log_fd) == 0;
+            if (!ok)
+            {
+                SPDLOG_ERROR("user log sync failed, refusing writes: {}",
+                             strerror(errno));
+            }
+            sync.lock();
+            syncing = false;
+            if (ok)
+            {
+                synced = std::max(synced, target);
+            }
+            else
+            {
+                failed = true;
+            }
+            sync_done.notify_all();
+        }
+        return true;
+    }
+
+    /* Caller holds log_mutex. */
+    bool compaction_due() const
+    {
+        return log_bytes >= options.compact_min_bytes &&
+               log_bytes > live_bytes * options.compact_ratio;
+    }
+
+    /*
+     * Wakes the compactor when the log has grown enough, then waits for
+     * record `seq` to be durable.
+     */
+    StoreStatus written(std::unique_lock<std::mutex> &log, std::uint64_t seq)
+    {
+        bool due = compaction_due() && !compacting;
+        log.unlock();
+        if (due)
+        {
+            {
+                std::lock_guard guard(compact_mutex);
+                compact_requested = true;
+            }
+            compact_wakeup.notify_one();
+        }
+        return durable(seq) ? StoreStatus::Ok : StoreStatus::Error;
+    }
+
+    std::uint32_t parse_id(std::string_view uid) const
+    {
+        std::uint64_t id = 0;
+        auto [end, ec] =
+            std::from_chars(uid.data(), uid.data() + uid.size(), id);
+        if (ec != std::errc() || end != uid.data() + uid.size() || id == 0 ||
+            id > users.size())
+        {
+            return 0;
+        }
+        return static_cast<std::uint32_t>(id);
+    }
+
+    void apply_insert(std::string_view email,
+                      std::string_view password,
+                      std::string_view role)
+    {
+        users.push_back({std::string(email),
+                         std::string(password),
+                         {},
+                         std::string(role)});
+        by_email.insert(email, static_cast<std::uint32_t>(users.size()));
+        live_bytes +=
+            HEADER + 6 + email.size() + password.size() + role.size();
+    }
+
+    void apply_token(std::uint32_t ref, std::string_view token)
+    {
+        auto &user = users[ref - 1];
+        if (!user.token.empty())
+        {
+            by_token.erase(user.token);
+            live_bytes -= HEADER + 2 + user.token.size();
+        }
+        user.token = token;
+        if (!token.empty())
+        {
+            by_token.insert(token, ref);
+            live_bytes += HEADER + 2 + token.size();
+        }
+    }
+
+    /* Apply every intact record, cut the log after the last one. */
+    bool replay()
+    {
+        std::string data;
+        char buf[1 << 16];
+        ssize_t n;
+        while ((n = pread(fd, buf, sizeof(buf), data.size())) > 0)
+        {
+            data.append(buf, n);
+        }
+        if (n < 0)
+        {
+            SPDLOG_ERROR("can not read user log: {}", strerror(errno));
+            return false;
+        }
+        std::size_t pos = 0;
+        while (data.size() - pos >= HEADER)
+        {
+            std::uint32_t crc, length;
+            std::memcpy(&crc, data.data() + pos, 4);
+            std::memcpy(&length, data.data() + pos + 4, 4);
+            if (length < HEADER - 8 || data.size() - pos - 8 < length ||
+                crc32(data.data() + pos + 4, length + 4) != crc ||
+                !apply(std::string_view(data).substr(pos + 8, length)))
+            {
+                break;
+            }
+            pos += 8 + length;
+        }
+        if (pos != data.size())
+        {
+            SPDLOG_WARN("user log {} has a damaged tail, dropping {} bytes",
+                        options.path,
+                        data.size() - pos);
+            if (ftruncate(fd, pos) != 0)
+            {
+                return false;
+            }
+        }
+        log_bytes = pos;
+        return true;
+    }
+
+    bool apply(std::string_view payload)
+    {
+        auto type = static_cast<RecordType>(payload[0]);
+        std::uint64_t id;
+        std::memcpy(&id, payload.data() + 1, sizeof(id));
+        payload.remove_prefix(1 + sizeof(id));
+        std::string_view fields[3];
+        std::size_t count = 0;
+        while (!payload.empty() && count < 3)
+        {
+            std::uint16_t len;
+            if (payload.size() < sizeof(len))
+            {
+                return false;
+            }
+            std::memcpy(&len, payload.data(), sizeof(len));
+            payload.remove_prefix(sizeof(len));
+            if (payload.size() < len)
+            {
+                return false;
+            }
+            fields[count++] = payload.substr(0, len);
+            payload.remove_prefix(len);
+        }
+        switch (type)
+        {
+        case Insert:
+            if (count != 3 || id != users.size() + 1 ||
+                by_email.find(fields[0]) != 0)
+            {
+                return false;
+            }
+            apply_insert(fields[0], fields[1], fields[2]);
+            return true;
+        case Token:
+            if (count != 1 || id == 0 || id > users.size())
+            {
+                return false;
+            }
+            apply_token(static_cast<std::uint32_t>(id), fields[0]);
+            return true;
+        case Password:
+            if (count != 1 || id == 0 || id > users.size())
+            {
+                return false;
+            }
+            live_bytes += fields[0].size();
+            live_bytes -= users[id - 1].password.size();
+            users[id - 1].password = fields[0];
+            return true;
+        }
+        return false;
+    }
+
+    void sync_directory()
+    {
+        auto slash = options.path.rfind('/');
+        auto dir =
+            slash == std::string::npos
+                ? std::string(".")
+                : options.path.substr(0, std::max<std::size_t>(slash, 1));
+        int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0)
+        {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    void compact_loop()
+    {
+        std::unique_lock lock(compact_mutex);
+        for (;;)
+        {
+            compact_wakeup.wait_for(lock, std::chrono::seconds(60), [this] {
+                return stopping || compact_requested;
+            });
+            if (stopping)
+            {
+                return;
+            }
+            compact_requested = false;
+            bool due;
+            {
+                std::lock_guard log(log_mutex);
+                due = compaction_due();
+            }
+            if (due)
+            {
+                lock.unlock();
+                compact();
+                lock.lock();
+            }
+        }
+    }
+
+    Options options;
+    /* taken by writers, which alone change the state below */
+    mutable std::mutex log_mutex;
+    /* taken shared by lookups, exclusively by writers to apply a change */
+    mutable std::shared_mutex mutex;
+    std::vector<User> users;
+    OpenIndex by_email;
+    OpenIndex by_token;
+    int fd = -1;
+    std::string record;
+    std::size_t log_bytes = 0;
+    std::size_t live_bytes = 0;
+    bool compacting = false;
+    /* records appended while a compaction writes its copy */
+    std::string side;
+    std::atomic<bool> failed{false};
+
+    /* records appended and known durable, guarded by sync_mutex */
+    std::mutex sync_mutex;
+    std::condition_variable sync_done;
+    std::uint64_t appended = 0;
+    std::uint64_t synced = 0;
+    bool syncing = false;
+
+    std::mutex compact_mutex;
+    std::condition_variable compact_wakeup;
+    bool compact_requested = false;
+    bool stopping = false;
+    std::thread compactor;
+};
+
+}  // namespace nckd
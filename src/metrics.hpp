@@ -0,0 +1,397 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace nckd
+{
+/*
+ * Counters and histograms are split into per-thread stripes, each on its
+ * own cache line. Updates are a relaxed fetch_add on the caller's stripe,
+ * so request threads never write to a line another thread is writing;
+ * readers add the stripes up when /metrics is scraped.
+ */
+constexpr std::size_t METRIC_STRIPES = 16;
+
+inline std::size_t metric_stripe()
+{
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t stripe =
+        next.fetch_add(1, std::memory_order_relaxed) % METRIC_STRIPES;
+    return stripe;
+}
+
+class Counter
+{
+  public:
+    void add(std::uint64_t n = 1)
+    {
+        auto &stripe = stripes[metric_stripe()];
+        stripe.value.fetch_add(n, std::memory_order_relaxed);
+    }
+    std::uint64_t value() const
+    {
+        std::uint64_t sum = 0;
+        for (const auto &s : stripes)
+        {
+            sum += s.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+  private:
+    struct alignas(64) Stripe
+    {
+        std::atomic<std::uint64_t> value{0};
+    };
+    std::array<Stripe, METRIC_STRIPES> stripes;
+};
+
+/*
+ * Log-linear (HDR style) latency histogram in microseconds: every power of
+ * two is split into 4 sub-buckets, which keeps the relative error under
+ * 25% from 1us up to about 67s.
+ */
+class Histogram
+{
+  public:
+    static constexpr int SUB_BITS = 2;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int MAX_EXPONENT = 26;
+    static constexpr int BUCKETS = MAX_EXPONENT * SUB_BUCKETS;
+
+    static int bucket_of(std::uint64_t us)
+    {
+        if (us < SUB_BUCKETS)
+        {
+            return static_cast<int>(us);
+        }
+        int exponent = std::bit_width(us) - 1;
+        if (exponent > MAX_EXPONENT)
+        {
+            return BUCKETS - 1;
+        }
+        int sub = static_cast<int>(us >> (exponent - SUB_BITS)) &
+                  (SUB_BUCKETS - 1);
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    /* Exclusive upper bound of a bucket, in microseconds. */
+    static std::uint64_t upper_bound(int bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+        {
+            return bucket + 1;
+        }
+        int exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        std::uint64_t sub = bucket % SUB_BUCKETS;
+        return (std::uint64_t(1) << exponent) +
+               ((sub + 1) << (exponent - SUB_BITS));
+    }
+
+    void observe(std::chrono::nanoseconds elapsed)
+    {
+        auto us = static_cast<std::uint64_t>(
+            std::max<std::int64_t>(elapsed.count() / 1000, 0));
+        auto &stripe = stripes[metric_stripe()];
+        stripe.counts[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+        stripe.sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    struct Snapshot
+    {
+        std::array<std::uint64_t, BUCKETS> counts{};
+        std::uint64_t count = 0;
+        std::uint64_t sum_us = 0;
+    };
+    Snapshot snapshot() const
+    {
+        Snapshot snap;
+        for (const auto &s : stripes)
+        {
+            for (int k = 0; k < BUCKETS; ++k)
+            {
+                auto n = s.counts[k].load(std::memory_order_relaxed);
+                snap.counts[k] += n;
+                snap.count += n;
+            }
+            snap.sum_us += s.sum_us.load(std::memory_order_relaxed);
+        }
+        return snap;
+    }
+
+  private:
+    struct alignas(64) Stripe
+    {
+        std::array<std::atomic<std::uint64_t>, BUCKETS> counts{};
+        std::atomic<std::uint64_t> sum_us{0};
+    };
+    std::array<Stripe, METRIC_STRIPES> stripes;
+};
+
+/* Observes the time from construction to destruction. */
+class ScopedTimer
+{
+  public:
+    explicit ScopedTimer(Histogram &histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now())
+    {
+    }
+    ~ScopedTimer()
+    {
+        histogram.observe(std::chrono::steady_clock::now() - start);
+    }
+
+  private:
+    Histogram &histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+enum class Route
+{
+    Webhook,
+    Login,
+    Register,
+    Other,
+    Count,
+};
+
+constexpr const char *ROUTE_NAMES[] = {
+    "webhook", "login", "register", "other"};
+
+/* Error codes the handlers answer with, see the 错误码 comments. */
+constexpr const char *ERROR_CODES[] = {"100101",
+                                       "100102",
+                                       "100103",
+                                       "100201",
+                                       "100202",
+                                       "100301",
+                                       "100302",
+                                       "100303",
+                                       "100304",
+                                       "100305",
+                                       "100401",
+                                       "100402",
+                                       "100403",
+                                       "other"};
+constexpr std::size_t ERROR_CODE_COUNT = std::size(ERROR_CODES);
+
+inline std::size_t error_index(std::string_view code)
+{
+    for (std::size_t k = 0; k + 1 < ERROR_CODE_COUNT; ++k)
+    {
+        if (code == ERROR_CODES[k])
+        {
+            return k;
+        }
+    }
+    return ERROR_CODE_COUNT - 1;
+}
+
+/* Upper bound on cpool::Stmt values, checked next to PG_STATEMENTS. */
+constexpr std::size_t MAX_STATEMENTS = 16;
+/* Upper bound on static routes, checked next to ENDPOINTS. */
+constexpr std::size_t MAX_ENDPOINTS = 16;
+
+struct Metrics
+{
+    static constexpr std::size_t ROUTES =
+        static_cast<std::size_t>(Route::Count);
+
+    Counter requests[ROUTES];
+    Histogram latency[ROUTES];
+    Counter errors[ERROR_CODE_COUNT];
+    Histogram pool_wait;
+    Counter pool_timeouts;
+    Histogram db_time[MAX_STATEMENTS];
+    Histogram argon2_hash;
+    Histogram argon2_verify;
+    Counter token_batches;
+    Counter token_batch_rows;
+    Counter replica_reads;
+    Counter replica_fallbacks;
+    Counter argon2_rehashes;
+    Counter route_matches[MAX_ENDPOINTS];
+    /* requests left to cpp-httplib's regex routing */
+    Counter route_fallbacks;
+
+    Counter &errors_for(std::string_view code)
+    {
+        return errors[error_index(code)];
+    }
+};
+
+inline Metrics &metrics()
+{
+    static Metrics instance;
+    return instance;
+}
+
+/* Prometheus text exposition format, version 0.0.4. */
+class MetricsWriter
+{
+  public:
+    explicit MetricsWriter(std::string &out) : out(out)
+    {
+    }
+
+    void header(const char *name, const char *type, const char *help)
+    {
+        out.append("# HELP ").append(name).append(" ").append(help);
+        out.append("\n# TYPE ").append(name).append(" ").append(type);
+        out.append("\n");
+    }
+
+    void sample(const char *name,
+                std::string_view labels,
+                double value,
+                const char *suffix = "")
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.17g", value);
+        out.append(name).append(suffix);
+        if (!labels.empty())
+        {
+            out.append("{").append(labels).append("}");
+        }
+        out.append(" ").append(buf).append("\n");
+    }
+
+    /* Cumulative buckets at every power of two, in seconds. */
+    void histogram(const char *name,
+                   std::string_view labels,
+                   const Histogram &histogram)
+    {
+        auto snap = histogram.snapshot();
+        std::string prefix(labels);
+        if (!prefix.empty())
+        {
+            prefix.append(",");
+        }
+        std::uint64_t cumulative = 0;
+        char le[64];
+        for (int k = 0; k < Histogram::BUCKETS; ++k)
+        {
+            cumulative += snap.counts[k];
+            if ((k + 1) % Histogram::SUB_BUCKETS != 0)
+            {
+                continue;
+            }
+            snprintf(le,
+                     sizeof(le),
+                     "le=\"%g\"",
+                     Histogram::upper_bound(k) / 1e6);
+            sample(name, prefix + le, cumulative, "_bucket");
+        }
+        sample(name, prefix + "le=\"+Inf\"", snap.count, "_bucket");
+        sample(name, labels, snap.sum_us / 1e6, "_sum");
+        sample(name, labels, snap.count, "_count");
+    }
+
+  private:
+    std::string &out;
+};
+
+/*
+ * Render the registry. `statements` names the db_time histograms in use,
+ * `endpoints` the route_matches counters, `gauges` are sampled by the
+ * caller at scrape time.
+ */
+inline std::string render_metrics(
+    const Metrics &m,
+    const std::vector<const char *> &statements,
+    const std::vector<std::pair<const char *, double>> &gauges,
+    const std::vector<const char *> &endpoints = {})
+{
+    std::string out;
+    MetricsWriter w(out);
+    std::string label;
+
+    w.header("nckd_requests_total", "counter", "Requests per route.");
+    for (std::size_t k = 0; k < Metrics::ROUTES; ++k)
+    {
+        label = std::string("route=\"") + ROUTE_NAMES[k] + "\"";
+        w.sample("nckd_requests_total", label, m.requests[k].value());
+    }
+    w.header("nckd_request_duration_seconds",
+             "histogram",
+             "Request latency per route.");
+    for (std::size_t k = 0; k < Metrics::ROUTES; ++k)
+    {
+        label = std::string("route=\"") + ROUTE_NAMES[k] + "\"";
+        w.histogram("nckd_request_duration_seconds", label, m.latency[k]);
+    }
+    w.header("nckd_route_matches_total",
+             "counter",
+             "Requests per static route, fallback for regex routing.");
+    for (std::size_t k = 0; k < endpoints.size() && k < MAX_ENDPOINTS; ++k)
+    {
+        label = std::string("route=\"") + endpoints[k] + "\"";
+        w.sample(
+            "nckd_route_matches_total", label, m.route_matches[k].value());
+    }
+    w.sample("nckd_route_matches_total",
+             "route=\"fallback\"",
+             m.route_fallbacks.value());
+    w.header("nckd_errors_total", "counter", "Error codes answered.");
+    for (std::size_t k = 0; k < ERROR_CODE_COUNT; ++k)
+    {
+        label = std::string("code=\"") + ERROR_CODES[k] + "\"";
+        w.sample("nckd_errors_total", label, m.errors[k].value());
+    }
+    w.header("nckd_pool_acquire_seconds",
+             "histogram",
+             "Time spent waiting for a pool connection.");
+    w.histogram("nckd_pool_acquire_seconds", "", m.pool_wait);
+    w.header("nckd_pool_acquire_timeouts_total",
+             "counter",
+             "Acquires that gave up waiting.");
+    w.sample("nckd_pool_acquire_timeouts_total", "", m.pool_timeouts.value());
+    w.header("nckd_db_statement_seconds",
+             "histogram",
+             "Database time per prepared statement.");
+    for (std::size_t k = 0; k < statements.size() && k < MAX_STATEMENTS; ++k)
+    {
+        label = std::string("statement=\"") + statements[k] + "\"";
+        w.histogram("nckd_db_statement_seconds", label, m.db_time[k]);
+    }
+    w.header("nckd_argon2_seconds", "histogram", "Argon2 time per call.");
+    w.histogram("nckd_argon2_seconds", "op=\"hash\"", m.argon2_hash);
+    w.histogram("nckd_argon2_seconds", "op=\"verify\"", m.argon2_verify);
+    w.header("nckd_argon2_rehashes_total",
+             "counter",
+             "Stored hashes upgraded to the current parameters on login.");
+    w.sample("nckd_argon2_rehashes_total", "", m.argon2_rehashes.value());
+    w.header("nckd_token_batches_total",
+             "counter",
+             "Group commits of login token updates.");
+    w.sample("nckd_token_batches_total", "", m.token_batches.value());
+    w.header("nckd_token_batch_rows_total",
+             "counter",
+             "Token updates written by those commits.");
+    w.sample("nckd_token_batch_rows_total", "", m.token_batch_rows.value());
+    w.header("nckd_replica_reads_total",
+             "counter",
+             "Token lookups answered by a replica.");
+    w.sample("nckd_replica_reads_total", "", m.replica_reads.value());
+    w.header("nckd_replica_fallbacks_total",
+             "counter",
+             "Token lookups a replica passed on to the primary.");
+    w.sample("nckd_replica_fallbacks_total", "", m.replica_fallbacks.value());
+    for (const auto &[name, value] : gauges)
+    {
+        w.header(name, "gauge", "Sampled at scrape time.");
+        w.sample(name, "", value);
+    }
+    return out;
+}
+
+}  // namespace nckd
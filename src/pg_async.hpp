@@ -0,0 +1,629 @@
+#pragma once
+#include "utils.hpp"
+#include "pg_executor.hpp"
+#include "task.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <libpq-fe.h>
+#include <spdlog/spdlog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace nckd
+{
+/*
+ * Non-blocking query engine: a few nonblocking libpq connections driven by
+ * one epoll thread. Coroutines `co_await engine.query(...)`; the request is
+ * handed to the next free connection with PQsendQueryPrepared, its socket
+ * is watched for readiness and the coroutine is resumed on the engine
+ * thread once PQgetResult has the answer. Requests queue inside the engine
+ * instead of failing when every connection is busy, up to
+ * `queue_capacity` of them and for at most `timeout`, after which they
+ * are resumed with no result, like a pool acquire that timed out.
+ *
+ * Connections are opened and re-prepared with PQconnectStart and a
+ * pipelined PREPARE on the same epoll loop, so a database outage only
+ * costs the queries that were on the lost connection.
+ */
+class AsyncPGEngine
+{
+    struct Request
+    {
+        cpool::Stmt stmt;
+        std::array<std::string, 2> params;
+        std::coroutine_handle<> waiter;
+        PGresult *result = nullptr;
+        std::chrono::steady_clock::time_point sent;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+  public:
+    struct Options
+    {
+        /* queued plus running time before a query is answered empty */
+        std::chrono::milliseconds timeout{200};
+        /* queries waiting for a connection, more are answered empty */
+        std::size_t queue_capacity = 1024;
+        /* a connect or reconnect still not done after this is retried */
+        std::chrono::milliseconds connect_timeout{10000};
+    };
+
+    class QueryAwaiter
+    {
+      public:
+        QueryAwaiter(AsyncPGEngine &engine, Request request)
+            : engine(engine), request(std::move(request))
+        {
+        }
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            request.waiter = h;
+            /* a stopped or saturated engine answers right away */
+            return engine.submit(&request);
+        }
+        PGResultPtr await_resume()
+        {
+            return PGResultPtr(request.result);
+        }
+
+      private:
+        AsyncPGEngine &engine;
+        Request request;
+    };
+
+    AsyncPGEngine(std::string conninfo, std::size_t num_connections)
+        : AsyncPGEngine(std::move(conninfo), num_connections, Options())
+    {
+    }
+    AsyncPGEngine(std::string conninfo,
+                  std::size_t num_connections,
+                  const Options &options)
+        : conninfo(std::move(conninfo)),
+          options(options),
+          slots(num_connections)
+    {
+    }
+    AsyncPGEngine(const AsyncPGEngine &) = delete;
+    AsyncPGEngine &operator=(const AsyncPGEngine &) = delete;
+    ~AsyncPGEngine()
+    {
+        stop();
+    }
+
+    /*
+     * Open the connections and start the engine thread. False when none
+     * could be opened within `connect_timeout`, so the caller can fall back
+     * to the pool.
+     */
+    bool start()
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0)
+        {
+            return false;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = WAKE_ID;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+        for (std::size_t k = 0; k < slots.size(); ++k)
+        {
+            connect(k);
+        }
+        /* the first connects are driven here, before any query arrives */
+        auto deadline = std::chrono::steady_clock::now() +
+                        options.connect_timeout;
+        while (connecting() && std::chrono::steady_clock::now() < deadline)
+        {
+            step();
+        }
+        if (std::none_of(slots.begin(), slots.end(), [](const Slot &slot) {
+                return slot.state == State::Ready;
+            }))
+        {
+            return false;
+        }
+        running = true;
+        accepting = true;
+        worker = std::thread([this] { loop(); });
+        return true;
+    }
+
+    void stop()
+    {
+        if (running.exchange(false))
+        {
+            wake();
+            worker.join();
+        }
+        for (auto &slot : slots)
+        {
+            if (slot.conn != nullptr)
+            {
+                PQfinish(slot.conn);
+                slot.conn = nullptr;
+            }
+        }
+        if (wake_fd >= 0)
+        {
+            close(wake_fd);
+            wake_fd = -1;
+        }
+        if (epoll_fd >= 0)
+        {
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+    }
+
+    /*
+     * Parameters are passed one by one rather than as an initializer_list,
+     * whose backing array GCC 12 fails to keep in a coroutine frame.
+     */
+    QueryAwaiter query(cpool::Stmt stmt,
+                       std::string_view first,
+                       std::string_view second = {})
+    {
+        Request request{stmt,
+                        {std::string(first), std::string(second)},
+                        {},
+                        nullptr,
+                        {},
+                        {}};
+        return QueryAwaiter(*this, std::move(request));
+    }
+
+    /* Queries submitted and not yet sent to a connection. */
+    std::size_t queued() const
+    {
+        return backlog.load(std::memory_order_relaxed);
+    }
+
+  private:
+    static constexpr std::uint64_t WAKE_ID = ~std::uint64_t(0);
+
+    enum class State
+    {
+        Down,
+        Connecting,
+        Preparing,
+        Ready,
+    };
+
+    struct Slot
+    {
+        PGconn *conn = nullptr;
+        /* the socket registered with epoll, -1 for none */
+        int fd = -1;
+        State state = State::Down;
+        Request *active = nullptr;
+        /* results of a timed out query are still to be read */
+        bool draining = false;
+        std::uint32_t events = 0;
+        /* Down: when to reconnect; Connecting, Preparing: when to give up */
+        std::chrono::steady_clock::time_point until;
+    };
+
+    bool submit(Request *request)
+    {
+        request->deadline = std::chrono::steady_clock::now() + options.timeout;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!accepting ||
+                backlog.load(std::memory_order_relaxed) >=
+                    options.queue_capacity)
+            {
+                return false;
+            }
+            backlog.fetch_add(1, std::memory_order_relaxed);
+            submitted.push_back(request);
+        }
+        wake();
+        return true;
+    }
+
+    void wake()
+    {
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = write(wake_fd, &one, sizeof(one));
+    }
+
+    /* Begin a non-blocking (re)connect of slot `k`. */
+    void connect(std::size_t k)
+    {
+        auto &slot = slots[k];
+        forget(k);
+        slot.conn = PQconnectStart(conninfo.c_str());
+        if (slot.conn == nullptr || PQstatus(slot.conn) == CONNECTION_BAD)
+        {
+            down(k);
+            return;
+        }
+        slot.state = State::Connecting;
+        slot.until = std::chrono::steady_clock::now() + options.connect_timeout;
+        watch(k, EPOLLOUT);
+    }
+
+    /* Drop slot `k`'s connection and retry in a second. */
+    void down(std::size_t k)
+    {
+        auto &slot = slots[k];
+        if (slot.conn != nullptr)
+        {
+            SPDLOG_WARN("async connection {} lost: {}",
+                        k,
+                        PQerrorMessage(slot.conn));
+        }
+        if (slot.active != nullptr)
+        {
+            PQclear(slot.active->result);
+            slot.active->result = nullptr;
+            done.push_back(slot.active);
+            slot.active = nullptr;
+        }
+        forget(k);
+        slot.state = State::Down;
+        slot.until = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    }
+
+    void forget(std::size_t k)
+    {
+        auto &slot = slots[k];
+        if (slot.fd >= 0)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, slot.fd, nullptr);
+            slot.fd = -1;
+        }
+        if (slot.conn != nullptr)
+        {
+            PQfinish(slot.conn);
+            slot.conn = nullptr;
+        }
+        slot.draining = false;
+        slot.events = 0;
+    }
+
+    /* Watch `events` on the slot's socket, which a connect may change. */
+    void watch(std::size_t k, std::uint32_t events)
+    {
+        auto &slot = slots[k];
+        int fd = PQsocket(slot.conn);
+        if (slot.fd == fd && slot.events == events)
+        {
+            return;
+        }
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = k;
+        if (slot.fd != fd)
+        {
+            if (slot.fd >= 0)
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, slot.fd, nullptr);
+            }
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        else
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        }
+        slot.fd = fd;
+        slot.events = events;
+    }
+
+    bool connecting() const
+    {
+        return std::any_of(slots.begin(), slots.end(), [](const Slot &slot) {
+            return slot.state == State::Connecting ||
+                   slot.state == State::Preparing;
+        });
+    }
+
+    void dispatch()
+    {
+        for (std::size_t k = 0; k < slots.size() && !waiting.empty(); ++k)
+        {
+            auto &slot = slots[k];
+            if (slot.state != State::Ready || slot.active != nullptr ||
+                slot.draining)
+            {
+                continue;
+            }
+            if (PQstatus(slot.conn) != CONNECTION_OK)
+            {
+                down(k);
+                continue;
+            }
+            Request *request = waiting.front();
+            waiting.pop_front();
+            backlog.fetch_sub(1, std::memory_order_relaxed);
+            const auto &s = cpool::statement(request->stmt);
+            const char *values[2] = {request->params[0].c_str(),
+                                     request->params[1].c_str()};
+            if (!PQsendQueryPrepared(
+                    slot.conn, s.name, s.n_params, values, NULL, NULL, 0))
+            {
+                done.push_back(request);
+                continue;
+            }
+            slot.active = request;
+            request->sent = std::chrono::steady_clock::now();
+            int flushed = PQflush(slot.conn);
+            if (flushed < 0)
+            {
+                down(k);
+                continue;
+            }
+            watch(k, flushed == 1 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+        }
+    }
+
+    void on_ready(std::size_t k, std::uint32_t events)
+    {
+        auto &slot = slots[k];
+        switch (slot.state)
+        {
+        case State::Down:
+            return;
+        case State::Connecting:
+        {
+            auto polling = PQconnectPoll(slot.conn);
+            if (polling == PGRES_POLLING_FAILED)
+            {
+                down(k);
+            }
+            else if (polling != PGRES_POLLING_OK)
+            {
+                watch(k, polling == PGRES_POLLING_READING ? EPOLLIN
+                                                          : EPOLLOUT);
+            }
+            else if (PQsetnonblocking(slot.conn, 1) != 0 ||
+                     !cpool::send_prepares(slot.conn))
+            {
+                down(k);
+            }
+            else
+            {
+                slot.state = State::Preparing;
+                on_ready(k, EPOLLIN);
+            }
+            return;
+        }
+        case State::Preparing:
+        {
+            auto polling = cpool::poll_prepares(slot.conn);
+            if (polling == PGRES_POLLING_FAILED)
+            {
+                down(k);
+            }
+            else if (polling == PGRES_POLLING_OK)
+            {
+                slot.state = State::Ready;
+                watch(k, EPOLLIN);
+            }
+            else
+            {
+                watch(k,
+                      polling == PGRES_POLLING_WRITING ? EPOLLIN | EPOLLOUT
+                                                       : EPOLLIN);
+            }
+            return;
+        }
+        case State::Ready:
+            break;
+        }
+        if (events & EPOLLOUT)
+        {
+            int flushed = PQflush(slot.conn);
+            if (flushed < 0)
+            {
+                down(k);
+                return;
+            }
+            watch(k, flushed == 1 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+        }
+        if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+            return;
+        }
+        if (!PQconsumeInput(slot.conn))
+        {
+            down(k);
+            return;
+        }
+        while ((slot.active != nullptr || slot.draining) &&
+               !PQisBusy(slot.conn))
+        {
+            PGresult *res = PQgetResult(slot.conn);
+            if (res == nullptr)
+            {
+                if (slot.active != nullptr)
+                {
+                    metrics()
+                        .db_time[static_cast<int>(slot.active->stmt)]
+                        .observe(std::chrono::steady_clock::now() -
+                                 slot.active->sent);
+                    done.push_back(slot.active);
+                    slot.active = nullptr;
+                }
+                slot.draining = false;
+                break;
+            }
+            if (slot.active != nullptr && slot.active->result == nullptr)
+            {
+                slot.active->result = res;
+            }
+            else
+            {
+                PQclear(res);
+            }
+        }
+    }
+
+    /*
+     * Answer the queries past their deadline with no result. One that is
+     * already on a connection is let go and its answer read and dropped
+     * when it comes.
+     */
+    void expire()
+    {
+        auto now = std::chrono::steady_clock::now();
+        while (!waiting.empty() && waiting.front()->deadline <= now)
+        {
+            done.push_back(waiting.front());
+            waiting.pop_front();
+            backlog.fetch_sub(1, std::memory_order_relaxed);
+        }
+        for (std::size_t k = 0; k < slots.size(); ++k)
+        {
+            auto &slot = slots[k];
+            if (slot.active != nullptr && slot.active->deadline <= now)
+            {
+                PQclear(slot.active->result);
+                slot.active->result = nullptr;
+                done.push_back(slot.active);
+                slot.active = nullptr;
+                slot.draining = true;
+            }
+            if (slot.state == State::Down && slot.until <= now)
+            {
+                connect(k);
+            }
+            else if ((slot.state == State::Connecting ||
+                      slot.state == State::Preparing) &&
+                     slot.until <= now)
+            {
+                SPDLOG_WARN("async connection {} timed out connecting", k);
+                down(k);
+            }
+        }
+    }
+
+    /* Milliseconds until the next deadline, at most a second. */
+    int next_wait() const
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + std::chrono::seconds(1);
+        if (!waiting.empty())
+        {
+            next = std::min(next, waiting.front()->deadline);
+        }
+        for (const auto &slot : slots)
+        {
+            if (slot.active != nullptr)
+            {
+                next = std::min(next, slot.active->deadline);
+            }
+            if (slot.state != State::Ready)
+            {
+                next = std::min(next, slot.until);
+            }
+        }
+        if (next <= now)
+        {
+            return 0;
+        }
+        /* rounded up, so the deadline has passed when epoll returns */
+        return std::chrono::ceil<std::chrono::milliseconds>(next - now)
+            .count();
+    }
+
+    void step()
+    {
+        epoll_event events[64];
+        int n = epoll_wait(epoll_fd, events, 64, next_wait());
+        for (int i = 0; i < n; ++i)
+        {
+            if (events[i].data.u64 == WAKE_ID)
+            {
+                std::uint64_t count;
+                [[maybe_unused]] auto r = read(wake_fd, &count, sizeof(count));
+                std::lock_guard<std::mutex> lock(mutex);
+                waiting.insert(
+                    waiting.end(), submitted.begin(), submitted.end());
+                submitted.clear();
+            }
+            else
+            {
+                on_ready(events[i].data.u64, events[i].events);
+            }
+        }
+        expire();
+        dispatch();
+        resume_done();
+    }
+
+    void loop()
+    {
+        while (running)
+        {
+            step();
+        }
+        /* nothing is answered after stop(), fail what is left */
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            accepting = false;
+            waiting.insert(waiting.end(), submitted.begin(), submitted.end());
+            submitted.clear();
+        }
+        for (auto &slot : slots)
+        {
+            if (slot.active != nullptr)
+            {
+                PQclear(slot.active->result);
+                slot.active->result = nullptr;
+                done.push_back(slot.active);
+                slot.active = nullptr;
+            }
+        }
+        done.insert(done.end(), waiting.begin(), waiting.end());
+        backlog.fetch_sub(waiting.size(), std::memory_order_relaxed);
+        waiting.clear();
+        resume_done();
+    }
+
+    void resume_done()
+    {
+        /* a resumed coroutine may submit again, which only touches
+         * `submitted`, so walking a local copy is enough */
+        std::vector<Request *> ready;
+        ready.swap(done);
+        for (Request *request : ready)
+        {
+            request->waiter.resume();
+        }
+    }
+
+    std::string conninfo;
+    Options options;
+    std::vector<Slot> slots;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread worker;
+    std::mutex mutex;
+    bool accepting = false;
+    std::vector<Request *> submitted;
+    /* submitted or waiting, read by submit() for the queue cap */
+    std::atomic<std::size_t> backlog{0};
+    /* owned by the engine thread */
+    std::deque<Request *> waiting;
+    std::vector<Request *> done;
+};
+
+}  // namespace nckd
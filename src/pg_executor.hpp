@@ -0,0 +1,168 @@
+#pragma once
+#include "utils.hpp"
+#include <array>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <libpq-fe.h>
+
+namespace nckd
+{
+struct PGResultDeleter
+{
+    void operator()(PGresult *res) const
+    {
+        PQclear(res);
+    }
+};
+using PGResultPtr = std::unique_ptr<PGresult, PGResultDeleter>;
+
+struct Query
+{
+    cpool::Stmt stmt;
+    std::array<const char *, 2> params;
+};
+
+/* Text form of a one dimensional array, every element double quoted. */
+inline std::string pg_array_literal(const std::vector<std::string_view> &items)
+{
+    std::string out = "{";
+    for (const auto &item : items)
+    {
+        if (out.size() > 1)
+        {
+            out += ',';
+        }
+        out += '"';
+        for (char c : item)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+            }
+            out += c;
+        }
+        out += '"';
+    }
+    out += '}';
+    return out;
+}
+
+/*
+ * Runs registered statements on a checked out PGConnection.
+ *
+ * A single statement goes out on its own: with autocommit it is already
+ * atomic, so wrapping it in BEGIN/END only adds two round trips. Several
+ * statements are sent with libpq pipeline mode and closed by one Sync
+ * message; the server runs everything up to the Sync as one implicit
+ * transaction, so the whole batch commits or rolls back together and
+ * costs a single round trip.
+ */
+class PGExecutor
+{
+  public:
+    explicit PGExecutor(cpool::PGConnection &connection)
+        : connection(connection)
+    {
+    }
+
+    PGResultPtr run(cpool::Stmt stmt,
+                    std::initializer_list<const char *> params)
+    {
+        return PGResultPtr(connection.exec_prepared(stmt, params.begin()));
+    }
+
+    /*
+     * Returns one result per query, in order. After a failure the rest of
+     * the batch comes back as PGRES_PIPELINE_ABORTED; an empty vector means
+     * nothing could be sent at all.
+     */
+    std::vector<PGResultPtr> run_transaction(const std::vector<Query> &queries)
+    {
+        std::vector<PGResultPtr> results;
+        if (!connection.ensure_ready())
+        {
+            return results;
+        }
+        PGconn *conn = connection.acquire();
+        TRACE_SPAN("pipeline");
+        /* the whole flight is accounted to its first statement */
+        nckd::ScopedTimer timer(nckd::metrics().db_time[static_cast<int>(
+            queries.empty() ? cpool::Stmt::FindByToken : queries[0].stmt)]);
+        if (!PQenterPipelineMode(conn))
+        {
+            return results;
+        }
+        std::size_t sent = 0;
+        for (const auto &q : queries)
+        {
+            const auto &s = cpool::statement(q.stmt);
+            if (!PQsendQueryPrepared(conn,
+                                     s.name,
+                                     s.n_params,
+                                     q.params.data(),
+                                     NULL,
+                                     NULL,
+                                     0))
+            {
+                break;
+            }
+            ++sent;
+        }
+        if (!PQpipelineSync(conn))
+        {
+            sent = 0;
+        }
+        results.reserve(queries.size());
+        for (std::size_t k = 0; k < sent; ++k)
+        {
+            results.emplace_back(PQgetResult(conn));
+            /* each query's results are terminated by a NULL */
+            while (PGresult *extra = PQgetResult(conn))
+            {
+                PQclear(extra);
+            }
+        }
+        /* drain up to and including the Sync */
+        while (PGresult *res = PQgetResult(conn))
+        {
+            bool synced = PQresultStatus(res) == PGRES_PIPELINE_SYNC;
+            PQclear(res);
+            if (synced)
+            {
+                break;
+            }
+        }
+        PQexitPipelineMode(conn);
+        while (results.size() < queries.size())
+        {
+            results.emplace_back(nullptr);
+        }
+        return results;
+    }
+
+  private:
+    cpool::PGConnection &connection;
+};
+
+/* True when every result of a transaction completed successfully. */
+inline bool all_ok(const std::vector<PGResultPtr> &results)
+{
+    if (results.empty())
+    {
+        return false;
+    }
+    for (const auto &res : results)
+    {
+        auto status = PQresultStatus(res.get());
+        if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace nckd
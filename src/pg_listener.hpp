@@ -0,0 +1,134 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <libpq-fe.h>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+
+namespace nckd
+{
+/* Channel /login/ notifies with the token it just rotated out. */
+constexpr const char *TOKEN_INVALIDATE_CHANNEL = "nckd_token_invalidate";
+
+/*
+ * Background LISTEN on a dedicated connection. Every payload received on
+ * `channel` is handed to `on_notify` from the listener thread. The
+ * connection is re-established with a backoff when it drops; the callback
+ * is told about it through `on_reconnect` since notifications sent while
+ * we were away are lost.
+ */
+class PGListener
+{
+  public:
+    PGListener(std::string conninfo,
+               std::string channel,
+               std::function<void(const char *)> on_notify,
+               std::function<void()> on_reconnect = nullptr)
+        : conninfo(std::move(conninfo)),
+          channel(std::move(channel)),
+          on_notify(std::move(on_notify)),
+          on_reconnect(std::move(on_reconnect))
+    {
+    }
+    PGListener(const PGListener &) = delete;
+    PGListener &operator=(const PGListener &) = delete;
+    ~PGListener()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        running = true;
+        worker = std::thread([this] { run(); });
+    }
+
+    void stop()
+    {
+        running = false;
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+
+  private:
+    PGconn *open()
+    {
+        PGconn *conn = PQconnectdb(conninfo.c_str());
+        if (PQstatus(conn) != CONNECTION_OK)
+        {
+            SPDLOG_WARN("listener connection failed: {}", PQerrorMessage(conn));
+            PQfinish(conn);
+            return nullptr;
+        }
+        char *ident = PQescapeIdentifier(conn, channel.c_str(), channel.size());
+        std::string sql = std::string("LISTEN ") + ident;
+        PQfreemem(ident);
+        PGresult *res = PQexec(conn, sql.c_str());
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+        if (!ok)
+        {
+            SPDLOG_WARN("LISTEN {} failed: {}", channel, PQerrorMessage(conn));
+            PQfinish(conn);
+            return nullptr;
+        }
+        return conn;
+    }
+
+    void run()
+    {
+        auto backoff = std::chrono::milliseconds(100);
+        bool first = true;
+        while (running)
+        {
+            PGconn *conn = open();
+            if (conn == nullptr)
+            {
+                std::this_thread::sleep_for(backoff);
+                backoff =
+                    std::min(backoff * 2, std::chrono::milliseconds(5000));
+                continue;
+            }
+            backoff = std::chrono::milliseconds(100);
+            if (!first && on_reconnect)
+            {
+                on_reconnect();
+            }
+            first = false;
+            pollfd pfd{PQsocket(conn), POLLIN, 0};
+            while (running && PQstatus(conn) == CONNECTION_OK)
+            {
+                /* wake up periodically to notice stop() */
+                if (poll(&pfd, 1, 250) < 0 && errno != EINTR)
+                {
+                    break;
+                }
+                if (!PQconsumeInput(conn))
+                {
+                    break;
+                }
+                while (PGnotify *notify = PQnotifies(conn))
+                {
+                    on_notify(notify->extra);
+                    PQfreemem(notify);
+                }
+            }
+            PQfinish(conn);
+        }
+    }
+
+    std::string conninfo;
+    std::string channel;
+    std::function<void(const char *)> on_notify;
+    std::function<void()> on_reconnect;
+    std::atomic<bool> running{false};
+    std::thread worker;
+};
+
+}  // namespace nckd
@@ -0,0 +1,240 @@
+#pragma once
+#include "pg_async.hpp"
+#include "pg_executor.hpp"
+#include "replica.hpp"
+#include "token_batch.hpp"
+#include "trace.hpp"
+#include "user_store.hpp"
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <libpq-fe.h>
+
+namespace nckd
+{
+/*
+ * UserStore on the users table.
+ *
+ * Token lookups go to a replica first when one is usable, and to the
+ * primary when it fails or does not know the token, which may just have
+ * been rotated there. They use the AsyncPGEngine when there is one.
+ *
+ * A replica may not have applied a rotation whose NOTIFY already reached
+ * this node, so it can still accept a revoked token. The caller caches
+ * its answers for at most the replica lag limit, which bounds the window
+ * to about twice that limit plus one lag check interval.
+ * Everything else runs on the pool `pool()` returns, and token rotations
+ * go through the TokenBatchWriter.
+ */
+class PGUserStore final : public UserStore
+{
+  public:
+    PGUserStore(std::function<cpool::PGPool &()> pool,
+                AsyncPGEngine *engine,
+                ReplicaRouter &replicas,
+                TokenBatchWriter &writer)
+        : pool(std::move(pool)),
+          engine(engine),
+          replicas(replicas),
+          writer(writer)
+    {
+    }
+
+    StoreStatus find_by_token(std::string_view token,
+                              AuthEntry &out,
+                              bool &from_replica) override
+    {
+        std::string key(token);
+        from_replica = false;
+        if (auto *replica = replicas.pick())
+        {
+            auto res = lookup(replica->engine.get(), *replica->pool, key);
+            if (res && PQresultStatus(res.get()) == PGRES_TUPLES_OK)
+            {
+                if (PQntuples(res.get()) == 1)
+                {
+                    metrics().replica_reads.add();
+                    from_replica = true;
+                    return entry(res, out);
+                }
+            }
+            else if (res)
+            {
+                replicas.failed(*replica);
+            }
+            metrics().replica_fallbacks.add();
+        }
+        auto res = lookup(engine, pool(), key);
+        if (!res)
+        {
+            return StoreStatus::Busy;
+        }
+        if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+        {
+            return failed("FETCH ALL", res);
+        }
+        if (PQntuples(res.get()) != 1)
+        {
+            return StoreStatus::NotFound;
+        }
+        return entry(res, out);
+    }
+
+    StoreStatus find_by_email(std::string_view email, UserRecord &out) override
+    {
+        auto connection = pool().acquire();
+        if (!connection)
+        {
+            return StoreStatus::Busy;
+        }
+        std::string key(email);
+        auto res = PGExecutor(*connection).run(cpool::Stmt::FindByEmail,
+                                               {key.c_str()});
+        if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+        {
+            return failed("FETCH ALL", res);
+        }
+        if (PQntuples(res.get()) != 1)
+        {
+            return StoreStatus::NotFound;
+        }
+        out.password = PQgetvalue(res.get(), 0, 0);
+        out.id = PQgetvalue(res.get(), 0, 1);
+        out.token = PQgetisnull(res.get(), 0, 2) ? ""
+                                                 : PQgetvalue(res.get(), 0, 2);
+        out.role = PQgetvalue(res.get(), 0, 3);
+        return StoreStatus::Ok;
+    }
+
+    StoreStatus email_exists(std::string_view email) override
+    {
+        auto connection = pool().acquire();
+        if (!connection)
+        {
+            return StoreStatus::Busy;
+        }
+        std::string key(email);
+        auto res = PGExecutor(*connection).run(cpool::Stmt::EmailExists,
+                                               {key.c_str()});
+        if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+        {
+            return failed("FETCH ALL", res);
+        }
+        return PQntuples(res.get()) > 0 ? StoreStatus::Ok
+                                        : StoreStatus::NotFound;
+    }
+
+    StoreStatus insert_user(std::string_view email,
+                            std::string_view password) override
+    {
+        auto connection = pool().acquire();
+        if (!connection)
+        {
+            return StoreStatus::Busy;
+        }
+        std::string e(email), p(password);
+        /* 单条插入语句自动提交，不需要事务块 */
+        auto res = PGExecutor(*connection).run(cpool::Stmt::InsertUser,
+                                               {e.c_str(), p.c_str()});
+        if (PQresultStatus(res.get()) != PGRES_COMMAND_OK)
+        {
+            /* unique_violation: registered in the meantime */
+            const char *state =
+                PQresultErrorField(res.get(), PG_DIAG_SQLSTATE);
+            if (state != nullptr && strcmp(state, "23505") == 0)
+            {
+                return StoreStatus::Exists;
+            }
+            return failed("INSERT command", res);
+        }
+        return StoreStatus::Ok;
+    }
+
+    StoreStatus set_token(std::string_view uid,
+                          std::string_view token,
+                          std::string_view old_token) override
+    {
+        /* 更新 token 并通知其他节点旧 token 失效，与并发登录合并提交 */
+        auto written = writer.submit(
+            std::string(uid), std::string(token), std::string(old_token));
+        if (!written)
+        {
+            return StoreStatus::Busy;
+        }
+        TRACE_SPAN("token_commit");
+        return written->get() ? StoreStatus::Ok : StoreStatus::Error;
+    }
+
+    StoreStatus update_password(std::string_view uid,
+                                std::string_view password,
+                                std::string_view old_password) override
+    {
+        auto connection = pool().acquire();
+        if (!connection)
+        {
+            return StoreStatus::Busy;
+        }
+        std::string id(uid), p(password), old(old_password);
+        auto res = PGExecutor(*connection)
+                       .run(cpool::Stmt::UpdatePassword,
+                            {id.c_str(), p.c_str(), old.c_str()});
+        if (PQresultStatus(res.get()) != PGRES_COMMAND_OK)
+        {
+            return failed("UPDATE command", res);
+        }
+        return strcmp(PQcmdTuples(res.get()), "1") == 0
+                   ? StoreStatus::Ok
+                   : StoreStatus::NotFound;
+    }
+
+  private:
+    /* Suspends on the engine rather than holding a pool connection. */
+    static Task<PGResultPtr> query(AsyncPGEngine &engine, std::string token)
+    {
+        co_return co_await engine.query(cpool::Stmt::FindByToken, token);
+    }
+
+    /* nullptr when no connection was free. */
+    static PGResultPtr lookup(AsyncPGEngine *engine,
+                              cpool::PGPool &pool,
+                              const std::string &token)
+    {
+        TRACE_SPAN("token_lookup");
+        if (engine)
+        {
+            return sync_wait(query(*engine, token));
+        }
+        auto connection = pool.acquire();
+        if (!connection)
+        {
+            return nullptr;
+        }
+        /* 单条只读查询，不需要事务块 */
+        return PGExecutor(*connection).run(cpool::Stmt::FindByToken,
+                                           {token.c_str()});
+    }
+
+    static StoreStatus entry(const PGResultPtr &res, AuthEntry &out)
+    {
+        out.role = PQgetvalue(res.get(), 0, 0);
+        out.uid = PQgetvalue(res.get(), 0, 1);
+        return StoreStatus::Ok;
+    }
+
+    static StoreStatus failed(const char *what, const PGResultPtr &res)
+    {
+        fprintf(stderr,
+                "%s failed: %s",
+                what,
+                PQresultErrorMessage(res.get()));
+        return StoreStatus::Error;
+    }
+
+    std::function<cpool::PGPool &()> pool;
+    AsyncPGEngine *engine;
+    ReplicaRouter &replicas;
+    TokenBatchWriter &writer;
+};
+
+}  // namespace nckd
@@ -0,0 +1,119 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/random.h>
+
+namespace nckd
+{
+/* Length of the opaque session tokens handed out by /login/. */
+constexpr std::size_t TOKEN_LENGTH = 48;
+
+/* [0-9A-Za-z] */
+constexpr std::size_t ALNUM_SIZE = 62;
+
+/*
+ * Kernel CSPRNG output buffered per thread. A refill is one getrandom()
+ * call for BUFFER bytes, enough for about eighty 48 character tokens, so
+ * minting a token is normally a memcpy out of thread local storage.
+ * Bytes are wiped from the buffer as they are handed out.
+ */
+class SecureRandom
+{
+  public:
+    static constexpr std::size_t BUFFER = 4096;
+
+    static void fill(void *out, std::size_t n)
+    {
+        auto &self = local();
+        auto *dst = static_cast<unsigned char *>(out);
+        while (n > 0)
+        {
+            if (self.pos == BUFFER)
+            {
+                self.refill();
+            }
+            std::size_t take = std::min(n, BUFFER - self.pos);
+            std::memcpy(dst, self.buf + self.pos, take);
+            std::memset(self.buf + self.pos, 0, take);
+            self.pos += take;
+            dst += take;
+            n -= take;
+        }
+    }
+
+  private:
+    static SecureRandom &local()
+    {
+        thread_local SecureRandom self;
+        return self;
+    }
+
+    void refill()
+    {
+        std::size_t got = 0;
+        while (got < BUFFER)
+        {
+            ssize_t n = getrandom(buf + got, BUFFER - got, 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::runtime_error("getrandom failed");
+            }
+            got += static_cast<std::size_t>(n);
+        }
+        pos = 0;
+    }
+
+    unsigned char buf[BUFFER];
+    std::size_t pos = BUFFER;
+};
+
+/*
+ * Fill out[0, n) with uniformly distributed [0-9A-Za-z]. Each random byte
+ * is cut to 6 bits and values 62 and 63 are rejected, which keeps the
+ * distribution exact. The loop has no data dependent branches: every byte
+ * is written through the table and the output index only advances when
+ * the value was in range.
+ */
+inline void random_alnum(char *out, std::size_t n)
+{
+    /* 64 entries so rejected values still index into the table */
+    static constexpr char table[64 + 1] =
+        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz00";
+    unsigned char bytes[64];
+    char scratch[sizeof(bytes)];
+    std::size_t done = 0;
+    while (done < n)
+    {
+        /* ask for a little more than needed to absorb the rejections */
+        std::size_t want = std::min(sizeof(bytes), (n - done) * 33 / 32 + 2);
+        SecureRandom::fill(bytes, want);
+        std::size_t k = 0;
+        for (std::size_t i = 0; i < want; ++i)
+        {
+            unsigned v = bytes[i] & 63u;
+            scratch[k] = table[v];
+            k += v < ALNUM_SIZE;
+        }
+        std::size_t take = std::min(k, n - done);
+        std::memcpy(out + done, scratch, take);
+        done += take;
+    }
+}
+
+inline std::string random_alnum(std::size_t n)
+{
+    std::string s(n, '\0');
+    random_alnum(s.data(), n);
+    return s;
+}
+
+}  // namespace nckd
@@ -0,0 +1,247 @@
+#pragma once
+#include "pg_async.hpp"
+#include "pg_executor.hpp"
+#include "utils.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <libpq-fe.h>
+#include <spdlog/spdlog.h>
+
+namespace nckd
+{
+/*
+ * Milliseconds the server lags behind its primary. A primary, or any server
+ * not in recovery, is 0. So is a standby that replayed everything it
+ * received, since an idle primary would otherwise look like growing lag.
+ * That only holds while WAL is streaming in: a standby whose WAL receiver
+ * is gone stops receiving too and would read 0 forever, so it is -1, i.e.
+ * unusable. The receiver's status needs pg_read_all_stats to be visible;
+ * without it a running receiver counts as streaming.
+ */
+constexpr const char *REPLICA_LAG_SQL =
+    "SELECT CASE WHEN NOT pg_is_in_recovery() THEN 0 "
+    "WHEN NOT EXISTS (SELECT 1 FROM pg_stat_wal_receiver "
+    "WHERE COALESCE(status, 'streaming') = 'streaming') THEN -1 "
+    "WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+    "ELSE COALESCE(EXTRACT(EPOCH FROM now() - "
+    "pg_last_xact_replay_timestamp()) * 1000, 0)::int8 END;";
+
+/*
+ * Read-only servers for the /webhook/ token lookups, each with its own
+ * pool and, optionally, its own AsyncPGEngine.
+ *
+ * A checker thread measures every replica's lag every `check_interval`.
+ * pick() hands out the replicas that answered and are within `max_lag` in
+ * round robin order, and nullptr once none is left, so the caller goes to
+ * the primary. A lookup that fails on a replica marks it down right away;
+ * it comes back with the next passing check.
+ */
+class ReplicaRouter
+{
+  public:
+    struct Options
+    {
+        cpool::PGPool::Options pool;
+        /* non-blocking connections per replica, 0 uses only the pool */
+        std::size_t async_connections = 0;
+        std::chrono::milliseconds max_lag{1000};
+        std::chrono::milliseconds check_interval{2000};
+    };
+
+    struct Replica
+    {
+        std::string url;
+        std::unique_ptr<cpool::PGPool> pool;
+        std::unique_ptr<AsyncPGEngine> engine;
+        std::atomic<bool> healthy{false};
+        std::atomic<std::int64_t> lag_ms{0};
+    };
+
+    ReplicaRouter(const std::vector<std::string> &urls,
+                  const Options &options)
+        : options(options)
+    {
+        for (const auto &url : urls)
+        {
+            auto replica = std::make_unique<Replica>();
+            replica->url = url;
+            replica->pool = std::make_unique<cpool::PGPool>(
+                replica->url.c_str(), options.pool);
+            if (options.async_connections > 0)
+            {
+                AsyncPGEngine::Options engine_options;
+                engine_options.timeout = options.pool.acquire_timeout;
+                replica->engine = std::make_unique<AsyncPGEngine>(
+                    url, options.async_connections, engine_options);
+                if (!replica->engine->start())
+                {
+                    SPDLOG_WARN("async engine unavailable for a replica, "
+                                "its pool is used");
+                    replica->engine.reset();
+                }
+            }
+            replicas.push_back(std::move(replica));
+        }
+        if (!replicas.empty())
+        {
+            check_all();
+            checker = std::thread([this] { check_loop(); });
+        }
+    }
+    ReplicaRouter(const ReplicaRouter &) = delete;
+    ReplicaRouter &operator=(const ReplicaRouter &) = delete;
+    ~ReplicaRouter()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        if (checker.joinable())
+        {
+            checker.join();
+        }
+        for (auto &replica : replicas)
+        {
+            if (replica->engine)
+            {
+                replica->engine->stop();
+            }
+        }
+    }
+
+    bool enabled() const
+    {
+        return !replicas.empty();
+    }
+
+    /* Next usable replica, nullptr when the primary has to answer. */
+    Replica *pick()
+    {
+        auto n = replicas.size();
+        if (n == 0)
+        {
+            return nullptr;
+        }
+        auto start = next.fetch_add(1, std::memory_order_relaxed);
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            auto &replica = *replicas[(start + k) % n];
+            if (replica.healthy.load(std::memory_order_relaxed))
+            {
+                return &replica;
+            }
+        }
+        return nullptr;
+    }
+
+    /* A query on `replica` failed; skip it until its next check passes. */
+    void failed(Replica &replica)
+    {
+        if (replica.healthy.exchange(false, std::memory_order_relaxed))
+        {
+            SPDLOG_WARN("replica marked down after a failed lookup");
+        }
+    }
+
+    std::size_t size() const
+    {
+        return replicas.size();
+    }
+
+    /* The k-th replica in the order of the urls given. */
+    Replica &replica(std::size_t k)
+    {
+        return *replicas[k];
+    }
+
+    std::size_t healthy() const
+    {
+        std::size_t n = 0;
+        for (const auto &replica : replicas)
+        {
+            n += replica->healthy.load(std::memory_order_relaxed) ? 1 : 0;
+        }
+        return n;
+    }
+
+    std::size_t size_in_use() const
+    {
+        std::size_t n = 0;
+        for (const auto &replica : replicas)
+        {
+            n += replica->pool->size_in_use();
+        }
+        return n;
+    }
+
+  private:
+    void check_loop()
+    {
+        std::unique_lock lock(mutex);
+        while (!wakeup.wait_for(
+            lock, options.check_interval, [this] { return stopping; }))
+        {
+            lock.unlock();
+            check_all();
+            lock.lock();
+        }
+    }
+
+    void check_all()
+    {
+        for (auto &replica : replicas)
+        {
+            auto lag = measure_lag(*replica);
+            bool up = lag >= 0 && lag <= options.max_lag.count();
+            replica->lag_ms.store(lag, std::memory_order_relaxed);
+            if (replica->healthy.exchange(up, std::memory_order_relaxed) !=
+                up)
+            {
+                if (up)
+                {
+                    SPDLOG_INFO("replica is up, lag {} ms", lag);
+                }
+                else
+                {
+                    SPDLOG_WARN("replica is down, lag {} ms", lag);
+                }
+            }
+        }
+    }
+
+    /* -1 when the replica could not be asked. */
+    std::int64_t measure_lag(Replica &replica)
+    {
+        auto connection = replica.pool->acquire(options.check_interval);
+        if (!connection || !connection->ensure_ready())
+        {
+            return -1;
+        }
+        PGResultPtr res(PQexec(connection->acquire(), REPLICA_LAG_SQL));
+        if (PQresultStatus(res.get()) != PGRES_TUPLES_OK ||
+            PQntuples(res.get()) != 1)
+        {
+            return -1;
+        }
+        return std::atoll(PQgetvalue(res.get(), 0, 0));
+    }
+
+    Options options;
+    std::vector<std::unique_ptr<Replica>> replicas;
+    std::atomic<std::size_t> next{0};
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::thread checker;
+};
+
+}  // namespace nckd
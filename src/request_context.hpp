@@ -0,0 +1,177 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <memory_resource>
+#include <string_view>
+
+namespace nckd
+{
+/* Headers handlers read, found in one pass over the request's headers. */
+enum class Header
+{
+    Authorization,
+    ContentType,
+    UserAgent,
+    XForwardedFor,
+    Count,
+};
+
+constexpr std::string_view HEADER_NAMES[] = {
+    "authorization", "content-type", "user-agent", "x-forwarded-for"};
+
+static_assert(std::size(HEADER_NAMES) ==
+              static_cast<std::size_t>(Header::Count));
+/* RequestContext tells the names apart by their length */
+static_assert([] {
+    for (auto a : HEADER_NAMES)
+    {
+        for (auto b : HEADER_NAMES)
+        {
+            if (a != b && a.size() == b.size())
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}());
+
+/* `name` equals the lower case `lower`, ignoring case. */
+constexpr bool equals_lower(std::string_view name, std::string_view lower)
+{
+    if (name.size() != lower.size())
+    {
+        return false;
+    }
+    for (std::size_t k = 0; k < name.size(); ++k)
+    {
+        char c = name[k];
+        if (c >= 'A' && c <= 'Z')
+        {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+        if (c != lower[k])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Scratch memory for one request: a monotonic arena over a buffer of the
+ * worker thread, released in bulk when the next request starts. Requests
+ * that need more than SIZE spill over to the heap.
+ */
+class RequestArena
+{
+  public:
+    static constexpr std::size_t SIZE = 4096;
+
+    std::pmr::memory_resource *resource()
+    {
+        return &arena;
+    }
+
+    void reset()
+    {
+        arena.release();
+    }
+
+    /* The parts joined, valid until the next reset(). */
+    std::string_view concat(std::initializer_list<std::string_view> parts)
+    {
+        std::size_t size = 0;
+        for (auto part : parts)
+        {
+            size += part.size();
+        }
+        auto *out = static_cast<char *>(arena.allocate(size, 1));
+        auto *end = out;
+        for (auto part : parts)
+        {
+            memcpy(end, part.data(), part.size());
+            end += part.size();
+        }
+        return {out, size};
+    }
+
+  private:
+    alignas(std::max_align_t) std::byte buffer[SIZE];
+    std::pmr::monotonic_buffer_resource arena{
+        buffer, SIZE, std::pmr::new_delete_resource()};
+};
+
+/*
+ * What the current request's handler may use without allocating: views of
+ * the well-known headers, into the request that is being handled, and the
+ * arena. begin() is called from pre-routing, before any handler runs.
+ *
+ * A header sent more than once keeps its first value, except the list
+ * valued X-Forwarded-For, whose lines are joined with ", " in the arena as
+ * RFC 9110 section 5.3 combines them; a proxy may add its own line instead
+ * of appending to the client's.
+ */
+class RequestContext
+{
+  public:
+    /* `headers` is a multimap of name and value, like httplib::Headers. */
+    template <class Headers>
+    void begin(const Headers &headers)
+    {
+        arena.reset();
+        known.fill({});
+        for (const auto &[name, value] : headers)
+        {
+            auto k = index_of(name);
+            if (k == NONE)
+            {
+                continue;
+            }
+            if (known[k].empty())
+            {
+                known[k] = value;
+            }
+            else if (k == FORWARDED_FOR)
+            {
+                known[k] = arena.concat({known[k], ", ", value});
+            }
+        }
+    }
+
+    /* Empty when the request does not have it. */
+    std::string_view header(Header h) const
+    {
+        return known[static_cast<std::size_t>(h)];
+    }
+
+    RequestArena arena;
+
+  private:
+    static constexpr std::size_t COUNT =
+        static_cast<std::size_t>(Header::Count);
+    static constexpr std::size_t NONE = COUNT;
+    static constexpr std::size_t FORWARDED_FOR =
+        static_cast<std::size_t>(Header::XForwardedFor);
+
+    static std::size_t index_of(std::string_view name)
+    {
+        /* the lengths differ, so one comparison decides */
+        for (std::size_t k = 0; k < COUNT; ++k)
+        {
+            if (name.size() == HEADER_NAMES[k].size())
+            {
+                return equals_lower(name, HEADER_NAMES[k]) ? k : NONE;
+            }
+        }
+        return NONE;
+    }
+
+    std::array<std::string_view, COUNT> known{};
+};
+
+inline thread_local RequestContext request_context;
+
+}  // namespace nckd
@@ -0,0 +1,141 @@
+#pragma once
+#include "metrics.hpp"
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace nckd
+{
+struct RouteSpec
+{
+    std::string_view method;
+    std::string_view path;
+    /* label in nckd_route_matches_total */
+    const char *name;
+    /* what the request and latency metrics count it as */
+    Route route = Route::Other;
+};
+
+/*
+ * Exact method and path matches, resolved with a perfect hash found at
+ * compile time: one FNV-1a pass over the path picks the only slot the
+ * route can be in, and one comparison confirms it. Patterns with
+ * parameters stay with cpp-httplib's regex routing.
+ */
+template <std::size_t N>
+class StaticRoutes
+{
+  public:
+    static constexpr std::size_t SLOTS = std::bit_ceil(N * 2);
+    /* find() result for a request no route matches */
+    static constexpr std::size_t NONE = N;
+
+    constexpr explicit StaticRoutes(const RouteSpec (&specs)[N])
+    {
+        for (std::size_t k = 0; k < N; ++k)
+        {
+            this->specs[k] = specs[k];
+        }
+        for (seed = 1; !place(); ++seed)
+        {
+            /* a handful of routes in twice as many slots needs few tries */
+            if (seed > 1'000'000)
+            {
+                throw "no perfect hash for these routes";
+            }
+        }
+    }
+
+    constexpr std::size_t find(std::string_view method,
+                               std::string_view path) const
+    {
+        auto k = slots[slot(method, path)];
+        return k != NONE && specs[k].path == path && specs[k].method == method
+                   ? k
+                   : NONE;
+    }
+
+    constexpr const RouteSpec &operator[](std::size_t k) const
+    {
+        return specs[k];
+    }
+
+    static constexpr std::size_t size()
+    {
+        return N;
+    }
+
+  private:
+    constexpr std::size_t slot(std::string_view method,
+                               std::string_view path) const
+    {
+        std::uint64_t h = 0xcbf29ce484222325ull ^ seed;
+        /* GET and POST differ in their first letter */
+        h = (h ^ static_cast<unsigned char>(method.empty() ? 0 : method[0])) *
+            0x100000001b3ull;
+        for (char c : path)
+        {
+            h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+        }
+        return (h ^ h >> 32) & (SLOTS - 1);
+    }
+
+    constexpr bool place()
+    {
+        slots.fill(NONE);
+        for (std::size_t k = 0; k < N; ++k)
+        {
+            auto &s = slots[slot(specs[k].method, specs[k].path)];
+            if (s != NONE)
+            {
+                return false;
+            }
+            s = k;
+        }
+        return true;
+    }
+
+    std::array<RouteSpec, N> specs{};
+    std::array<std::size_t, SLOTS> slots{};
+    std::uint64_t seed = 0;
+};
+
+/* Endpoints served from the static table, in the order of ENDPOINTS. */
+enum class Endpoint
+{
+    Webhook,
+    Login,
+    Register,
+    Metrics,
+    Trace,
+    Stop,
+    Count,
+};
+
+constexpr RouteSpec ENDPOINTS[] = {
+    {"GET", "/webhook/", "webhook", Route::Webhook},
+    {"POST", "/login/", "login", Route::Login},
+    {"POST", "/register/", "register", Route::Register},
+    {"GET", "/metrics", "metrics"},
+    {"GET", "/trace", "trace"},
+    {"GET", "/stop", "stop"},
+};
+
+constexpr StaticRoutes ROUTE_TABLE(ENDPOINTS);
+
+static_assert(ROUTE_TABLE.size() == static_cast<std::size_t>(Endpoint::Count));
+static_assert(ROUTE_TABLE.size() <= MAX_ENDPOINTS);
+static_assert(ROUTE_TABLE.find("GET", "/webhook/") ==
+              static_cast<std::size_t>(Endpoint::Webhook));
+static_assert(ROUTE_TABLE.find("POST", "/webhook/") == ROUTE_TABLE.NONE);
+
+/* Metrics route of a ROUTE_TABLE.find() result. */
+constexpr Route endpoint_route(std::size_t endpoint)
+{
+    return endpoint == ROUTE_TABLE.NONE ? Route::Other
+                                        : ROUTE_TABLE[endpoint].route;
+}
+
+}  // namespace nckd
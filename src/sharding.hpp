@@ -0,0 +1,241 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <httplib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spdlog/spdlog.h>
+#include <sys/socket.h>
+
+namespace nckd
+{
+/* Shard of the request being handled on this thread, set by pre-routing. */
+inline thread_local std::size_t current_shard = 0;
+
+/* CPUs this process may run on, in order. */
+inline std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+/*
+ * N cpp-httplib servers bound to the same address with SO_REUSEPORT, so
+ * the kernel spreads incoming connections over N accept queues instead of
+ * one. Routes and handlers are registered once and installed on every
+ * shard.
+ *
+ * Each shard listens on its own thread. With pinning, that thread is bound
+ * to one CPU before listen() creates the shard's worker pool, and the
+ * workers inherit the binding. A single shard without pinning or a thread
+ * count behaves exactly like a plain httplib::Server.
+ */
+class ShardedServer
+{
+  public:
+    struct Options
+    {
+        std::size_t shards = 1;
+        /* worker threads per shard, 0 keeps the library default */
+        std::size_t threads = 0;
+        bool pin = false;
+    };
+
+    explicit ShardedServer(const Options &options) : options(options)
+    {
+        for (std::size_t k = 0; k < std::max<std::size_t>(options.shards, 1);
+             ++k)
+        {
+            servers.push_back(std::make_unique<httplib::Server>());
+        }
+        set_pre_routing_handler([](const httplib::Request &,
+                                   httplib::Response &) {
+            return httplib::Server::HandlerResponse::Unhandled;
+        });
+    }
+
+    std::size_t size() const
+    {
+        return servers.size();
+    }
+
+    /* HTTP worker threads of all shards together. */
+    static std::size_t worker_threads(const Options &options)
+    {
+        std::size_t per_shard = options.threads > 0
+                                    ? options.threads
+                                    : CPPHTTPLIB_THREAD_POOL_COUNT;
+        return std::max<std::size_t>(options.shards, 1) * per_shard;
+    }
+
+    bool is_valid() const
+    {
+        for (const auto &s : servers)
+        {
+            if (!s->is_valid())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    ShardedServer &Get(const std::string &pattern,
+                       httplib::Server::Handler handler)
+    {
+        for (auto &s : servers)
+        {
+            s->Get(pattern, handler);
+        }
+        return *this;
+    }
+
+    ShardedServer &Post(const std::string &pattern,
+                        httplib::Server::Handler handler)
+    {
+        for (auto &s : servers)
+        {
+            s->Post(pattern, handler);
+        }
+        return *this;
+    }
+
+    ShardedServer &set_error_handler(httplib::Server::Handler handler)
+    {
+        for (auto &s : servers)
+        {
+            s->set_error_handler(handler);
+        }
+        return *this;
+    }
+
+    ShardedServer &set_exception_handler(
+        httplib::Server::ExceptionHandler handler)
+    {
+        for (auto &s : servers)
+        {
+            s->set_exception_handler(handler);
+        }
+        return *this;
+    }
+
+    /* Runs before routing; current_shard is already set for the handler. */
+    ShardedServer &set_pre_routing_handler(
+        httplib::Server::HandlerWithResponse handler)
+    {
+        for (std::size_t k = 0; k < servers.size(); ++k)
+        {
+            servers[k]->set_pre_routing_handler(
+                [k, handler](const httplib::Request &req,
+                             httplib::Response &res) {
+                    current_shard = k;
+                    return handler(req, res);
+                });
+        }
+        return *this;
+    }
+
+    ShardedServer &set_logger(httplib::Server::Logger logger)
+    {
+        for (auto &s : servers)
+        {
+            s->set_logger(logger);
+        }
+        return *this;
+    }
+
+    /* Blocks until every shard stopped; false if one could not bind. */
+    bool listen(const std::string &host, int port)
+    {
+        auto cpus = allowed_cpus();
+        for (auto &s : servers)
+        {
+            if (servers.size() > 1)
+            {
+                s->set_socket_options([](httplib::socket_t sock) {
+                    int yes = 1;
+                    setsockopt(
+                        sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+                    setsockopt(
+                        sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+                });
+            }
+            if (options.threads > 0)
+            {
+                auto threads = options.threads;
+                s->new_task_queue = [threads] {
+                    return new httplib::ThreadPool(threads);
+                };
+            }
+        }
+        /* bind every shard up front so a failure is reported, not hung on */
+        for (auto &s : servers)
+        {
+            if (!s->bind_to_port(host.c_str(), port))
+            {
+                SPDLOG_ERROR("shard failed to bind {}:{}", host, port);
+                stop();
+                return false;
+            }
+        }
+        std::vector<std::thread> threads;
+        for (std::size_t k = 0; k < servers.size(); ++k)
+        {
+            int cpu = options.pin && !cpus.empty() ? cpus[k % cpus.size()]
+                                                   : -1;
+            threads.emplace_back([this, k, cpu] {
+                if (cpu >= 0)
+                {
+                    pin_to(cpu);
+                }
+                servers[k]->listen_after_bind();
+            });
+        }
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        return true;
+    }
+
+    void stop()
+    {
+        for (auto &s : servers)
+        {
+            s->stop();
+        }
+    }
+
+  private:
+    static void pin_to(int cpu)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        {
+            SPDLOG_WARN("could not pin shard to cpu {}", cpu);
+        }
+    }
+
+    Options options;
+    std::vector<std::unique_ptr<httplib::Server>> servers;
+};
+
+}  // namespace nckd
@@ -0,0 +1,161 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <memory>
+#include <optional>
+#include <utility>
+
+namespace nckd
+{
+/*
+ * Lazily started coroutine producing a T. Awaiting a Task starts it and
+ * resumes the awaiting coroutine, through symmetric transfer, once it has
+ * finished. Exceptions thrown inside come out of co_await.
+ */
+template <class T>
+class Task
+{
+  public:
+    struct promise_type
+    {
+        std::optional<T> value;
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object()
+        {
+            return Task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<promise_type> h) noexcept
+            {
+                auto next = h.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept
+            {
+            }
+        };
+        FinalAwaiter final_suspend() noexcept
+        {
+            return {};
+        }
+        template <class U>
+        void return_value(U &&v)
+        {
+            value.emplace(std::forward<U>(v));
+        }
+        void unhandled_exception()
+        {
+            error = std::current_exception();
+        }
+    };
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, {}))
+    {
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume()
+    {
+        auto &promise = handle.promise();
+        if (promise.error)
+        {
+            std::rethrow_exception(promise.error);
+        }
+        return std::move(*promise.value);
+    }
+
+  private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle)
+    {
+    }
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail
+{
+/* Eagerly started, self-destroying coroutine used by sync_wait(). */
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object()
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void()
+        {
+        }
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+template <class T>
+Detached run_detached(Task<T> task, std::shared_ptr<std::promise<T>> done)
+{
+    try
+    {
+        done->set_value(co_await task);
+    }
+    catch (...)
+    {
+        done->set_exception(std::current_exception());
+    }
+}
+}  // namespace detail
+
+/*
+ * Bridge from the blocking cpp-httplib handlers: start `task` and block
+ * the calling thread until it finished, wherever it was resumed.
+ */
+template <class T>
+T sync_wait(Task<T> task)
+{
+    auto done = std::make_shared<std::promise<T>>();
+    auto result = done->get_future();
+    detail::run_detached(std::move(task), done);
+    return result.get();
+}
+
+}  // namespace nckd
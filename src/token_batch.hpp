@@ -0,0 +1,232 @@
+#pragma once
+#include "pg_executor.hpp"
+#include "pg_listener.hpp"
+#include "utils.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace nckd
+{
+/* One flush worth of rotations, one entry per user. */
+struct TokenBatch
+{
+    std::vector<std::string_view> ids;
+    std::vector<std::string_view> tokens;
+    /* tokens rotated out, to announce as revoked */
+    std::vector<std::string_view> old_tokens;
+    /* submissions folded into it, at least ids.size() */
+    std::size_t entries = 0;
+};
+
+/*
+ * One set_tokens UPDATE plus one notify_all for the rotated out tokens,
+ * pipelined into one implicit transaction.
+ */
+inline bool write_token_batch(cpool::PGPool &pool, const TokenBatch &batch)
+{
+    auto id_array = pg_array_literal(batch.ids);
+    auto token_array = pg_array_literal(batch.tokens);
+    auto old_token_array = pg_array_literal(batch.old_tokens);
+
+    auto connection = pool.acquire();
+    if (!connection)
+    {
+        SPDLOG_WARN("token batch of {} dropped, no connection",
+                    batch.entries);
+        return false;
+    }
+    std::vector<Query> queries = {
+        {cpool::Stmt::SetTokens, {id_array.c_str(), token_array.c_str()}}};
+    if (!batch.old_tokens.empty())
+    {
+        queries.push_back({cpool::Stmt::NotifyAll,
+                           {TOKEN_INVALIDATE_CHANNEL,
+                            old_token_array.c_str()}});
+    }
+    auto results = PGExecutor(*connection).run_transaction(queries);
+    if (!all_ok(results))
+    {
+        SPDLOG_WARN("token batch of {} failed: {}",
+                    batch.entries,
+                    results.empty() ? ""
+                                    : PQresultErrorMessage(results[0].get()));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Group commit for the token rotations done by /login/.
+ *
+ * Handlers queue their (uid, token) and wait on a future. A writer thread
+ * collects whatever arrives within `window` of the first entry, or up to
+ * `max_batch` entries, and hands them to `flush`, by default
+ * write_token_batch(). Every waiter in the batch is completed with its
+ * result once it returned, so a morning login peak pays one WAL flush per
+ * batch instead of one per login.
+ *
+ * If one user logs in twice within a batch only the later token is
+ * written, like two sequential UPDATEs would leave it.
+ */
+class TokenBatchWriter
+{
+  public:
+    struct Options
+    {
+        std::chrono::microseconds window{2000};
+        std::size_t max_batch = 128;
+        std::size_t queue_capacity = 4096;
+    };
+
+    /* true once the batch is committed */
+    using Flush = std::function<bool(const TokenBatch &)>;
+
+    TokenBatchWriter(Flush flush, const Options &options)
+        : flush(std::move(flush)), options(options)
+    {
+        writer = std::thread([this] { run(); });
+    }
+    TokenBatchWriter(cpool::PGPool &pool, const Options &options)
+        : TokenBatchWriter(
+              [&pool](const TokenBatch &batch) {
+                  return write_token_batch(pool, batch);
+              },
+              options)
+    {
+    }
+    TokenBatchWriter(const TokenBatchWriter &) = delete;
+    TokenBatchWriter &operator=(const TokenBatchWriter &) = delete;
+    ~TokenBatchWriter()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        writer.join();
+    }
+
+    /*
+     * The future is true once the token is committed. nullopt when the
+     * queue is full and the caller should answer busy.
+     */
+    std::optional<std::future<bool>> submit(std::string uid,
+                                            std::string token,
+                                            std::string old_token)
+    {
+        std::unique_lock lock(mutex);
+        if (stopping || queue.size() >= options.queue_capacity)
+        {
+            return std::nullopt;
+        }
+        queue.push_back({std::move(uid),
+                         std::move(token),
+                         std::move(old_token),
+                         {},
+                         std::chrono::steady_clock::now()});
+        auto done = queue.back().done.get_future();
+        /* the writer only needs a nudge for a new batch or a full one */
+        bool nudge =
+            queue.size() == 1 || queue.size() >= options.max_batch;
+        lock.unlock();
+        if (nudge)
+        {
+            wakeup.notify_one();
+        }
+        return done;
+    }
+
+    std::size_t queued() const
+    {
+        std::lock_guard lock(mutex);
+        return queue.size();
+    }
+
+  private:
+    struct Entry
+    {
+        std::string uid;
+        std::string token;
+        std::string old_token;
+        std::promise<bool> done;
+        std::chrono::steady_clock::time_point queued_at;
+    };
+
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        for (;;)
+        {
+            wakeup.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            auto deadline = queue.front().queued_at + options.window;
+            wakeup.wait_until(lock, deadline, [this] {
+                return stopping || queue.size() >= options.max_batch;
+            });
+            std::vector<Entry> batch;
+            while (!queue.empty() && batch.size() < options.max_batch)
+            {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            lock.unlock();
+            bool ok = commit(batch);
+            for (auto &entry : batch)
+            {
+                entry.done.set_value(ok);
+            }
+            lock.lock();
+        }
+    }
+
+    bool commit(const std::vector<Entry> &entries)
+    {
+        /* the last token queued for a user wins */
+        std::unordered_map<std::string_view, std::string_view> latest;
+        TokenBatch batch;
+        batch.entries = entries.size();
+        for (const auto &entry : entries)
+        {
+            latest[entry.uid] = entry.token;
+            if (!entry.old_token.empty())
+            {
+                batch.old_tokens.push_back(entry.old_token);
+            }
+        }
+        for (const auto &[uid, token] : latest)
+        {
+            batch.ids.push_back(uid);
+            batch.tokens.push_back(token);
+        }
+        if (!flush(batch))
+        {
+            return false;
+        }
+        metrics().token_batches.add();
+        metrics().token_batch_rows.add(entries.size());
+        return true;
+    }
+
+    Flush flush;
+    Options options;
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<Entry> queue;
+    bool stopping = false;
+    std::thread writer;
+};
+
+}  // namespace nckd
@@ -0,0 +1,210 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace nckd
+{
+struct AuthEntry
+{
+    std::string role;
+    std::string uid;
+};
+
+/*
+ * Sharded, bounded token -> (role, uid) cache used by /webhook/.
+ *
+ * Each shard is an LRU list plus a hash index guarded by its own mutex, so
+ * concurrent lookups of different tokens rarely touch the same lock. Every
+ * shard also carries an invalidation epoch: a lookup that misses remembers
+ * the epoch before going to the database and only publishes its result if
+ * no erase() happened in between, so a token rotated by /login/ can not be
+ * re-inserted by a request that raced with the rotation.
+ */
+class TokenCache
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    TokenCache(std::size_t capacity,
+               std::chrono::milliseconds ttl,
+               std::size_t num_shards = 16)
+        : ttl(ttl),
+          num_shards(num_shards == 0 ? 1 : num_shards),
+          shards(new Shard[this->num_shards])
+    {
+        std::size_t per_shard =
+            (capacity + this->num_shards - 1) / this->num_shards;
+        for (std::size_t k = 0; k < this->num_shards; ++k)
+        {
+            shards[k].capacity = per_shard;
+        }
+    }
+
+    bool enabled() const
+    {
+        return shards[0].capacity > 0 && ttl.count() > 0;
+    }
+
+    std::optional<AuthEntry> get(std::string_view token)
+    {
+        auto &shard = shard_for(token);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(token);
+        if (it == shard.index.end())
+        {
+            return std::nullopt;
+        }
+        if (it->second->expires <= clock::now())
+        {
+            shard.lru.erase(it->second);
+            shard.index.erase(it);
+            return std::nullopt;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return it->second->entry;
+    }
+
+    /* Epoch to pass to put() after a database lookup for `token`. */
+    std::uint64_t epoch(std::string_view token)
+    {
+        return shard_for(token).epoch.load(std::memory_order_acquire);
+    }
+
+    /* Insert an entry that expires after the configured TTL. */
+    bool put(std::string_view token, AuthEntry entry, std::uint64_t epoch)
+    {
+        return put_until(token, std::move(entry), clock::now() + ttl, epoch);
+    }
+
+    bool put_until(std::string_view token,
+                   AuthEntry entry,
+                   clock::time_point expires,
+                   std::uint64_t epoch)
+    {
+        auto &shard = shard_for(token);
+        if (shard.capacity == 0 || expires <= clock::now())
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.epoch.load(std::memory_order_relaxed) != epoch)
+        {
+            return false;
+        }
+        auto it = shard.index.find(token);
+        if (it != shard.index.end())
+        {
+            it->second->entry = std::move(entry);
+            it->second->expires = expires;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            return true;
+        }
+        if (shard.index.size() >= shard.capacity)
+        {
+            shard.index.erase(shard.lru.back().token);
+            shard.lru.pop_back();
+        }
+        shard.lru.push_front(
+            Node{std::string(token), std::move(entry), expires});
+        shard.index.emplace(shard.lru.front().token, shard.lru.begin());
+        return true;
+    }
+
+    /* Drop `token`; also fences out any lookup that is still in flight. */
+    bool erase(std::string_view token)
+    {
+        auto &shard = shard_for(token);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.epoch.fetch_add(1, std::memory_order_release);
+        auto it = shard.index.find(token);
+        if (it == shard.index.end())
+        {
+            return false;
+        }
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+        return true;
+    }
+
+    void clear()
+    {
+        for (std::size_t k = 0; k < num_shards; ++k)
+        {
+            std::lock_guard<std::mutex> lock(shards[k].mutex);
+            shards[k].epoch.fetch_add(1, std::memory_order_release);
+            shards[k].index.clear();
+            shards[k].lru.clear();
+        }
+    }
+
+    std::size_t size() const
+    {
+        std::size_t n = 0;
+        for (std::size_t k = 0; k < num_shards; ++k)
+        {
+            std::lock_guard<std::mutex> lock(shards[k].mutex);
+            n += shards[k].index.size();
+        }
+        return n;
+    }
+
+    /*
+     * Visit every live entry as (token, entry, expires), least recently
+     * used first within each shard. Holds one shard lock at a time.
+     */
+    template <class F>
+    void for_each(F &&visit) const
+    {
+        auto now = clock::now();
+        for (std::size_t k = 0; k < num_shards; ++k)
+        {
+            std::lock_guard<std::mutex> lock(shards[k].mutex);
+            for (auto it = shards[k].lru.rbegin(); it != shards[k].lru.rend();
+                 ++it)
+            {
+                if (it->expires > now)
+                {
+                    visit(std::string_view(it->token), it->entry, it->expires);
+                }
+            }
+        }
+    }
+
+  private:
+    struct Node
+    {
+        std::string token;
+        AuthEntry entry;
+        clock::time_point expires;
+    };
+    struct alignas(64) Shard
+    {
+        mutable std::mutex mutex;
+        std::list<Node> lru;
+        /* keys point into Node::token, list nodes never move */
+        std::unordered_map<std::string_view, std::list<Node>::iterator> index;
+        std::size_t capacity = 0;
+        std::atomic<std::uint64_t> epoch{0};
+    };
+
+    Shard &shard_for(std::string_view token)
+    {
+        auto h = std::hash<std::string_view>{}(token);
+        return shards[((h >> 32) ^ h) % num_shards];
+    }
+
+    std::chrono::milliseconds ttl;
+    std::size_t num_shards;
+    std::unique_ptr<Shard[]> shards;
+};
+
+}  // namespace nckd
@@ -0,0 +1,290 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nckd
+{
+inline std::uint64_t trace_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/* Names must be string literals, only the pointer is kept. */
+struct TraceEvent
+{
+    const char *name;
+    std::uint64_t start_ns;
+    std::uint64_t end_ns;
+    std::uint64_t request;
+};
+
+/* Last CAPACITY spans of one thread; older ones are overwritten. */
+class TraceRing
+{
+  public:
+    static constexpr std::size_t CAPACITY = 4096;
+
+    explicit TraceRing(std::uint32_t tid) : tid(tid)
+    {
+    }
+
+    /* Uncontended unless a dump is reading this ring at the same time. */
+    void push(const TraceEvent &event)
+    {
+        std::lock_guard lock(mutex);
+        events[head++ % CAPACITY] = event;
+    }
+
+    /* Events of `request`, or all of them for request 0. */
+    void collect(std::vector<std::pair<std::uint32_t, TraceEvent>> &out,
+                 std::uint64_t request = 0) const
+    {
+        std::lock_guard lock(mutex);
+        auto first = head > CAPACITY ? head - CAPACITY : 0;
+        for (auto k = first; k < head; ++k)
+        {
+            const auto &event = events[k % CAPACITY];
+            if (request == 0 || event.request == request)
+            {
+                out.emplace_back(tid, event);
+            }
+        }
+    }
+
+    const std::uint32_t tid;
+
+  private:
+    mutable std::mutex mutex;
+    std::array<TraceEvent, CAPACITY> events{};
+    std::uint64_t head = 0;
+};
+
+/* Sampled request the current thread is working on, 0 when untraced. */
+inline thread_local std::uint64_t trace_request = 0;
+
+/*
+ * Per-request phase tracing.
+ *
+ * begin_request() decides on the worker thread whether the request is
+ * sampled. For sampled requests every TRACE_SPAN on that thread lands in
+ * the thread's ring, and end_request() adds the span of the request as a
+ * whole. A sampled request slower than `slow` is also written to
+ * `slow_dir` as its own trace file, at most one file per second.
+ *
+ * Untraced requests pay one thread_local load per span, and nothing at all
+ * while `sample_rate` is 0.
+ */
+class Tracer
+{
+  public:
+    struct Options
+    {
+        double sample_rate = 0;
+        std::chrono::milliseconds slow{0};
+        std::string slow_dir = ".";
+    };
+
+    void configure(const Options &options)
+    {
+        this->options = options;
+        threshold = options.sample_rate >= 1.0
+                        ? UINT64_MAX
+                        : static_cast<std::uint64_t>(
+                              std::max(options.sample_rate, 0.0) * 0x1p64);
+    }
+
+    bool enabled() const
+    {
+        return threshold != 0;
+    }
+
+    void begin_request()
+    {
+        trace_request = enabled() && sampled()
+                            ? next_request.fetch_add(
+                                  1, std::memory_order_relaxed)
+                            : 0;
+        request_start = trace_request ? trace_now() : 0;
+    }
+
+    void end_request(const char *name)
+    {
+        if (trace_request == 0)
+        {
+            return;
+        }
+        auto end = trace_now();
+        record({name, request_start, end, trace_request});
+        auto slow = static_cast<std::uint64_t>(
+            std::chrono::nanoseconds(options.slow).count());
+        if (slow != 0 && end - request_start >= slow && may_dump(end))
+        {
+            write_slow(trace_request);
+        }
+        trace_request = 0;
+    }
+
+    void record(const TraceEvent &event)
+    {
+        thread_local const Tracer *owner = nullptr;
+        thread_local std::shared_ptr<TraceRing> ring;
+        if (owner != this)
+        {
+            owner = this;
+            ring = attach();
+        }
+        ring->push(event);
+    }
+
+    /* Chrome trace event JSON, loadable in Perfetto or chrome://tracing. */
+    std::string dump(std::uint64_t request = 0) const
+    {
+        std::vector<std::pair<std::uint32_t, TraceEvent>> events;
+        {
+            std::lock_guard lock(rings_mutex);
+            for (const auto &ring : rings)
+            {
+                ring->collect(events, request);
+            }
+        }
+        std::string out = "{\"traceEvents\":[";
+        char buf[256];
+        for (std::size_t k = 0; k < events.size(); ++k)
+        {
+            const auto &[tid, e] = events[k];
+            snprintf(buf,
+                     sizeof(buf),
+                     "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                     "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"args\":{\"request\":%llu}}",
+                     k ? "," : "",
+                     e.name,
+                     tid,
+                     e.start_ns / 1e3,
+                     (e.end_ns - e.start_ns) / 1e3,
+                     static_cast<unsigned long long>(e.request));
+            out += buf;
+        }
+        out += "],\"displayTimeUnit\":\"ms\"}";
+        return out;
+    }
+
+  private:
+    bool sampled() const
+    {
+        if (threshold == UINT64_MAX)
+        {
+            return true;
+        }
+        /* xorshift64*, same scheme as the access log */
+        thread_local std::uint64_t state =
+            0x9E3779B97F4A7C15ull ^
+            reinterpret_cast<std::uintptr_t>(&state);
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull < threshold;
+    }
+
+    std::shared_ptr<TraceRing> attach()
+    {
+        std::lock_guard lock(rings_mutex);
+        rings.push_back(std::make_shared<TraceRing>(
+            static_cast<std::uint32_t>(rings.size() + 1)));
+        return rings.back();
+    }
+
+    bool may_dump(std::uint64_t now)
+    {
+        auto last = last_dump.load(std::memory_order_relaxed);
+        return now - last >= 1'000'000'000ull &&
+               last_dump.compare_exchange_strong(
+                   last, now, std::memory_order_relaxed);
+    }
+
+    void write_slow(std::uint64_t request) const
+    {
+        auto path = options.slow_dir + "/nckd-trace-" +
+                    std::to_string(request) + ".json";
+        if (FILE *f = fopen(path.c_str(), "w"))
+        {
+            auto body = dump(request);
+            fwrite(body.data(), 1, body.size(), f);
+            fclose(f);
+        }
+    }
+
+    Options options;
+    std::uint64_t threshold = 0;
+    std::atomic<std::uint64_t> next_request{1};
+    std::atomic<std::uint64_t> last_dump{0};
+    static inline thread_local std::uint64_t request_start = 0;
+    mutable std::mutex rings_mutex;
+    /* rings outlive their threads so a dump still shows their spans */
+    std::vector<std::shared_ptr<TraceRing>> rings;
+};
+
+inline Tracer &tracer()
+{
+    static Tracer instance;
+    return instance;
+}
+
+/* Records the enclosing scope when the current request is traced. */
+class TraceSpan
+{
+  public:
+    explicit TraceSpan(const char *name)
+        : name(name), start(trace_request ? trace_now() : 0)
+    {
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+    ~TraceSpan()
+    {
+        if (start != 0)
+        {
+            tracer().record({name, start, trace_now(), trace_request});
+        }
+    }
+
+  private:
+    const char *name;
+    std::uint64_t start;
+};
+
+/* Attributes spans on a helper thread to the request that queued the job. */
+class TraceAdopt
+{
+  public:
+    explicit TraceAdopt(std::uint64_t request) : saved(trace_request)
+    {
+        trace_request = request;
+    }
+    TraceAdopt(const TraceAdopt &) = delete;
+    TraceAdopt &operator=(const TraceAdopt &) = delete;
+    ~TraceAdopt()
+    {
+        trace_request = saved;
+    }
+
+  private:
+    std::uint64_t saved;
+};
+
+#define NCKD_TRACE_CAT2(a, b) a##b
+#define NCKD_TRACE_CAT(a, b) NCKD_TRACE_CAT2(a, b)
+#define TRACE_SPAN(name) \
+    ::nckd::TraceSpan NCKD_TRACE_CAT(trace_span_, __LINE__)(name)
+
+}  // namespace nckd
@@ -0,0 +1,61 @@
+#pragma once
+#include "token_cache.hpp"
+#include <string>
+#include <string_view>
+
+namespace nckd
+{
+enum class StoreStatus
+{
+    Ok,
+    NotFound,
+    /* insert_user: the email is taken */
+    Exists,
+    /* no connection or queue space right now, worth retrying */
+    Busy,
+    Error,
+};
+
+struct UserRecord
+{
+    std::string id;
+    std::string password;
+    /* empty when the user never logged in */
+    std::string token;
+    std::string role;
+};
+
+/*
+ * What the handlers need from user storage. Engines report outcomes as a
+ * StoreStatus and leave the mapping to error codes to the handlers.
+ */
+class UserStore
+{
+  public:
+    virtual ~UserStore() = default;
+
+    /*
+     * `from_replica` is set when a replica answered. Its answer may predate a
+     * rotation the primary already announced, so it must not be cached as
+     * long as one from the primary.
+     */
+    virtual StoreStatus find_by_token(std::string_view token,
+                                      AuthEntry &out,
+                                      bool &from_replica) = 0;
+    virtual StoreStatus find_by_email(std::string_view email,
+                                      UserRecord &out) = 0;
+    /* Ok when taken, NotFound when free */
+    virtual StoreStatus email_exists(std::string_view email) = 0;
+    virtual StoreStatus insert_user(std::string_view email,
+                                    std::string_view password) = 0;
+    /* `old_token` is announced as revoked, it may be empty */
+    virtual StoreStatus set_token(std::string_view uid,
+                                  std::string_view token,
+                                  std::string_view old_token) = 0;
+    /* Only replaces `old_password`; NotFound if it changed meanwhile. */
+    virtual StoreStatus update_password(std::string_view uid,
+                                        std::string_view password,
+                                        std::string_view old_password) = 0;
+};
+
+}  // namespace nckd
@@ -1,16 +1,31 @@
 #pragma once
 #include <httplib.h>
+#include <algorithm>
 #include <cstdio>
 #include <string>
 #include <string_view>
 #include <libpq-fe.h>
 #include <cpool/pool.h>
-#include <random>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <poll.h>
+#include <strings.h>
+#include <optional>
+#include <utility>
+#include <spdlog/spdlog.h>
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "random.hpp"
 using namespace std;
 using namespace httplib;
 using namespace cpool;
 
-std::string dump_headers(const Headers &headers)
+/* Authorization values are credentials and never written out. */
+inline std::string dump_headers(const Headers &headers)
 {
     std::string s;
     char buf[BUFSIZ];
@@ -18,15 +33,22 @@ std::string dump_headers(const Headers &headers)
     for (auto it = headers.begin(); it != headers.end(); ++it)
     {
         const auto &x = *it;
-        snprintf(
-            buf, sizeof(buf), "%s: %s\n", x.first.c_str(), x.second.c_str());
+        bool secret = strcasecmp(x.first.c_str(), "authorization") == 0;
+        snprintf(buf,
+                 sizeof(buf),
+                 "%s: %s\n",
+                 x.first.c_str(),
+                 secret ? "<redacted>" : x.second.c_str());
         s += buf;
     }
 
     return s;
 }
 
-std::string log(const Request &req, const Response &res)
+/* Without `bodies` only their sizes: they carry passwords and tokens. */
+inline std::string log(const Request &req,
+                       const Response &res,
+                       bool bodies = true)
 {
     std::string s;
     char buf[BUFSIZ];
@@ -57,7 +79,7 @@ std::string log(const Request &req, const Response &res)
     s += buf;
 
     s += dump_headers(req.headers);
-    s += (req.body);
+    s += bodies ? req.body : "<" + std::to_string(req.body.size()) + "B>";
     s += "\n";
 
     s += "--------------------------------\n";
@@ -69,7 +91,8 @@ std::string log(const Request &req, const Response &res)
 
     if (!res.body.empty())
     {
-        s += res.body;
+        s += bodies ? res.body
+                    : "<" + std::to_string(res.body.size()) + "B>";
     }
 
     s += "\n";
@@ -97,43 +120,324 @@ constexpr std::string_view type_name()
 
 namespace cpool
 {
+/* Parameter type OIDs, see catalog/pg_type.dat */
+constexpr Oid PG_INT8_OID = 20;
+constexpr Oid PG_TEXT_OID = 25;
+constexpr Oid PG_TEXT_ARRAY_OID = 1009;
+constexpr Oid PG_INT8_ARRAY_OID = 1016;
+
+/*
+ * Statements the handlers run. They are prepared once per connection by
+ * PGConnection::connect(), so every request only pays for a Bind/Execute.
+ * Keep PG_STATEMENTS in the same order as Stmt.
+ */
+enum class Stmt
+{
+    FindByToken,
+    FindByEmail,
+    EmailExists,
+    SetTokens,
+    InsertUser,
+    NotifyAll,
+    EmailsExisting,
+    UpdatePassword,
+    FindTokens,
+};
+
+struct PreparedStatement
+{
+    const char *name;
+    const char *sql;
+    int n_params;
+    Oid param_types[3];
+};
+
+inline constexpr PreparedStatement PG_STATEMENTS[] = {
+    {"find_by_token",
+     "SELECT role, id FROM users WHERE token=$1;",
+     1,
+     {PG_TEXT_OID}},
+    {"find_by_email",
+     "SELECT password, id, token, role FROM users WHERE email=$1;",
+     1,
+     {PG_TEXT_OID}},
+    {"email_exists",
+     "SELECT 1 FROM users WHERE email=$1;",
+     1,
+     {PG_TEXT_OID}},
+    /* one row per (id, token) pair, see TokenBatchWriter */
+    {"set_tokens",
+     "UPDATE users SET token=v.token "
+     "FROM unnest($1::int8[], $2::text[]) AS v(id, token) "
+     "WHERE users.id=v.id;",
+     2,
+     {PG_INT8_ARRAY_OID, PG_TEXT_ARRAY_OID}},
+    {"insert_user",
+     "INSERT INTO users (email, password) VALUES ($1, $2);",
+     2,
+     {PG_TEXT_OID, PG_TEXT_OID}},
+    {"notify_all",
+     "SELECT pg_notify($1, payload) FROM unnest($2::text[]) AS payload;",
+     2,
+     {PG_TEXT_OID, PG_TEXT_ARRAY_OID}},
+    {"emails_existing",
+     "SELECT email FROM users WHERE email = ANY($1::text[]);",
+     1,
+     {PG_TEXT_ARRAY_OID}},
+    /* only replaces the hash the rehash was computed from */
+    {"update_password",
+     "UPDATE users SET password=$2 WHERE id=$1 AND password=$3;",
+     3,
+     {PG_INT8_OID, PG_TEXT_OID, PG_TEXT_OID}},
+    /* re-checks a restored cache snapshot in one round trip */
+    {"find_tokens",
+     "SELECT token, role, id FROM users WHERE token = ANY($1::text[]);",
+     1,
+     {PG_TEXT_ARRAY_OID}},
+};
+
+static_assert(std::size(PG_STATEMENTS) <= nckd::MAX_STATEMENTS);
+
+inline const PreparedStatement &statement(Stmt stmt)
+{
+    return PG_STATEMENTS[static_cast<int>(stmt)];
+}
+
+/*
+ * Non-blocking prepare: every PREPARE is queued in one pipeline closed by
+ * a Sync, then poll_prepares() is called whenever the socket is ready
+ * until it stops asking for READING or WRITING.
+ */
+inline bool send_prepares(PGconn *conn)
+{
+    if (!PQenterPipelineMode(conn))
+    {
+        return false;
+    }
+    for (const auto &s : PG_STATEMENTS)
+    {
+        if (!PQsendPrepare(conn, s.name, s.sql, s.n_params, s.param_types))
+        {
+            return false;
+        }
+    }
+    return PQpipelineSync(conn) == 1;
+}
+
+inline PostgresPollingStatusType poll_prepares(PGconn *conn)
+{
+    int flushed = PQflush(conn);
+    if (flushed < 0 || !PQconsumeInput(conn))
+    {
+        return PGRES_POLLING_FAILED;
+    }
+    while (!PQisBusy(conn))
+    {
+        PGresult *res = PQgetResult(conn);
+        if (res == nullptr)
+        {
+            /* end of one statement's results */
+            continue;
+        }
+        auto status = PQresultStatus(res);
+        if (status == PGRES_PIPELINE_SYNC)
+        {
+            PQclear(res);
+            return PQexitPipelineMode(conn) ? PGRES_POLLING_OK
+                                            : PGRES_POLLING_FAILED;
+        }
+        if (status != PGRES_COMMAND_OK)
+        {
+            fprintf(stderr, "Prepare failed: %s", PQresultErrorMessage(res));
+            PQclear(res);
+            return PGRES_POLLING_FAILED;
+        }
+        PQclear(res);
+    }
+    return flushed == 1 ? PGRES_POLLING_WRITING : PGRES_POLLING_READING;
+}
+
+/* Blocking prepare of every statement, in one round trip. */
+inline bool prepare_statements(PGconn *conn)
+{
+    if (!send_prepares(conn))
+    {
+        return false;
+    }
+    for (;;)
+    {
+        auto polling = poll_prepares(conn);
+        if (polling != PGRES_POLLING_READING &&
+            polling != PGRES_POLLING_WRITING)
+        {
+            return polling == PGRES_POLLING_OK;
+        }
+        pollfd fd{PQsocket(conn),
+                  static_cast<short>(polling == PGRES_POLLING_WRITING
+                                         ? POLLIN | POLLOUT
+                                         : POLLIN),
+                  0};
+        if (poll(&fd, 1, -1) < 0 && errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
 class PGConnection final : public Connection
 {
   public:
+    /* Round trip to the server; an empty query is the cheapest one. */
     bool heart_beat() override
     {
-        return PQstatus(conn) == CONNECTION_OK;
+        if (conn == nullptr)
+        {
+            return lazy;
+        }
+        PGresult *res = PQexec(conn, "");
+        bool ok = PQresultStatus(res) == PGRES_EMPTY_QUERY;
+        PQclear(res);
+        return ok;
     }
     bool is_healthy() override
     {
-        return PQstatus(conn) == CONNECTION_OK;
+        return (conn == nullptr && lazy) || PQstatus(conn) == CONNECTION_OK;
     }
+    /*
+     * Connections warmed up by the factory are already open, and the ones
+     * above the pool minimum are opened by ensure_ready() on first use.
+     */
     bool connect() override
     {
-        conn = PQconnectdb(conninfo);
-        /* 检查后端连接成功建立 */
-        if (PQstatus(conn) != CONNECTION_OK)
+        if (connected && PQstatus(conn) == CONNECTION_OK)
         {
-            fprintf(stderr,
-                    "Connection to database failed: %s",
-                    PQerrorMessage(conn));
-            return false;
+            return true;
         }
-        connected = true;
-        return connected;
+        if (conn == nullptr && lazy)
+        {
+            return true;
+        }
+        return open();
     }
     void disconnect() override
     {
         PQfinish(conn);
+        conn = nullptr;
         connected = false;
     }
     PGconn* acquire()
     {
         return conn;
     }
+    /*
+     * Run a registered statement with text-format parameters. A connection
+     * that went bad is reset and re-prepared first, since prepared
+     * statements do not survive the server session.
+     */
+    PGresult *exec_prepared(Stmt stmt, const char *const *param_values)
+    {
+        if (!ensure_ready())
+        {
+            return nullptr;
+        }
+        const auto &s = statement(stmt);
+        TRACE_SPAN(s.name);
+        nckd::ScopedTimer timer(
+            nckd::metrics().db_time[static_cast<int>(stmt)]);
+        return PQexecPrepared(
+            conn, s.name, s.n_params, param_values, NULL, NULL, 0);
+    }
+
+    bool ensure_ready()
+    {
+        if (conn == nullptr)
+        {
+            return open();
+        }
+        if (!connected || PQstatus(conn) != CONNECTION_OK)
+        {
+            PQreset(conn);
+            connected =
+                PQstatus(conn) == CONNECTION_OK && prepare_statements(conn);
+        }
+        return connected;
+    }
+
+    /*
+     * Begin a non-blocking connect, driven to the end by poll_connect(),
+     * which also sends the PREPAREs in one pipeline, so that connecting
+     * many connections at once costs one set of round trips.
+     */
+    bool start_connect()
+    {
+        PQfinish(conn);
+        conn = PQconnectStart(conninfo);
+        connected = false;
+        preparing = false;
+        polling = PGRES_POLLING_WRITING;
+        return conn != nullptr && PQstatus(conn) != CONNECTION_BAD;
+    }
+    PostgresPollingStatusType poll_connect()
+    {
+        if (!preparing)
+        {
+            polling = PQconnectPoll(conn);
+            if (polling != PGRES_POLLING_OK)
+            {
+                return polling;
+            }
+            lazy = false;
+            preparing = true;
+            if (PQsetnonblocking(conn, 1) != 0 || !send_prepares(conn))
+            {
+                return polling = PGRES_POLLING_FAILED;
+            }
+        }
+        polling = poll_prepares(conn);
+        if (polling == PGRES_POLLING_OK)
+        {
+            preparing = false;
+            connected = PQsetnonblocking(conn, 0) == 0;
+        }
+        return polling;
+    }
+    PostgresPollingStatusType polling_status() const
+    {
+        return polling;
+    }
+    /* Give up on a connect attempt, the next use retries it. */
+    void abandon_connect()
+    {
+        PQfinish(conn);
+        conn = nullptr;
+        connected = false;
+        preparing = false;
+        lazy = true;
+    }
 
   private:
-    PGconn *conn;
+    bool open()
+    {
+        if (conn != nullptr)
+        {
+            PQfinish(conn);
+        }
+        lazy = false;
+        conn = PQconnectdb(conninfo);
+        /* 检查后端连接成功建立 */
+        if (PQstatus(conn) != CONNECTION_OK)
+        {
+            fprintf(stderr,
+                    "Connection to database failed: %s",
+                    PQerrorMessage(conn));
+            connected = false;
+            return false;
+        }
+        connected = prepare_statements(conn);
+        return connected;
+    }
+
+    PGconn *conn = nullptr;
     const char *conninfo =
         "user=postgres dbname=postgres password=postgres host=127.0.0.1 "
         "port=5432";
@@ -143,30 +447,344 @@ class PGConnection final : public Connection
     }
     friend ConnectionPoolFactory<PGConnection>;
     bool connected = false;
+    bool lazy = false;
+    bool preparing = false;
+    PostgresPollingStatusType polling = PGRES_POLLING_FAILED;
 };
 template <>
 class ConnectionPoolFactory<PGConnection>
 {
   public:
+    /*
+     * `num_warm` connections are opened up front, all at once; the others
+     * are opened on first use.
+     */
     static std::unique_ptr<ConnectionPool> create(
         const std::uint16_t num_connections,
-        const char *db_url)
+        const char *db_url,
+        std::uint16_t num_warm = UINT16_MAX,
+        std::chrono::milliseconds connect_timeout = std::chrono::seconds(10))
     {
         std::vector<std::unique_ptr<Connection>> connections;
+        std::vector<PGConnection *> warm;
         for (std::uint16_t k = 0; k < num_connections; ++k)
         {
             // cannot use std::make_unique, because constructor is hidden
-            connections.emplace_back(
-                std::unique_ptr<PGConnection>(new PGConnection(db_url)));
+            auto connection =
+                std::unique_ptr<PGConnection>(new PGConnection(db_url));
+            connection->lazy = true;
+            if (k < num_warm)
+            {
+                warm.push_back(connection.get());
+            }
+            connections.emplace_back(std::move(connection));
         }
+        warm_up(warm, connect_timeout);
         return std::unique_ptr<ConnectionPool>(
             new ConnectionPool{std::move(connections)});
     }
+
+    /*
+     * Drive all connects with PQconnectPoll, so startup costs one RTT set.
+     * Connections that fail are left to be opened on first use.
+     */
+    static void warm_up(const std::vector<PGConnection *> &connections,
+                        std::chrono::milliseconds timeout)
+    {
+        std::vector<PGConnection *> pending;
+        for (auto *c : connections)
+        {
+            if (c->start_connect())
+            {
+                pending.push_back(c);
+            }
+            else
+            {
+                c->abandon_connect();
+            }
+        }
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::vector<pollfd> fds;
+        while (!pending.empty())
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0)
+            {
+                break;
+            }
+            fds.clear();
+            for (auto *c : pending)
+            {
+                short events =
+                    c->polling_status() == PGRES_POLLING_READING ? POLLIN
+                                                                 : POLLOUT;
+                fds.push_back({PQsocket(c->acquire()), events, 0});
+            }
+            if (poll(fds.data(), fds.size(), left.count()) < 0 &&
+                errno != EINTR)
+            {
+                break;
+            }
+            std::vector<PGConnection *> still;
+            for (std::size_t k = 0; k < pending.size(); ++k)
+            {
+                if (fds[k].revents == 0)
+                {
+                    still.push_back(pending[k]);
+                    continue;
+                }
+                auto status = pending[k]->poll_connect();
+                if (status == PGRES_POLLING_FAILED)
+                {
+                    fprintf(stderr,
+                            "Connection to database failed: %s",
+                            PQerrorMessage(pending[k]->acquire()));
+                    pending[k]->abandon_connect();
+                }
+                else if (status != PGRES_POLLING_OK)
+                {
+                    still.push_back(pending[k]);
+                }
+            }
+            pending.swap(still);
+        }
+        for (auto *c : pending)
+        {
+            c->abandon_connect();
+        }
+    }
+};
+
+/*
+ * ConnectionPool front end used by the handlers.
+ *
+ * acquire() waits up to `acquire_timeout` for a connection to come back
+ * instead of failing as soon as the pool is empty, and a background thread
+ * periodically probes idle connections with heart_beat() and reconnects
+ * the ones that went bad, so a database blip is repaired before requests
+ * hit it.
+ */
+class PGPool
+{
+    using Proxy = decltype(std::declval<ConnectionPool &>().get_connection());
+
+  public:
+    struct Options
+    {
+        std::uint16_t min_size = 2;
+        std::uint16_t max_size = 8;
+        std::chrono::milliseconds acquire_timeout{200};
+        std::chrono::milliseconds validate_interval{10000};
+        std::chrono::milliseconds connect_timeout{10000};
+    };
+
+    class Lease
+    {
+      public:
+        Lease() = default;
+        Lease(Lease &&other) noexcept
+            : owner(std::exchange(other.owner, nullptr)),
+              proxy(std::move(other.proxy))
+        {
+        }
+        Lease &operator=(Lease &&other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                owner = std::exchange(other.owner, nullptr);
+                proxy = std::move(other.proxy);
+            }
+            return *this;
+        }
+        ~Lease()
+        {
+            release();
+        }
+        explicit operator bool() const
+        {
+            return owner != nullptr;
+        }
+        PGConnection &operator*()
+        {
+            return dynamic_cast<PGConnection &>(**proxy);
+        }
+        PGConnection *operator->()
+        {
+            return &**this;
+        }
+        void release()
+        {
+            if (owner != nullptr)
+            {
+                std::exchange(owner, nullptr)->give_back(std::move(*proxy));
+                proxy.reset();
+            }
+        }
+
+      private:
+        friend PGPool;
+        Lease(PGPool *owner, Proxy &&proxy)
+            : owner(owner), proxy(std::move(proxy))
+        {
+        }
+        PGPool *owner = nullptr;
+        std::optional<Proxy> proxy;
+    };
+
+    PGPool(const char *db_url, Options options)
+        : options(options),
+          pool(ConnectionPoolFactory<PGConnection>::create(
+              std::max(options.max_size, options.min_size),
+              db_url,
+              options.min_size,
+              options.connect_timeout))
+    {
+        if (options.validate_interval.count() > 0)
+        {
+            validator = std::thread([this] { validate_loop(); });
+        }
+    }
+    PGPool(const PGPool &) = delete;
+    PGPool &operator=(const PGPool &) = delete;
+    ~PGPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (validator.joinable())
+        {
+            validator.join();
+        }
+    }
+
+    /* Empty Lease when nothing was released within the timeout. */
+    Lease acquire()
+    {
+        return acquire(options.acquire_timeout);
+    }
+    Lease acquire(std::chrono::milliseconds timeout)
+    {
+        auto &m = nckd::metrics();
+        TRACE_SPAN("pool_acquire");
+        nckd::ScopedTimer timer(m.pool_wait);
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            auto seen = releases;
+            lock.unlock();
+            if (auto lease = try_acquire())
+            {
+                return lease;
+            }
+            lock.lock();
+            if (!cv.wait_until(lock, deadline, [&] {
+                    return releases != seen || stopping;
+                }) ||
+                stopping)
+            {
+                m.pool_timeouts.add();
+                return {};
+            }
+        }
+    }
+    Lease try_acquire()
+    {
+        auto proxy = pool->get_connection();
+        if (!proxy.valid())
+        {
+            return {};
+        }
+        in_use.fetch_add(1, std::memory_order_relaxed);
+        return Lease(this, std::move(proxy));
+    }
+
+    std::size_t size() const
+    {
+        return pool->size();
+    }
+    std::size_t size_in_use() const
+    {
+        return in_use.load(std::memory_order_relaxed);
+    }
+
+  private:
+    void give_back(Proxy &&proxy)
+    {
+        pool->release_connection(std::move(proxy));
+        in_use.fetch_sub(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++releases;
+        }
+        cv.notify_one();
+    }
+
+    void validate_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(
+            lock, options.validate_interval, [this] { return stopping; }))
+        {
+            lock.unlock();
+            validate_idle();
+            lock.lock();
+        }
+    }
+
+    /*
+     * Probe the idle connections one at a time, each going back to the
+     * pool right after its heart beat. The broken ones are kept out and
+     * reconnected together with non-blocking connects, so a blip only
+     * holds connections that could not have served a request anyway.
+     */
+    void validate_idle()
+    {
+        std::vector<PGConnection *> probed;
+        std::vector<Lease> broken;
+        for (auto n = pool->size_idle(); n > 0; --n)
+        {
+            auto lease = try_acquire();
+            if (!lease ||
+                std::find(probed.begin(), probed.end(), &*lease) !=
+                    probed.end())
+            {
+                break;
+            }
+            probed.push_back(&*lease);
+            if (!lease->heart_beat())
+            {
+                SPDLOG_WARN("pool connection failed its heart beat, "
+                            "reconnecting");
+                broken.push_back(std::move(lease));
+            }
+        }
+        std::vector<PGConnection *> reconnect;
+        for (auto &lease : broken)
+        {
+            reconnect.push_back(&*lease);
+        }
+        ConnectionPoolFactory<PGConnection>::warm_up(reconnect,
+                                                     options.connect_timeout);
+    }
+
+    Options options;
+    std::unique_ptr<ConnectionPool> pool;
+    std::atomic<std::size_t> in_use{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::uint64_t releases = 0;
+    bool stopping = false;
+    std::thread validator;
 };
 
 }  // namespace cpool
 
-static void
+inline void
 show_binary_results(PGresult *res)
 {
     int         i,
@@ -221,7 +839,7 @@ show_binary_results(PGresult *res)
     }
 }
 
-bool is_valid(const string& email)
+inline bool is_valid(const string& email)
 {
 
     // Regular expression definition
@@ -233,14 +851,8 @@ bool is_valid(const string& email)
     return regex_match(email, pattern);
 }
 
-std::string random_string(int max_length=32)
+inline std::string random_string(int max_length=32)
 {
-     std::string str("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
-
-     std::random_device rd;
-     std::mt19937 generator(rd());
-
-     std::shuffle(str.begin(), str.end(), generator);
-
-     return str.substr(0, max_length);    // assumes 32 < number of characters in str
+     // characters are drawn independently, see nckd::random_alnum
+     return nckd::random_alnum(static_cast<std::size_t>(max_length));
 }
@@ -0,0 +1,39 @@
+#include <gtest/gtest.h>
+#include "../src/utils.hpp"
+#include <string>
+
+namespace
+{
+httplib::Request login_request()
+{
+    httplib::Request req;
+    req.method = "POST";
+    req.path = "/login/";
+    req.headers.emplace("Authorization", "secret-token");
+    req.headers.emplace("User-Agent", "curl");
+    req.body = "{\"email\": \"a@b.cd\", \"password\": \"hunter22\"}";
+    return req;
+}
+}  // namespace
+
+TEST(NckdAccessLogTest, DumpLeavesOutBodiesAndCredentials)
+{
+    auto req = login_request();
+    httplib::Response res;
+    res.status = 200;
+    res.body = "{\"code\":\"0\", \"data\": {\"token\": \"fresh-token\"}}";
+
+    auto dump = log(req, res, false);
+    EXPECT_EQ(dump.find("hunter22"), std::string::npos);
+    EXPECT_EQ(dump.find("fresh-token"), std::string::npos);
+    EXPECT_EQ(dump.find("secret-token"), std::string::npos);
+    EXPECT_NE(dump.find("Authorization: <redacted>"), std::string::npos);
+    EXPECT_NE(dump.find("User-Agent: curl"), std::string::npos);
+    EXPECT_NE(dump.find("<" + std::to_string(req.body.size()) + "B>"),
+              std::string::npos);
+
+    // bodies on request, the header stays masked
+    dump = log(req, res, true);
+    EXPECT_NE(dump.find("hunter22"), std::string::npos);
+    EXPECT_EQ(dump.find("secret-token"), std::string::npos);
+}
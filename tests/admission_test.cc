@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include "../src/admission.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace
+{
+constexpr std::uint64_t SECOND = 1000000000ull;
+}  // namespace
+
+TEST(NckdAdmissionTest, BurstThenRate)
+{
+    // 2 per second, bursts of 3
+    nckd::RateLimiter limiter(2, 3, 64);
+    std::uint64_t now = 100 * SECOND;
+    EXPECT_TRUE(limiter.allow("10.0.0.1", now));
+    EXPECT_TRUE(limiter.allow("10.0.0.1", now));
+    EXPECT_TRUE(limiter.allow("10.0.0.1", now));
+    EXPECT_FALSE(limiter.allow("10.0.0.1", now));
+    EXPECT_TRUE(limiter.blocked("10.0.0.1", now));
+
+    // refills one admission every 500ms
+    EXPECT_TRUE(limiter.allow("10.0.0.1", now + SECOND / 2));
+    EXPECT_FALSE(limiter.allow("10.0.0.1", now + SECOND / 2));
+    EXPECT_FALSE(limiter.blocked("10.0.0.1", now + 2 * SECOND));
+}
+
+TEST(NckdAdmissionTest, KeysAreIndependent)
+{
+    nckd::RateLimiter limiter(1, 1, 1 << 12);
+    std::uint64_t now = SECOND;
+    EXPECT_TRUE(limiter.allow("alice@example.com", now));
+    EXPECT_FALSE(limiter.allow("alice@example.com", now));
+    EXPECT_TRUE(limiter.allow("bob@example.com", now));
+}
+
+TEST(NckdAdmissionTest, DisabledAllowsEverything)
+{
+    nckd::RateLimiter limiter(0, 0);
+    for (int k = 0; k < 100; ++k)
+    {
+        EXPECT_TRUE(limiter.allow("10.0.0.1"));
+    }
+    EXPECT_FALSE(limiter.blocked("10.0.0.1"));
+}
+
+TEST(NckdAdmissionTest, ConcurrentAllowNeverOvershoots)
+{
+    // a burst of 1000 and a rate too slow to refill during the test
+    nckd::RateLimiter limiter(0.001, 1000, 16);
+    std::uint64_t now = SECOND;
+    std::atomic<int> admitted{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&] {
+            for (int k = 0; k < 500; ++k)
+            {
+                admitted += limiter.allow("10.0.0.1", now);
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    EXPECT_EQ(admitted, 1000);
+}
+
+TEST(NckdAdmissionTest, NegativeCacheExpires)
+{
+    nckd::NegativeCache cache(256, std::chrono::seconds(60));
+    std::uint64_t now = SECOND;
+    EXPECT_FALSE(cache.contains("bad-token", now));
+    cache.insert("bad-token", now);
+    EXPECT_TRUE(cache.contains("bad-token", now + SECOND));
+    EXPECT_FALSE(cache.contains("other-token", now + SECOND));
+    EXPECT_FALSE(cache.contains("bad-token", now + 61 * SECOND));
+
+    nckd::NegativeCache disabled(0, std::chrono::seconds(60));
+    disabled.insert("bad-token", now);
+    EXPECT_FALSE(disabled.contains("bad-token", now));
+}
+
+TEST(NckdAdmissionTest, ClientAddressBehindTrustedProxies)
+{
+    std::vector<std::string> trusted = {"10.0.0.1", "10.0.0.2"};
+    // direct clients are keyed on their own address, whatever they claim
+    EXPECT_EQ(nckd::client_address("1.2.3.4", "5.6.7.8", trusted), "1.2.3.4");
+    // the rightmost hop a trusted proxy did not add
+    EXPECT_EQ(nckd::client_address("10.0.0.1", "5.6.7.8", trusted), "5.6.7.8");
+    EXPECT_EQ(nckd::client_address(
+                  "10.0.0.1", "9.9.9.9, 5.6.7.8 , 10.0.0.2", trusted),
+              "5.6.7.8");
+    // a trusted proxy that did not forward the client
+    EXPECT_EQ(nckd::client_address("10.0.0.1", "", trusted), "");
+    EXPECT_EQ(nckd::client_address("10.0.0.1", " , 10.0.0.2", trusted), "");
+    EXPECT_EQ(nckd::client_address("10.0.0.1", "5.6.7.8", {}), "10.0.0.1");
+}
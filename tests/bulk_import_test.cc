@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include "../src/bulk_import.hpp"
+#include <sstream>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace
+{
+/* Needs scripts/schema.sql loaded, as scripts/pg_local.sh start does. */
+const char *DB_URL =
+    "user=postgres dbname=postgres password=postgres host=127.0.0.1 "
+    "port=5432";
+
+/* Runs `sql` with `email` as $1 on a connection of its own. */
+void exec(const char *sql, const std::string &email)
+{
+    PGconn *admin = PQconnectdb(DB_URL);
+    ASSERT_EQ(PQstatus(admin), CONNECTION_OK);
+    const char *values[] = {email.c_str()};
+    PGresult *res =
+        PQexecParams(admin, sql, 1, nullptr, values, nullptr, nullptr, 0);
+    EXPECT_EQ(PQresultStatus(res), PGRES_COMMAND_OK)
+        << PQresultErrorMessage(res);
+    PQclear(res);
+    PQfinish(admin);
+}
+
+/* The reason of every report line, in order. */
+std::vector<std::string> reasons(const std::string &report)
+{
+    std::vector<std::string> out;
+    std::istringstream in(report);
+    for (std::string line; std::getline(in, line);)
+    {
+        out.push_back(nlohmann::json::parse(line)["reason"]);
+    }
+    return out;
+}
+}  // namespace
+
+TEST(NckdBulkImportTest, AppendFieldEscapesCopySpecials)
+{
+    std::string out = "x";
+    nckd::BulkImporter::append_field(out, "a\\b\tc\nd\re");
+    EXPECT_EQ(out, "xa\\\\b\\tc\\nd\\re");
+
+    out.clear();
+    nckd::BulkImporter::append_field(out, "$argon2id$v=19$m=8,t=1,p=1$s$h");
+    EXPECT_EQ(out, "$argon2id$v=19$m=8,t=1,p=1$s$h");
+}
+
+TEST(NckdBulkImportTest, ReportsRejectedLinesAndLoadsTheRest)
+{
+    const std::string domain = "@bulkimport.example";
+    exec("DELETE FROM users WHERE email LIKE '%' || $1", domain);
+    exec("INSERT INTO users (email, password) VALUES ($1, 'x')",
+         "taken" + domain);
+
+    cpool::PGPool pool(DB_URL, {1, 1});
+    auto connection = pool.acquire(std::chrono::seconds(5));
+    ASSERT_TRUE(connection);
+    /* cheapest Argon2 costs, the import is what is under test */
+    nckd::Argon2Params params;
+    params.t_cost = 1;
+    params.m_cost = 8;
+    nckd::HashPool hash_pool(2, 8, 1 << 20, params);
+    std::ostringstream report;
+    nckd::BulkImporter importer(*connection, hash_pool, report, 3);
+
+    std::istringstream input(
+        R"({"email": "one@bulkimport.example", "password": "secret1"})"
+        "\n"
+        R"({"email": "one@bulkimport.example", "password": "secret2"})"
+        "\n"
+        "not json\n"
+        R"({"email": "no-at-sign", "password": "secret3"})"
+        "\n"
+        R"({"email": "short@bulkimport.example", "password": "abc"})"
+        "\n"
+        R"({"email": "taken@bulkimport.example", "password": "secret"})"
+        "\n\n"
+        R"({"email": "two@bulkimport.example", "password": "secret4"})"
+        "\n");
+    auto stats = importer.run(input);
+
+    EXPECT_EQ(stats.imported, 2);
+    EXPECT_EQ(stats.duplicates, 2);
+    EXPECT_EQ(stats.invalid, 3);
+    EXPECT_EQ(stats.failed, 0);
+    EXPECT_EQ(reasons(report.str()),
+              (std::vector<std::string>{"duplicate in input",
+                                        "malformed",
+                                        "invalid email",
+                                        "password too short",
+                                        "already registered"}));
+
+    PGconn *conn = connection->acquire();
+    auto param = "%" + domain;
+    const char *values[] = {param.c_str()};
+    nckd::PGResultPtr res(PQexecParams(
+        conn,
+        "SELECT count(*) FROM users WHERE email LIKE $1 "
+        "AND password LIKE '$argon2id$%'",
+        1,
+        nullptr,
+        values,
+        nullptr,
+        nullptr,
+        0));
+    ASSERT_EQ(PQresultStatus(res.get()), PGRES_TUPLES_OK);
+    EXPECT_STREQ(PQgetvalue(res.get(), 0, 0), "2");
+    exec("DELETE FROM users WHERE email LIKE '%' || $1", domain);
+}
@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+#include "../src/cache_snapshot.hpp"
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+namespace
+{
+std::string snapshot_path()
+{
+    return "/tmp/nckd_snapshot_test_" + std::to_string(getpid());
+}
+}  // namespace
+
+TEST(NckdCacheSnapshotTest, RoundTrip)
+{
+    auto path = snapshot_path();
+    nckd::TokenCache before(64, std::chrono::seconds(60), 4);
+    before.put("token-a", {"user", "42"}, before.epoch("token-a"));
+    before.put("token-b", {"admin", "7"}, before.epoch("token-b"));
+    ASSERT_TRUE(nckd::save_snapshot(before, path));
+
+    nckd::TokenCache after(64, std::chrono::seconds(60), 4);
+    EXPECT_EQ(nckd::load_snapshot(after, path), 2u);
+    auto hit = after.get("token-b");
+    ASSERT_TRUE(hit.has_value());
+    EXPECT_EQ(hit->role, "admin");
+    EXPECT_EQ(hit->uid, "7");
+    std::remove(path.c_str());
+}
+
+TEST(NckdCacheSnapshotTest, SkipsExpiredEntries)
+{
+    auto path = snapshot_path();
+    nckd::TokenCache before(64, std::chrono::seconds(60), 1);
+    auto soon = nckd::TokenCache::clock::now() + std::chrono::milliseconds(20);
+    before.put_until("token-a", {"user", "42"}, soon, before.epoch("token-a"));
+    before.put("token-b", {"user", "43"}, before.epoch("token-b"));
+    ASSERT_TRUE(nckd::save_snapshot(before, path));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    nckd::TokenCache after(64, std::chrono::seconds(60), 1);
+    EXPECT_EQ(nckd::load_snapshot(after, path), 1u);
+    EXPECT_FALSE(after.get("token-a").has_value());
+    EXPECT_TRUE(after.get("token-b").has_value());
+    std::remove(path.c_str());
+}
+
+TEST(NckdCacheSnapshotTest, RejectsCorruptFiles)
+{
+    auto path = snapshot_path();
+    nckd::TokenCache cache(64, std::chrono::seconds(60), 1);
+    EXPECT_EQ(nckd::load_snapshot(cache, path), 0u);
+
+    cache.put("token-a", {"user", "42"}, cache.epoch("token-a"));
+    ASSERT_TRUE(nckd::save_snapshot(cache, path));
+    {
+        // flip the last byte of the payload
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekg(-1, std::ios::end);
+        char c = f.get() ^ 1;
+        f.seekp(-1, std::ios::end);
+        f.put(c);
+    }
+    nckd::TokenCache after(64, std::chrono::seconds(60), 1);
+    EXPECT_EQ(nckd::load_snapshot(after, path), 0u);
+    EXPECT_EQ(after.size(), 0u);
+    std::remove(path.c_str());
+}
+
+TEST(NckdCacheSnapshotTest, RevalidationDropsStaleTokens)
+{
+    auto path = snapshot_path();
+    nckd::TokenCache before(64, std::chrono::seconds(60), 4);
+    before.put("token-a", {"user", "42"}, before.epoch("token-a"));
+    before.put("token-b", {"user", "43"}, before.epoch("token-b"));
+    before.put("token-c", {"user", "44"}, before.epoch("token-c"));
+    ASSERT_TRUE(nckd::save_snapshot(before, path));
+
+    nckd::TokenCache after(64, std::chrono::seconds(60), 4);
+    std::vector<std::string> restored;
+    EXPECT_EQ(nckd::load_snapshot(after, path, &restored), 3u);
+    std::remove(path.c_str());
+    ASSERT_EQ(restored.size(), 3u);
+
+    // token-b was rotated away while down, token-c's user was promoted
+    std::size_t batches = 0;
+    auto kept = nckd::revalidate_snapshot(
+        after,
+        restored,
+        [&](const std::vector<std::string_view> &batch,
+            std::unordered_map<std::string, nckd::AuthEntry> &live) {
+            ++batches;
+            for (auto token : batch)
+            {
+                if (token == "token-a")
+                {
+                    live.emplace(token, nckd::AuthEntry{"user", "42"});
+                }
+                if (token == "token-c")
+                {
+                    live.emplace(token, nckd::AuthEntry{"admin", "44"});
+                }
+            }
+            return true;
+        },
+        2);
+    EXPECT_EQ(kept, 1u);
+    EXPECT_EQ(batches, 2u);
+    EXPECT_TRUE(after.get("token-a").has_value());
+    EXPECT_FALSE(after.get("token-b").has_value());
+    EXPECT_FALSE(after.get("token-c").has_value());
+}
+
+TEST(NckdCacheSnapshotTest, RevalidationFailureDropsEverything)
+{
+    nckd::TokenCache cache(64, std::chrono::seconds(60), 4);
+    cache.put("token-a", {"user", "42"}, cache.epoch("token-a"));
+    std::vector<std::string> restored = {"token-a"};
+    auto kept = nckd::revalidate_snapshot(
+        cache,
+        restored,
+        [](const std::vector<std::string_view> &,
+           std::unordered_map<std::string, nckd::AuthEntry> &) {
+            return false;
+        });
+    EXPECT_EQ(kept, 0u);
+    EXPECT_FALSE(cache.get("token-a").has_value());
+}
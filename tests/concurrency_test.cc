@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+#include "../src/concurrency.hpp"
+#include <vector>
+
+using nckd::ConcurrencyLimiter;
+using nckd::Priority;
+using nckd::Route;
+
+namespace
+{
+ConcurrencyLimiter::Options options(double max_limit)
+{
+    ConcurrencyLimiter::Options o;
+    o.max_limit = max_limit;
+    o.min_limit = 2;
+    return o;
+}
+
+constexpr std::uint64_t MS = 1'000'000;
+}  // namespace
+
+TEST(NckdConcurrencyTest, DisabledAdmitsNothingToTrack)
+{
+    ConcurrencyLimiter limiter(options(0));
+    EXPECT_FALSE(limiter.enabled());
+    EXPECT_FALSE(limiter.try_acquire(Priority::Low, Route::Register));
+    EXPECT_EQ(limiter.active(), 0u);
+}
+
+TEST(NckdConcurrencyTest, LowPriorityIsShedFirst)
+{
+    /* starts at half of max, 10: Low may use 5, High all 10 */
+    ConcurrencyLimiter limiter(options(20));
+    ASSERT_EQ(limiter.limit(), 10);
+    std::vector<ConcurrencyLimiter::Permit> held;
+    for (int k = 0; k < 5; ++k)
+    {
+        held.push_back(limiter.try_acquire(Priority::Low, Route::Register));
+        ASSERT_TRUE(held.back());
+    }
+    EXPECT_FALSE(limiter.try_acquire(Priority::Low, Route::Register));
+    for (int k = 0; k < 5; ++k)
+    {
+        held.push_back(limiter.try_acquire(Priority::High, Route::Webhook));
+        ASSERT_TRUE(held.back());
+    }
+    EXPECT_FALSE(limiter.try_acquire(Priority::High, Route::Webhook));
+    held.pop_back();
+    EXPECT_EQ(limiter.active(), 9u);
+    EXPECT_TRUE(limiter.try_acquire(Priority::High, Route::Webhook));
+}
+
+TEST(NckdConcurrencyTest, GrowsWhileFastShrinksWhenSlow)
+{
+    ConcurrencyLimiter limiter(options(20));
+    std::uint64_t now = 1000 * MS;
+    auto run = [&](std::uint64_t latency, bool failed = false) {
+        auto permit = limiter.try_acquire(Priority::High, Route::Webhook, now);
+        now += latency;
+        permit.complete(failed, now);
+    };
+    run(1 * MS);
+    for (int k = 0; k < 50; ++k)
+    {
+        run(1 * MS);
+    }
+    auto grown = limiter.limit();
+    EXPECT_GT(grown, 10);
+    EXPECT_LE(grown, 20);
+
+    run(50 * MS);
+    EXPECT_DOUBLE_EQ(limiter.limit(), grown * 0.9);
+    /* the same round trip does not back off twice */
+    run(1 * MS, true);
+    EXPECT_DOUBLE_EQ(limiter.limit(), grown * 0.9);
+    run(60 * MS, true);
+    EXPECT_LT(limiter.limit(), grown * 0.9);
+}
+
+TEST(NckdConcurrencyTest, NeverBelowMinimum)
+{
+    ConcurrencyLimiter limiter(options(8));
+    std::uint64_t now = 1000 * MS;
+    for (int k = 0; k < 100; ++k)
+    {
+        auto permit = limiter.try_acquire(Priority::High, Route::Login, now);
+        now += 10 * MS;
+        permit.complete(true, now);
+    }
+    EXPECT_DOUBLE_EQ(limiter.limit(), 2);
+}
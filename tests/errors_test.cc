@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include "../src/errors.hpp"
+#include <string>
+
+TEST(NckdErrorsTest, ResponsesCarryTheirCode)
+{
+    for (std::size_t k = 0;
+         k < static_cast<std::size_t>(nckd::ErrorCode::Count);
+         ++k)
+    {
+        auto code = static_cast<nckd::ErrorCode>(k);
+        const auto &response = nckd::error_response(code);
+        if (code == nckd::ErrorCode::BadToken)
+        {
+            EXPECT_EQ(response.status, 401);
+            EXPECT_TRUE(response.body.empty());
+            continue;
+        }
+        EXPECT_EQ(response.body,
+                  std::string("{\"code\": ") + nckd::error_name(code) + "}");
+    }
+    EXPECT_EQ(nckd::error_response(nckd::ErrorCode::TooManyAttempts).status,
+              429);
+    EXPECT_EQ(nckd::error_response(nckd::ErrorCode::Overloaded).status, 503);
+    EXPECT_EQ(nckd::error_response(nckd::ErrorCode::EmailTaken).status, 200);
+}
+
+TEST(NckdErrorsTest, CountersFollowErrorCodes)
+{
+    auto &counter = nckd::metrics().errors_for("100302");
+    auto before = counter.value();
+    nckd::error_counter(nckd::ErrorCode::WrongPassword).add();
+    EXPECT_EQ(counter.value(), before + 1);
+}
+
+TEST(NckdErrorsTest, ExpectedHoldsValueOrCode)
+{
+    nckd::Expected<std::string> ok = std::string("body");
+    ASSERT_TRUE(ok);
+    EXPECT_EQ(*ok, "body");
+    EXPECT_EQ(ok->size(), 4u);
+
+    nckd::Expected<std::string> failed = nckd::ErrorCode::UnknownUser;
+    ASSERT_FALSE(failed);
+    EXPECT_EQ(failed.error(), nckd::ErrorCode::UnknownUser);
+}
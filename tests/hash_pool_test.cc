@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+#include "../src/hash_pool.hpp"
+#include <future>
+#include <string>
+
+TEST(NckdHashPoolTest, RefusesWorkWhenSaturated)
+{
+    nckd::HashPool pool(1, 1, 1 << 20);
+    std::promise<void> gate;
+    auto opened = gate.get_future().share();
+
+    auto running = pool.try_submit([opened] {
+        opened.wait();
+        return 1;
+    });
+    ASSERT_TRUE(running.has_value());
+    // Wait until the only worker picked up the first job.
+    std::optional<std::future<int>> queued;
+    while (!(queued = pool.try_submit([] { return 2; })))
+    {
+        std::this_thread::yield();
+    }
+    EXPECT_FALSE(pool.try_submit([] { return 3; }).has_value());
+
+    gate.set_value();
+    EXPECT_EQ(running->get(), 1);
+    EXPECT_EQ(queued->get(), 2);
+}
+
+TEST(NckdHashPoolTest, LaneCapCountsRunningJobs)
+{
+    nckd::HashPool pool(2, 8, 1 << 20, {}, 2, 2);
+    std::promise<void> gate;
+    auto opened = gate.get_future().share();
+
+    auto first = pool.try_submit(
+        [opened] {
+            opened.wait();
+            return 1;
+        },
+        0);
+    auto second = pool.try_submit(
+        [opened] {
+            opened.wait();
+            return 2;
+        },
+        0);
+    ASSERT_TRUE(first.has_value() && second.has_value());
+    // Both are taken by workers, the queue is empty but the cap is reached.
+    while (pool.queued() != 0)
+    {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(pool.in_flight(0), 2u);
+    EXPECT_FALSE(pool.try_submit([] { return 3; }, 0).has_value());
+
+    // The other lane and jobs without a lane are not held back by it.
+    auto other = pool.try_submit([] { return 4; }, 1);
+    auto background = pool.try_submit([] { return 5; });
+    ASSERT_TRUE(other.has_value() && background.has_value());
+    EXPECT_EQ(pool.in_flight(0), 2u);
+
+    gate.set_value();
+    EXPECT_EQ(first->get(), 1);
+    EXPECT_EQ(second->get(), 2);
+    EXPECT_EQ(other->get(), 4);
+    EXPECT_EQ(background->get(), 5);
+    while (pool.in_flight(0) != 0)
+    {
+        std::this_thread::yield();
+    }
+    auto third = pool.try_submit([] { return 3; }, 0);
+    ASSERT_TRUE(third.has_value());
+    EXPECT_EQ(third->get(), 3);
+}
+
+TEST(NckdHashPoolTest, MemoryBudgetCapsWorkers)
+{
+    nckd::Argon2Params params;
+    params.m_cost = 1 << 16;
+    nckd::HashPool pool(8, 4, 3 << 16, params);
+    EXPECT_EQ(pool.size(), 3);
+}
+
+TEST(NckdHashPoolTest, HashThenVerify)
+{
+    nckd::Argon2Params params;
+    params.t_cost = 1;
+    params.m_cost = 64;
+    nckd::HashPool pool(2, 4, 1024, params);
+
+    auto hashed = pool.hash("secret-password", "saltsalt");
+    ASSERT_TRUE(hashed.has_value());
+    auto result = hashed->get();
+    ASSERT_EQ(result.code, ARGON2_OK);
+
+    auto good = pool.verify(result.encoded, "secret-password");
+    auto bad = pool.verify(result.encoded, "wrong-password");
+    ASSERT_TRUE(good.has_value() && bad.has_value());
+    EXPECT_EQ(good->get(), ARGON2_OK);
+    EXPECT_NE(bad->get(), ARGON2_OK);
+}
+
+TEST(NckdHashPoolTest, ParsesEncodedParameters)
+{
+    nckd::Argon2Params params;
+    params.t_cost = 1;
+    params.m_cost = 64;
+    params.salt_len = 16;
+    nckd::HashPool pool(1, 1, 1024, params);
+    auto result = pool.compute("secret-password", "0123456789abcdef");
+    ASSERT_EQ(result.code, ARGON2_OK);
+
+    auto parsed = nckd::parse_argon2(result.encoded);
+    ASSERT_TRUE(parsed.has_value());
+    EXPECT_EQ(parsed->t_cost, 1u);
+    EXPECT_EQ(parsed->m_cost, 64u);
+    EXPECT_EQ(parsed->parallelism, 1u);
+    EXPECT_EQ(parsed->salt_len, 16u);
+    EXPECT_FALSE(nckd::needs_rehash(result.encoded, params));
+
+    auto stronger = params;
+    stronger.t_cost = 3;
+    EXPECT_TRUE(nckd::needs_rehash(result.encoded, stronger));
+    auto longer_salt = params;
+    longer_salt.salt_len = 32;
+    EXPECT_TRUE(nckd::needs_rehash(result.encoded, longer_salt));
+
+    EXPECT_FALSE(
+        nckd::parse_argon2("$argon2i$v=19$m=64,t=1,p=1$c2FsdA$aGFzaA"));
+    EXPECT_FALSE(nckd::parse_argon2("plain text"));
+    EXPECT_FALSE(nckd::needs_rehash("plain text", stronger));
+}
+
+TEST(NckdHashPoolTest, CalibrationStaysWithinBudget)
+{
+    nckd::Argon2Params start;
+    start.m_cost = 256;
+    auto params = nckd::calibrate_argon2(std::chrono::milliseconds(5), start);
+    EXPECT_GE(params.t_cost, 1u);
+    EXPECT_LE(params.m_cost, start.m_cost);
+    EXPECT_EQ(params.parallelism, start.parallelism);
+}
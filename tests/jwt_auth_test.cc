@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+#include "../src/jwt_auth.hpp"
+#include <string>
+
+namespace
+{
+const std::vector<nckd::JwtKey> KEYS = {{"k2", "new-secret"},
+                                        {"k1", "old-secret"}};
+}  // namespace
+
+TEST(NckdJwtAuthTest, IssueThenVerify)
+{
+    nckd::JwtAuth auth(KEYS, std::chrono::seconds(60));
+    auto token = auth.issue({"user", "42"});
+    EXPECT_TRUE(nckd::JwtAuth::looks_like_jwt(token));
+
+    auto claims = auth.verify(token);
+    ASSERT_TRUE(claims.has_value());
+    EXPECT_EQ(claims->role, "user");
+    EXPECT_EQ(claims->uid, "42");
+}
+
+TEST(NckdJwtAuthTest, RejectsTamperedAndUnknownKeys)
+{
+    nckd::JwtAuth auth(KEYS, std::chrono::seconds(60));
+    auto token = auth.issue({"user", "42"});
+    token.back() = token.back() == 'A' ? 'B' : 'A';
+    EXPECT_FALSE(auth.verify(token).has_value());
+    EXPECT_FALSE(auth.verify("not.a.jwt").has_value());
+
+    // signed with a key this node does not know
+    nckd::JwtAuth other({{"k3", "other-secret"}}, std::chrono::seconds(60));
+    EXPECT_FALSE(auth.verify(other.issue({"admin", "1"})).has_value());
+}
+
+TEST(NckdJwtAuthTest, OldKeyStillVerifiesAfterRotation)
+{
+    nckd::JwtAuth before({KEYS[1]}, std::chrono::seconds(60));
+    nckd::JwtAuth after(KEYS, std::chrono::seconds(60));
+    EXPECT_TRUE(after.verify(before.issue({"user", "7"})).has_value());
+}
+
+TEST(NckdJwtAuthTest, RejectsExpired)
+{
+    nckd::JwtAuth auth(KEYS, std::chrono::seconds(-60));
+    EXPECT_FALSE(auth.verify(auth.issue({"user", "42"})).has_value());
+}
+
+TEST(NckdJwtAuthTest, RevocationList)
+{
+    nckd::RevocationList list;
+    EXPECT_FALSE(list.revoked("jti-a"));
+    list.revoke("jti-a", std::chrono::seconds(60));
+    EXPECT_TRUE(list.revoked("jti-a"));
+    // already expired, nothing left to revoke
+    list.revoke("jti-b 1", std::chrono::seconds(60));
+    EXPECT_FALSE(list.revoked("jti-b"));
+}
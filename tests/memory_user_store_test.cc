@@ -0,0 +1,213 @@
+#include <gtest/gtest.h>
+#include "../src/memory_user_store.hpp"
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using nckd::MemoryUserStore;
+using nckd::StoreStatus;
+
+namespace
+{
+class NckdMemoryUserStoreTest : public ::testing::Test
+{
+  protected:
+    void SetUp() override
+    {
+        options.path = "/tmp/nckd_user_log_test_" + std::to_string(getpid());
+        options.sync = false;
+        std::remove(options.path.c_str());
+    }
+    void TearDown() override
+    {
+        std::remove(options.path.c_str());
+    }
+
+    MemoryUserStore::Options options;
+};
+}  // namespace
+
+TEST(NckdOpenIndexTest, EraseKeepsProbeRunsReachable)
+{
+    std::vector<std::string> keys;
+    nckd::OpenIndex index(
+        [&](std::uint32_t ref) -> std::string_view { return keys[ref - 1]; });
+    for (int k = 0; k < 1000; ++k)
+    {
+        keys.push_back("key-" + std::to_string(k));
+        index.insert(keys.back(), k + 1);
+    }
+    for (int k = 0; k < 1000; k += 2)
+    {
+        index.erase(keys[k]);
+    }
+    EXPECT_EQ(index.size(), 500u);
+    for (int k = 0; k < 1000; ++k)
+    {
+        EXPECT_EQ(index.find(keys[k]), k % 2 ? k + 1u : 0u) << keys[k];
+    }
+}
+
+TEST_F(NckdMemoryUserStoreTest, RegisterLoginAndLookup)
+{
+    MemoryUserStore store(options);
+    ASSERT_TRUE(store.open());
+    EXPECT_EQ(store.email_exists("a@example.com"), StoreStatus::NotFound);
+    EXPECT_EQ(store.insert_user("a@example.com", "hash-a"), StoreStatus::Ok);
+    EXPECT_EQ(store.insert_user("a@example.com", "hash-b"),
+              StoreStatus::Exists);
+    EXPECT_EQ(store.email_exists("a@example.com"), StoreStatus::Ok);
+
+    nckd::UserRecord user;
+    ASSERT_EQ(store.find_by_email("a@example.com", user), StoreStatus::Ok);
+    EXPECT_EQ(user.password, "hash-a");
+    EXPECT_EQ(user.role, "user");
+    EXPECT_TRUE(user.token.empty());
+
+    ASSERT_EQ(store.set_token(user.id, "token-1", ""), StoreStatus::Ok);
+    ASSERT_EQ(store.set_token(user.id, "token-2", "token-1"),
+              StoreStatus::Ok);
+    nckd::AuthEntry entry;
+    bool replica = true;
+    EXPECT_EQ(store.find_by_token("token-1", entry, replica),
+              StoreStatus::NotFound);
+    ASSERT_EQ(store.find_by_token("token-2", entry, replica), StoreStatus::Ok);
+    EXPECT_FALSE(replica);
+    EXPECT_EQ(entry.uid, user.id);
+    EXPECT_EQ(entry.role, "user");
+
+    EXPECT_EQ(store.update_password(user.id, "hash-c", "stale"),
+              StoreStatus::NotFound);
+    EXPECT_EQ(store.update_password(user.id, "hash-c", "hash-a"),
+              StoreStatus::Ok);
+}
+
+TEST_F(NckdMemoryUserStoreTest, ReplaysAndDropsATornTail)
+{
+    {
+        MemoryUserStore store(options);
+        ASSERT_TRUE(store.open());
+        store.insert_user("a@example.com", "hash-a");
+        store.insert_user("b@example.com", "hash-b");
+        store.set_token("2", "token-b", "");
+    }
+    {
+        /* half a record, as left by a crash in the middle of a write */
+        std::ofstream log(options.path, std::ios::app | std::ios::binary);
+        log.write("\x01\x02\x03\x04\x40\x00\x00\x00\x01", 9);
+    }
+    MemoryUserStore store(options);
+    ASSERT_TRUE(store.open());
+    EXPECT_EQ(store.size(), 2u);
+    nckd::AuthEntry entry;
+    bool replica = true;
+    ASSERT_EQ(store.find_by_token("token-b", entry, replica), StoreStatus::Ok);
+    EXPECT_EQ(entry.uid, "2");
+    /* the torn bytes were cut, new records follow the intact ones */
+    EXPECT_EQ(store.insert_user("c@example.com", "hash-c"), StoreStatus::Ok);
+}
+
+TEST_F(NckdMemoryUserStoreTest, CompactionKeepsOnlyTheCurrentState)
+{
+    {
+        MemoryUserStore store(options);
+        ASSERT_TRUE(store.open());
+        store.insert_user("a@example.com", "hash-a");
+        for (int k = 0; k < 100; ++k)
+        {
+            store.set_token("1", "token-" + std::to_string(k), "");
+        }
+        auto before = store.log_size();
+        ASSERT_TRUE(store.compact());
+        EXPECT_LT(store.log_size(), before / 10);
+        store.set_token("1", "token-last", "");
+    }
+    MemoryUserStore store(options);
+    ASSERT_TRUE(store.open());
+    nckd::AuthEntry entry;
+    bool replica = true;
+    EXPECT_EQ(store.find_by_token("token-99", entry, replica),
+              StoreStatus::NotFound);
+    EXPECT_EQ(store.find_by_token("token-last", entry, replica),
+              StoreStatus::Ok);
+    nckd::UserRecord user;
+    ASSERT_EQ(store.find_by_email("a@example.com", user), StoreStatus::Ok);
+    EXPECT_EQ(user.password, "hash-a");
+}
+
+TEST_F(NckdMemoryUserStoreTest, FailedAppendIsCutFromTheLog)
+{
+    MemoryUserStore store(options);
+    ASSERT_TRUE(store.open());
+    ASSERT_EQ(store.insert_user("a@example.com", "hash-a"), StoreStatus::Ok);
+
+    /* let the next record be written only in part */
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit saved;
+    getrlimit(RLIMIT_FSIZE, &saved);
+    rlimit small = saved;
+    small.rlim_cur = store.log_size() + 10;
+    setrlimit(RLIMIT_FSIZE, &small);
+    auto failed = store.insert_user("b@example.com", "hash-b");
+    setrlimit(RLIMIT_FSIZE, &saved);
+    EXPECT_EQ(failed, StoreStatus::Error);
+    EXPECT_EQ(store.email_exists("b@example.com"), StoreStatus::NotFound);
+
+    ASSERT_EQ(store.insert_user("c@example.com", "hash-c"), StoreStatus::Ok);
+    ASSERT_EQ(store.set_token("2", "token-c", ""), StoreStatus::Ok);
+
+    MemoryUserStore reopened(options);
+    ASSERT_TRUE(reopened.open());
+    EXPECT_EQ(reopened.size(), 2u);
+    nckd::AuthEntry entry;
+    bool replica = true;
+    ASSERT_EQ(reopened.find_by_token("token-c", entry, replica),
+              StoreStatus::Ok);
+    EXPECT_EQ(entry.uid, "2");
+}
+
+TEST_F(NckdMemoryUserStoreTest, ConcurrentSyncedWritesAllLand)
+{
+    options.sync = true;
+    {
+        MemoryUserStore store(options);
+        ASSERT_TRUE(store.open());
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 8; ++t)
+        {
+            writers.emplace_back([&store, t] {
+                auto email = "u" + std::to_string(t) + "@example.com";
+                EXPECT_EQ(store.insert_user(email, "hash"), StoreStatus::Ok);
+                nckd::UserRecord user;
+                ASSERT_EQ(store.find_by_email(email, user), StoreStatus::Ok);
+                for (int k = 0; k < 20; ++k)
+                {
+                    EXPECT_EQ(store.set_token(user.id,
+                                              email + std::to_string(k),
+                                              ""),
+                              StoreStatus::Ok);
+                }
+            });
+        }
+        for (auto &writer : writers)
+        {
+            writer.join();
+        }
+    }
+    MemoryUserStore store(options);
+    ASSERT_TRUE(store.open());
+    EXPECT_EQ(store.size(), 8u);
+    nckd::AuthEntry entry;
+    bool replica = true;
+    for (int t = 0; t < 8; ++t)
+    {
+        auto email = "u" + std::to_string(t) + "@example.com";
+        EXPECT_EQ(store.find_by_token(email + "19", entry, replica),
+                  StoreStatus::Ok);
+    }
+}
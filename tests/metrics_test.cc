@@ -0,0 +1,59 @@
+#include <gtest/gtest.h>
+#include "../src/metrics.hpp"
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(NckdMetricsTest, BucketsCoverTheirUpperBounds)
+{
+    for (std::uint64_t us : {0ull, 1ull, 3ull, 4ull, 7ull, 1000ull, 123456ull})
+    {
+        int bucket = nckd::Histogram::bucket_of(us);
+        EXPECT_LT(us, nckd::Histogram::upper_bound(bucket));
+        if (bucket > 0)
+        {
+            EXPECT_GE(us, nckd::Histogram::upper_bound(bucket - 1));
+        }
+    }
+    EXPECT_EQ(nckd::Histogram::bucket_of(~0ull), nckd::Histogram::BUCKETS - 1);
+}
+
+TEST(NckdMetricsTest, CountersSumAcrossThreads)
+{
+    nckd::Counter counter;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&] {
+            for (int k = 0; k < 1000; ++k)
+            {
+                counter.add();
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    EXPECT_EQ(counter.value(), 4000);
+}
+
+TEST(NckdMetricsTest, RendersExpositionFormat)
+{
+    nckd::Metrics m;
+    m.requests[0].add(3);
+    m.errors_for("100305").add();
+    m.latency[0].observe(std::chrono::microseconds(1500));
+    auto text = nckd::render_metrics(m, {"find_by_token"}, {{"nckd_up", 1}});
+    EXPECT_NE(text.find("nckd_requests_total{route=\"webhook\"} 3\n"),
+              std::string::npos);
+    EXPECT_NE(text.find("nckd_errors_total{code=\"100305\"} 1\n"),
+              std::string::npos);
+    EXPECT_NE(text.find("nckd_request_duration_seconds_bucket{route=\"webhook\""
+                        ",le=\"0.002048\"} 1\n"),
+              std::string::npos);
+    EXPECT_NE(text.find("nckd_request_duration_seconds_count{route=\"webhook\"}"
+                        " 1\n"),
+              std::string::npos);
+    EXPECT_NE(text.find("nckd_up 1\n"), std::string::npos);
+}
@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include "../src/utils.hpp"
+#include <chrono>
 #include <string>
+#include <thread>
 // Demonstrate some basic assertions.
 TEST(AcquiRestPGTest, BasicAssertions)
 {
@@ -24,3 +26,100 @@ TEST(AcquiRestPGTest, BasicAssertions)
     EXPECT_EQ(pool->size_idle(), 3);
     EXPECT_EQ(pool->size(), 4);
 }
+
+namespace
+{
+using namespace std::chrono_literals;
+
+const char *DB_URL =
+    "user=postgres dbname=postgres password=postgres host=127.0.0.1 "
+    "port=5432";
+
+/* Ends the backend `pid` from a connection of its own. */
+void terminate_backend(int pid)
+{
+    PGconn *admin = PQconnectdb(DB_URL);
+    ASSERT_EQ(PQstatus(admin), CONNECTION_OK);
+    auto param = std::to_string(pid);
+    const char *values[] = {param.c_str()};
+    PGresult *res = PQexecParams(admin,
+                                 "SELECT pg_terminate_backend($1::int)",
+                                 1,
+                                 nullptr,
+                                 values,
+                                 nullptr,
+                                 nullptr,
+                                 0);
+    EXPECT_EQ(PQresultStatus(res), PGRES_TUPLES_OK);
+    PQclear(res);
+    PQfinish(admin);
+}
+}  // namespace
+
+TEST(AcquiRestPGPoolTest, AcquireTimesOutOnExhaustedPool)
+{
+    cpool::PGPool pool(DB_URL, {1, 1, 200ms, 0ms});
+    auto held = pool.acquire();
+    ASSERT_TRUE(held);
+    EXPECT_EQ(pool.size_in_use(), 1);
+
+    auto start = std::chrono::steady_clock::now();
+    auto second = pool.acquire(50ms);
+    EXPECT_FALSE(second);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 50ms);
+
+    held.release();
+    EXPECT_EQ(pool.size_in_use(), 0);
+    EXPECT_TRUE(pool.acquire(50ms));
+}
+
+TEST(AcquiRestPGPoolTest, AcquireWaitsForRelease)
+{
+    cpool::PGPool pool(DB_URL, {1, 1, 200ms, 0ms});
+    auto held = pool.acquire();
+    ASSERT_TRUE(held);
+
+    std::thread releaser([&held] {
+        std::this_thread::sleep_for(20ms);
+        held.release();
+    });
+    auto start = std::chrono::steady_clock::now();
+    auto second = pool.acquire(5s);
+    releaser.join();
+    EXPECT_TRUE(second);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 5s);
+}
+
+TEST(AcquiRestPGPoolTest, ValidatorReplacesBrokenConnection)
+{
+    cpool::PGPool pool(DB_URL, {1, 1, 200ms, 50ms});
+    int old_pid;
+    {
+        auto lease = pool.acquire();
+        ASSERT_TRUE(lease);
+        ASSERT_TRUE(lease->ensure_ready());
+        old_pid = PQbackendPID(lease->acquire());
+    }
+    terminate_backend(old_pid);
+
+    /* the validator probes the idle connection and reconnects it */
+    int new_pid = old_pid;
+    for (auto deadline = std::chrono::steady_clock::now() + 5s;
+         new_pid == old_pid && std::chrono::steady_clock::now() < deadline;
+         std::this_thread::sleep_for(20ms))
+    {
+        auto lease = pool.acquire();
+        if (lease && lease->acquire() != nullptr &&
+            PQstatus(lease->acquire()) == CONNECTION_OK)
+        {
+            new_pid = PQbackendPID(lease->acquire());
+        }
+    }
+    EXPECT_NE(new_pid, old_pid);
+
+    auto lease = pool.acquire();
+    ASSERT_TRUE(lease);
+    PGresult *res = PQexec(lease->acquire(), "SELECT 1");
+    EXPECT_EQ(PQresultStatus(res), PGRES_TUPLES_OK);
+    PQclear(res);
+}
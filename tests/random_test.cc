@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+#include "../src/random.hpp"
+#include <array>
+#include <cctype>
+#include <set>
+#include <string>
+#include <vector>
+
+TEST(NckdRandomTest, AlnumTokens)
+{
+    auto token = nckd::random_alnum(nckd::TOKEN_LENGTH);
+    ASSERT_EQ(token.size(), nckd::TOKEN_LENGTH);
+    for (char c : token)
+    {
+        EXPECT_TRUE(std::isalnum(static_cast<unsigned char>(c))) << c;
+    }
+    EXPECT_NE(token, nckd::random_alnum(nckd::TOKEN_LENGTH));
+}
+
+TEST(NckdRandomTest, CharactersMayRepeat)
+{
+    // the old shuffle based generator could never repeat a character
+    bool repeated = false;
+    for (int k = 0; k < 16 && !repeated; ++k)
+    {
+        auto token = nckd::random_alnum(nckd::TOKEN_LENGTH);
+        repeated = std::set<char>(token.begin(), token.end()).size() <
+                   token.size();
+    }
+    EXPECT_TRUE(repeated);
+}
+
+TEST(NckdRandomTest, FillCrossesRefills)
+{
+    std::vector<unsigned char> bytes(3 * nckd::SecureRandom::BUFFER + 17);
+    nckd::SecureRandom::fill(bytes.data(), bytes.size());
+    std::array<int, 256> seen{};
+    for (auto b : bytes)
+    {
+        ++seen[b];
+    }
+    int distinct = 0;
+    for (int n : seen)
+    {
+        distinct += n > 0;
+    }
+    EXPECT_GT(distinct, 250);
+}
+
+TEST(NckdRandomTest, RoughlyUniform)
+{
+    std::array<int, 128> counts{};
+    const int samples = 62 * 2000;
+    auto s = nckd::random_alnum(samples);
+    for (char c : s)
+    {
+        ++counts[static_cast<unsigned char>(c)];
+    }
+    // expected 2000 per character, sigma about 44
+    for (char c : std::string("09AZaz"))
+    {
+        EXPECT_GT(counts[c], 1700) << c;
+        EXPECT_LT(counts[c], 2300) << c;
+    }
+}
@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+#include "../src/replica.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+using namespace std::chrono_literals;
+
+/* Nothing listens there, so the first check marks every replica down. */
+const char *NOWHERE = "host=127.0.0.1 port=1 connect_timeout=1";
+
+/* Standby started by scripts/pg_local.sh replica, on the port after 5432. */
+const char *REPLICA_URL =
+    "user=postgres dbname=postgres password=postgres host=127.0.0.1 "
+    "port=5433";
+
+nckd::ReplicaRouter::Options offline_options()
+{
+    nckd::ReplicaRouter::Options options;
+    options.pool.min_size = 0;
+    options.pool.max_size = 1;
+    options.pool.validate_interval = 0ms;
+    /* no second check while a test runs */
+    options.check_interval = std::chrono::hours(1);
+    return options;
+}
+}  // namespace
+
+TEST(NckdReplicaRouterTest, WithoutReplicasThePrimaryAnswers)
+{
+    nckd::ReplicaRouter router({}, offline_options());
+    EXPECT_FALSE(router.enabled());
+    EXPECT_EQ(router.pick(), nullptr);
+}
+
+TEST(NckdReplicaRouterTest, PickRoundRobinsOverHealthyReplicas)
+{
+    nckd::ReplicaRouter router({NOWHERE, NOWHERE, NOWHERE},
+                               offline_options());
+    ASSERT_EQ(router.size(), 3);
+    EXPECT_EQ(router.healthy(), 0);
+    EXPECT_EQ(router.pick(), nullptr);
+
+    for (std::size_t k = 0; k < router.size(); ++k)
+    {
+        router.replica(k).healthy = true;
+    }
+    std::vector<nckd::ReplicaRouter::Replica *> picked;
+    for (int k = 0; k < 6; ++k)
+    {
+        picked.push_back(router.pick());
+    }
+    auto *a = &router.replica(0), *b = &router.replica(1),
+         *c = &router.replica(2);
+    /* the pick() above moved the cursor, so compare from a onwards */
+    auto first = std::find(picked.begin(), picked.end(), a);
+    ASSERT_NE(first, picked.end());
+    std::rotate(picked.begin(), first, picked.end());
+    EXPECT_EQ(picked, (std::vector<nckd::ReplicaRouter::Replica *>{
+                          a, b, c, a, b, c}));
+}
+
+TEST(NckdReplicaRouterTest, FailedReplicaIsSkippedUntilItIsBack)
+{
+    nckd::ReplicaRouter router({NOWHERE, NOWHERE}, offline_options());
+    auto &a = router.replica(0), &b = router.replica(1);
+    a.healthy = true;
+    b.healthy = true;
+
+    router.failed(a);
+    EXPECT_EQ(router.healthy(), 1);
+    for (int k = 0; k < 4; ++k)
+    {
+        EXPECT_EQ(router.pick(), &b);
+    }
+    router.failed(b);
+    EXPECT_EQ(router.pick(), nullptr);
+    /* failing again is harmless */
+    router.failed(b);
+    EXPECT_EQ(router.healthy(), 0);
+
+    a.healthy = true;
+    EXPECT_EQ(router.pick(), &a);
+}
+
+TEST(NckdReplicaRouterTest, RoutesToTheStreamingStandby)
+{
+    auto options = offline_options();
+    options.pool.max_size = 2;
+    options.check_interval = 100ms;
+    nckd::ReplicaRouter router({REPLICA_URL}, options);
+    ASSERT_EQ(router.healthy(), 1) << "is scripts/pg_local.sh replica up?";
+    EXPECT_GE(router.replica(0).lag_ms.load(), 0);
+
+    auto *replica = router.pick();
+    ASSERT_NE(replica, nullptr);
+    {
+        auto connection = replica->pool->acquire(5s);
+        ASSERT_TRUE(connection);
+        ASSERT_TRUE(connection->ensure_ready());
+        nckd::PGResultPtr res(
+            PQexec(connection->acquire(), "SELECT pg_is_in_recovery()"));
+        ASSERT_EQ(PQresultStatus(res.get()), PGRES_TUPLES_OK);
+        EXPECT_STREQ(PQgetvalue(res.get(), 0, 0), "t");
+    }
+
+    router.failed(*replica);
+    EXPECT_EQ(router.pick(), nullptr);
+    /* the next passing check brings it back */
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (router.pick() == nullptr &&
+           std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(20ms);
+    }
+    EXPECT_EQ(router.pick(), replica);
+}
@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+#include "../src/request_context.hpp"
+#include "../src/admission.hpp"
+#include <map>
+#include <string>
+
+TEST(NckdRequestContextTest, FindsWellKnownHeadersIgnoringCase)
+{
+    std::multimap<std::string, std::string> headers = {
+        {"Accept", "*/*"},
+        {"AUTHORIZATION", "first"},
+        {"authorization", "second"},
+        {"User-Agent", "hasura"},
+        {"X-Forwarded-Fox", "nope"},
+    };
+    nckd::RequestContext context;
+    context.begin(headers);
+    EXPECT_EQ(context.header(nckd::Header::Authorization), "first");
+    EXPECT_EQ(context.header(nckd::Header::UserAgent), "hasura");
+    EXPECT_TRUE(context.header(nckd::Header::XForwardedFor).empty());
+    EXPECT_TRUE(context.header(nckd::Header::ContentType).empty());
+
+    context.begin(std::multimap<std::string, std::string>{});
+    EXPECT_TRUE(context.header(nckd::Header::Authorization).empty());
+}
+
+TEST(NckdRequestContextTest, JoinsForwardedForLines)
+{
+    /* the client's own line first, then the one its proxy added */
+    std::multimap<std::string, std::string> headers = {
+        {"X-Forwarded-For", "6.6.6.6"},
+        {"X-Forwarded-For", "203.0.113.7"},
+    };
+    nckd::RequestContext context;
+    context.begin(headers);
+    auto forwarded = context.header(nckd::Header::XForwardedFor);
+    EXPECT_EQ(forwarded, "6.6.6.6, 203.0.113.7");
+    EXPECT_EQ(nckd::client_address("10.0.0.2", forwarded, {"10.0.0.2"}),
+              "203.0.113.7");
+}
+
+TEST(NckdRequestContextTest, ArenaIsReusedPerRequest)
+{
+    nckd::RequestContext context;
+    context.begin(std::multimap<std::string, std::string>{});
+    auto first = context.arena.concat({"{\"uid\": \"", "42", "\"}"});
+    EXPECT_EQ(first, "{\"uid\": \"42\"}");
+    auto second = context.arena.concat({"ab", "", "c"});
+    EXPECT_EQ(second, "abc");
+    EXPECT_NE(first.data(), second.data());
+
+    context.begin(std::multimap<std::string, std::string>{});
+    auto again = context.arena.concat({"x"});
+    EXPECT_EQ(again.data(), first.data());
+}
+
+TEST(NckdRequestContextTest, ArenaSpillsToTheHeap)
+{
+    nckd::RequestArena arena;
+    std::string big(nckd::RequestArena::SIZE * 2, 'x');
+    auto out = arena.concat({big, "y"});
+    EXPECT_EQ(out.size(), big.size() + 1);
+    EXPECT_EQ(out.back(), 'y');
+}
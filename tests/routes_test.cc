@@ -0,0 +1,49 @@
+#include <gtest/gtest.h>
+#include "../src/routes.hpp"
+#include <string>
+
+TEST(NckdRoutesTest, FindsEveryEndpoint)
+{
+    for (std::size_t k = 0; k < nckd::ROUTE_TABLE.size(); ++k)
+    {
+        const auto &spec = nckd::ROUTE_TABLE[k];
+        EXPECT_EQ(nckd::ROUTE_TABLE.find(spec.method, spec.path), k);
+    }
+    EXPECT_EQ(nckd::endpoint_route(nckd::ROUTE_TABLE.find("POST", "/login/")),
+              nckd::Route::Login);
+    EXPECT_EQ(nckd::endpoint_route(nckd::ROUTE_TABLE.find("GET", "/metrics")),
+              nckd::Route::Other);
+}
+
+TEST(NckdRoutesTest, MissesNeedMethodAndPath)
+{
+    const auto none = nckd::ROUTE_TABLE.NONE;
+    EXPECT_EQ(nckd::ROUTE_TABLE.find("GET", "/login/"), none);
+    EXPECT_EQ(nckd::ROUTE_TABLE.find("HEAD", "/webhook/"), none);
+    EXPECT_EQ(nckd::ROUTE_TABLE.find("GET", "/webhook"), none);
+    EXPECT_EQ(nckd::ROUTE_TABLE.find("GET", "/webhook/x"), none);
+    EXPECT_EQ(nckd::ROUTE_TABLE.find("GET", ""), none);
+    EXPECT_EQ(nckd::ROUTE_TABLE.find("", "/webhook/"), none);
+    EXPECT_EQ(nckd::endpoint_route(none), nckd::Route::Other);
+}
+
+TEST(NckdRoutesTest, PlacesCollidingPaths)
+{
+    /* many similar paths still get a slot each */
+    static constexpr nckd::RouteSpec specs[] = {
+        {"GET", "/a", "a"},
+        {"GET", "/b", "b"},
+        {"GET", "/c", "c"},
+        {"GET", "/d", "d"},
+        {"POST", "/a", "post_a"},
+        {"POST", "/b", "post_b"},
+        {"GET", "/aa", "aa"},
+        {"GET", "/ab", "ab"},
+    };
+    constexpr nckd::StaticRoutes table(specs);
+    for (std::size_t k = 0; k < table.size(); ++k)
+    {
+        EXPECT_EQ(table.find(specs[k].method, specs[k].path), k);
+    }
+    EXPECT_EQ(table.find("POST", "/c"), table.NONE);
+}
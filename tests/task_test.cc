@@ -0,0 +1,66 @@
+#include <gtest/gtest.h>
+#include "../src/task.hpp"
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace
+{
+nckd::Task<int> answer()
+{
+    co_return 42;
+}
+
+nckd::Task<std::string> nested()
+{
+    int v = co_await answer();
+    co_return std::to_string(v);
+}
+
+nckd::Task<int> failing()
+{
+    throw std::runtime_error("100103");
+    co_return 0;
+}
+
+/* Resumes the awaiting coroutine from another thread, like the engine. */
+struct ResumeOnThread
+{
+    std::thread *thread;
+    bool await_ready()
+    {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        *thread = std::thread([h] { h.resume(); });
+    }
+    void await_resume()
+    {
+    }
+};
+
+nckd::Task<std::thread::id> hop(std::thread *thread)
+{
+    co_await ResumeOnThread{thread};
+    co_return std::this_thread::get_id();
+}
+}  // namespace
+
+TEST(NckdTaskTest, AwaitsNestedTasks)
+{
+    EXPECT_EQ(nckd::sync_wait(nested()), "42");
+}
+
+TEST(NckdTaskTest, RethrowsExceptions)
+{
+    EXPECT_THROW(nckd::sync_wait(failing()), std::runtime_error);
+}
+
+TEST(NckdTaskTest, SyncWaitAcrossThreads)
+{
+    std::thread worker;
+    auto id = nckd::sync_wait(hop(&worker));
+    EXPECT_NE(id, std::this_thread::get_id());
+    worker.join();
+}
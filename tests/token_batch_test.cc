@@ -0,0 +1,161 @@
+#include <gtest/gtest.h>
+#include "../src/token_batch.hpp"
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+TEST(NckdTokenBatchTest, ArrayLiteral)
+{
+    EXPECT_EQ(nckd::pg_array_literal({}), "{}");
+    EXPECT_EQ(nckd::pg_array_literal({"42"}), "{\"42\"}");
+    EXPECT_EQ(nckd::pg_array_literal({"1", "2", "3"}),
+              "{\"1\",\"2\",\"3\"}");
+}
+
+TEST(NckdTokenBatchTest, ArrayLiteralEscapes)
+{
+    EXPECT_EQ(nckd::pg_array_literal({"a\"b", "c\\d", "e,f", "NULL"}),
+              "{\"a\\\"b\",\"c\\\\d\",\"e,f\",\"NULL\"}");
+}
+
+namespace
+{
+using namespace std::chrono_literals;
+
+/* Records what the writer flushes, owning copies of the views. */
+struct Recorder
+{
+    struct Batch
+    {
+        std::map<std::string, std::string> tokens;
+        std::vector<std::string> old_tokens;
+        std::size_t entries;
+    };
+
+    nckd::TokenBatchWriter::Flush flush(bool ok = true)
+    {
+        return [this, ok](const nckd::TokenBatch &batch) {
+            Batch copy{{}, {}, batch.entries};
+            for (std::size_t k = 0; k < batch.ids.size(); ++k)
+            {
+                copy.tokens[std::string(batch.ids[k])] = batch.tokens[k];
+            }
+            copy.old_tokens.assign(batch.old_tokens.begin(),
+                                   batch.old_tokens.end());
+            std::lock_guard lock(mutex);
+            batches.push_back(std::move(copy));
+            return ok;
+        };
+    }
+
+    std::vector<Batch> taken()
+    {
+        std::lock_guard lock(mutex);
+        return batches;
+    }
+
+    std::mutex mutex;
+    std::vector<Batch> batches;
+};
+
+bool ready(std::future<bool> &done, std::chrono::milliseconds timeout)
+{
+    return done.wait_for(timeout) == std::future_status::ready;
+}
+}  // namespace
+
+TEST(NckdTokenBatchTest, FlushesWhenWindowCloses)
+{
+    Recorder recorder;
+    nckd::TokenBatchWriter writer(recorder.flush(), {200ms, 128, 16});
+
+    auto start = std::chrono::steady_clock::now();
+    auto a = writer.submit("1", "a", "");
+    auto b = writer.submit("2", "b", "");
+    ASSERT_TRUE(a && b);
+    ASSERT_TRUE(ready(*a, 5s));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 200ms);
+    EXPECT_TRUE(a->get());
+    EXPECT_TRUE(b->get());
+
+    auto batches = recorder.taken();
+    ASSERT_EQ(batches.size(), 1);
+    EXPECT_EQ(batches[0].entries, 2);
+    EXPECT_EQ(batches[0].tokens.size(), 2);
+}
+
+TEST(NckdTokenBatchTest, FlushesAtMaxBatch)
+{
+    Recorder recorder;
+    /* a window that would outlast the test */
+    nckd::TokenBatchWriter writer(recorder.flush(), {1h, 2, 16});
+
+    auto a = writer.submit("1", "a", "");
+    auto b = writer.submit("2", "b", "");
+    ASSERT_TRUE(a && b);
+    ASSERT_TRUE(ready(*a, 5s));
+    ASSERT_TRUE(ready(*b, 5s));
+    EXPECT_TRUE(a->get());
+    EXPECT_TRUE(b->get());
+
+    auto batches = recorder.taken();
+    ASSERT_EQ(batches.size(), 1);
+    EXPECT_EQ(batches[0].entries, 2);
+    EXPECT_EQ(writer.queued(), 0);
+}
+
+TEST(NckdTokenBatchTest, LastTokenOfAUserWins)
+{
+    Recorder recorder;
+    nckd::TokenBatchWriter writer(recorder.flush(), {1h, 3, 16});
+
+    auto first = writer.submit("1", "a", "old");
+    auto other = writer.submit("2", "b", "");
+    auto second = writer.submit("1", "c", "a");
+    ASSERT_TRUE(first && other && second);
+    ASSERT_TRUE(ready(*second, 5s));
+    EXPECT_TRUE(first->get());
+    EXPECT_TRUE(other->get());
+    EXPECT_TRUE(second->get());
+
+    auto batches = recorder.taken();
+    ASSERT_EQ(batches.size(), 1);
+    EXPECT_EQ(batches[0].entries, 3);
+    std::map<std::string, std::string> expected = {{"1", "c"}, {"2", "b"}};
+    EXPECT_EQ(batches[0].tokens, expected);
+    EXPECT_EQ(batches[0].old_tokens, (std::vector<std::string>{"old", "a"}));
+}
+
+TEST(NckdTokenBatchTest, FailedFlushFailsEveryWaiter)
+{
+    Recorder recorder;
+    nckd::TokenBatchWriter writer(recorder.flush(false), {1h, 3, 16});
+
+    std::vector<std::future<bool>> waiters;
+    for (const char *uid : {"1", "2", "1"})
+    {
+        auto done = writer.submit(uid, "t", "");
+        ASSERT_TRUE(done);
+        waiters.push_back(std::move(*done));
+    }
+    for (auto &done : waiters)
+    {
+        ASSERT_TRUE(ready(done, 5s));
+        EXPECT_FALSE(done.get());
+    }
+    EXPECT_EQ(recorder.taken().size(), 1);
+}
+
+TEST(NckdTokenBatchTest, RefusesWhenQueueIsFull)
+{
+    Recorder recorder;
+    nckd::TokenBatchWriter writer(recorder.flush(), {1h, 128, 2});
+
+    auto a = writer.submit("1", "a", "");
+    auto b = writer.submit("2", "b", "");
+    EXPECT_TRUE(a && b);
+    EXPECT_FALSE(writer.submit("3", "c", ""));
+}
@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+#include "../src/token_cache.hpp"
+#include <string>
+#include <thread>
+
+TEST(NckdTokenCacheTest, PutGetErase)
+{
+    nckd::TokenCache cache(64, std::chrono::seconds(60), 4);
+    EXPECT_FALSE(cache.get("token-a").has_value());
+
+    EXPECT_TRUE(cache.put("token-a", {"user", "42"}, cache.epoch("token-a")));
+    auto hit = cache.get("token-a");
+    ASSERT_TRUE(hit.has_value());
+    EXPECT_EQ(hit->role, "user");
+    EXPECT_EQ(hit->uid, "42");
+
+    EXPECT_TRUE(cache.erase("token-a"));
+    EXPECT_FALSE(cache.get("token-a").has_value());
+    EXPECT_FALSE(cache.erase("token-a"));
+}
+
+TEST(NckdTokenCacheTest, EraseFencesInFlightLookup)
+{
+    nckd::TokenCache cache(64, std::chrono::seconds(60), 1);
+    auto epoch = cache.epoch("token-a");
+    // /login/ rotates the token while /webhook/ is still querying.
+    cache.erase("token-a");
+    EXPECT_FALSE(cache.put("token-a", {"user", "42"}, epoch));
+    EXPECT_FALSE(cache.get("token-a").has_value());
+}
+
+TEST(NckdTokenCacheTest, EvictsLeastRecentlyUsed)
+{
+    nckd::TokenCache cache(2, std::chrono::seconds(60), 1);
+    cache.put("a", {"user", "1"}, cache.epoch("a"));
+    cache.put("b", {"user", "2"}, cache.epoch("b"));
+    EXPECT_TRUE(cache.get("a").has_value());
+    cache.put("c", {"user", "3"}, cache.epoch("c"));
+    EXPECT_EQ(cache.size(), 2);
+    EXPECT_TRUE(cache.get("a").has_value());
+    EXPECT_FALSE(cache.get("b").has_value());
+    EXPECT_TRUE(cache.get("c").has_value());
+}
+
+TEST(NckdTokenCacheTest, EntriesExpire)
+{
+    nckd::TokenCache cache(16, std::chrono::milliseconds(20), 1);
+    cache.put("a", {"user", "1"}, cache.epoch("a"));
+    EXPECT_TRUE(cache.get("a").has_value());
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    EXPECT_FALSE(cache.get("a").has_value());
+    EXPECT_EQ(cache.size(), 0);
+}
+
+TEST(NckdTokenCacheTest, DisabledCacheStoresNothing)
+{
+    nckd::TokenCache cache(0, std::chrono::seconds(60));
+    EXPECT_FALSE(cache.enabled());
+    EXPECT_FALSE(cache.put("a", {"user", "1"}, cache.epoch("a")));
+    EXPECT_FALSE(cache.get("a").has_value());
+}
@@ -0,0 +1,73 @@
+#include <gtest/gtest.h>
+#include "../src/trace.hpp"
+#include <string>
+#include <thread>
+
+namespace
+{
+std::size_t occurrences(const std::string &text, const std::string &what)
+{
+    std::size_t n = 0;
+    for (auto pos = text.find(what); pos != std::string::npos;
+         pos = text.find(what, pos + 1))
+    {
+        ++n;
+    }
+    return n;
+}
+}  // namespace
+
+TEST(NckdTraceTest, UntracedRequestsRecordNothing)
+{
+    nckd::Tracer tracer;
+    tracer.configure({});
+    EXPECT_FALSE(tracer.enabled());
+    tracer.begin_request();
+    EXPECT_EQ(nckd::trace_request, 0u);
+    {
+        nckd::TraceSpan span("ignored");
+    }
+    tracer.end_request("webhook");
+    EXPECT_EQ(occurrences(tracer.dump(), "ignored"), 0u);
+}
+
+TEST(NckdTraceTest, SampledRequestRecordsSpansAndItself)
+{
+    nckd::Tracer tracer;
+    nckd::Tracer::Options options;
+    options.sample_rate = 1.0;
+    tracer.configure(options);
+    tracer.begin_request();
+    auto request = nckd::trace_request;
+    ASSERT_NE(request, 0u);
+    tracer.record({"phase", 10, 20, request});
+    tracer.end_request("login");
+    EXPECT_EQ(nckd::trace_request, 0u);
+
+    auto json = tracer.dump(request);
+    EXPECT_EQ(json.rfind("{\"traceEvents\":[", 0), 0u);
+    EXPECT_EQ(occurrences(json, "\"name\":\"phase\""), 1u);
+    EXPECT_EQ(occurrences(json, "\"name\":\"login\""), 1u);
+    EXPECT_EQ(occurrences(json, "\"ph\":\"X\""), 2u);
+}
+
+TEST(NckdTraceTest, AdoptedSpansKeepTheirRequest)
+{
+    nckd::Tracer tracer;
+    nckd::Tracer::Options options;
+    options.sample_rate = 1.0;
+    tracer.configure(options);
+    tracer.begin_request();
+    auto request = nckd::trace_request;
+    std::thread helper([&, request] {
+        nckd::TraceAdopt adopt(request);
+        tracer.record({"helper", 1, 2, nckd::trace_request});
+    });
+    helper.join();
+    tracer.record({"other", 1, 2, request + 1});
+    tracer.end_request("register");
+    auto json = tracer.dump(request);
+    EXPECT_EQ(occurrences(json, "\"name\":\"helper\""), 1u);
+    EXPECT_EQ(occurrences(json, "\"name\":\"other\""), 0u);
+    EXPECT_EQ(occurrences(tracer.dump(), "\"name\":\"other\""), 1u);
+}
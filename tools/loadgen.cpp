@@ -0,0 +1,414 @@
+/*
+ * Load generator for the auth server.
+ *
+ * Setup registers and logs in a set of users over HTTP so the run has real
+ * tokens to send. The run then drives /webhook/, /login/ and /register/
+ * from `--concurrency` keep-alive connections with the requested mix for
+ * `--duration` seconds and prints throughput and latency percentiles per
+ * route.
+ *
+ * Every request comes from this one address and the login mix signs in as
+ * the same few users over and over, so the server's per-client limits
+ * would turn most of the load away. Start it with
+ *
+ *   Nckd ... --rate-limit-ip 0 --rate-limit-email 0
+ *
+ * as scripts/pg_local.sh suggests; calls answered 429 are counted and
+ * reported.
+ *
+ *   NckdLoadgen --mix 90:9:1 --concurrency 64 --hit-ratio 0.95
+ */
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <httplib.h>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using json = nlohmann::json;
+namespace po = boost::program_options;
+
+namespace
+{
+enum Op
+{
+    OP_WEBHOOK,
+    OP_LOGIN,
+    OP_REGISTER,
+    OP_COUNT,
+};
+
+constexpr const char *OP_NAMES[] = {"webhook", "login", "register"};
+
+constexpr std::size_t TOKEN_LENGTH = 48;
+
+constexpr const char *NO_LIMITS = "--rate-limit-ip 0 --rate-limit-email 0";
+
+/* calls the server turned away with 429 */
+std::atomic<std::uint64_t> rate_limited{0};
+
+struct Config
+{
+    std::string host;
+    int port;
+    int concurrency;
+    int duration;
+    int users;
+    int login_users;
+    double hit_ratio;
+    std::string password;
+    unsigned weights[OP_COUNT];
+    std::string prefix;
+};
+
+struct WorkerStats
+{
+    std::vector<std::uint32_t> latency_us[OP_COUNT];
+    std::uint64_t errors[OP_COUNT] = {};
+};
+
+std::string email_of(const Config &cfg, const char *kind, long n)
+{
+    return cfg.prefix + kind + std::to_string(n) + "@loadgen.example.com";
+}
+
+std::string body_of(const std::string &email, const std::string &password)
+{
+    return json{{"email", email}, {"password", password}}.dump();
+}
+
+/* The handlers answer 200 with {"code": 1003xx} for business errors. */
+bool accepted(const httplib::Result &res)
+{
+    if (res && res->status == 429)
+    {
+        rate_limited.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!res || res->status != 200)
+    {
+        return false;
+    }
+    auto body = json::parse(res->body, nullptr, false);
+    if (body.is_discarded() || !body.contains("code"))
+    {
+        return false;
+    }
+    const auto &code = body["code"];
+    return code.is_string() ? code == "0" : code == 0;
+}
+
+bool register_user(httplib::Client &cli,
+                   const std::string &email,
+                   const std::string &password)
+{
+    auto res = cli.Post(
+        "/register/", body_of(email, password), "application/json");
+    /* 100303: left over from an earlier run with the same prefix */
+    return accepted(res) ||
+           (res && res->body.find("100303") != std::string::npos);
+}
+
+std::string login_user(httplib::Client &cli,
+                       const std::string &email,
+                       const std::string &password)
+{
+    auto res =
+        cli.Post("/login/", body_of(email, password), "application/json");
+    if (!accepted(res))
+    {
+        return {};
+    }
+    auto body = json::parse(res->body);
+    return body["data"]["token"];
+}
+
+std::string random_token(std::mt19937_64 &rng)
+{
+    static constexpr char alphabet[] =
+        "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    std::uniform_int_distribution<int> pick(0, sizeof(alphabet) - 2);
+    std::string token(TOKEN_LENGTH, '0');
+    for (auto &c : token)
+    {
+        c = alphabet[pick(rng)];
+    }
+    return token;
+}
+
+/*
+ * Webhook users only ever log in during setup, so their tokens stay valid
+ * for the whole run; the login mix uses its own accounts.
+ */
+bool setup(const Config &cfg, std::vector<std::string> &tokens)
+{
+    httplib::Client cli(cfg.host, cfg.port);
+    cli.set_keep_alive(true);
+    auto failed = [](const char *what, const std::string &email) {
+        std::cerr << what << " failed for " << email << "\n";
+        if (rate_limited.load() > 0)
+        {
+            std::cerr << "rate limited, start the server with " << NO_LIMITS
+                      << "\n";
+        }
+        return false;
+    };
+    for (int k = 0; k < cfg.users; ++k)
+    {
+        auto email = email_of(cfg, "hook", k);
+        if (!register_user(cli, email, cfg.password))
+        {
+            return failed("register", email);
+        }
+        auto token = login_user(cli, email, cfg.password);
+        if (token.size() != TOKEN_LENGTH)
+        {
+            return failed("login", email);
+        }
+        tokens.push_back(std::move(token));
+    }
+    for (int k = 0; k < cfg.login_users; ++k)
+    {
+        auto email = email_of(cfg, "login", k);
+        if (!register_user(cli, email, cfg.password))
+        {
+            return failed("register", email);
+        }
+    }
+    return true;
+}
+
+void worker(const Config &cfg,
+            int id,
+            const std::vector<std::string> &tokens,
+            const std::atomic<bool> &running,
+            WorkerStats &stats)
+{
+    httplib::Client cli(cfg.host, cfg.port);
+    cli.set_keep_alive(true);
+    std::mt19937_64 rng(std::random_device{}() + id);
+    std::discrete_distribution<int> pick_op(std::begin(cfg.weights),
+                                            std::end(cfg.weights));
+    std::bernoulli_distribution hit(cfg.hit_ratio);
+    std::uniform_int_distribution<std::size_t> pick_token(
+        0, tokens.empty() ? 0 : tokens.size() - 1);
+    std::uniform_int_distribution<int> pick_login(
+        0, std::max(cfg.login_users - 1, 0));
+    long registered = 0;
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        int op = pick_op(rng);
+        auto start = std::chrono::steady_clock::now();
+        bool ok = false;
+        switch (op)
+        {
+        case OP_WEBHOOK: {
+            bool valid = !tokens.empty() && hit(rng);
+            auto token = valid ? tokens[pick_token(rng)] : random_token(rng);
+            auto res = cli.Get("/webhook/", {{"authorization", token}});
+            /* an unknown token is expected to be turned away with 401 */
+            ok = res && res->status == (valid ? 200 : 401);
+            if (res && res->status == 429)
+            {
+                rate_limited.fetch_add(1, std::memory_order_relaxed);
+            }
+            break;
+        }
+        case OP_LOGIN: {
+            auto email = email_of(cfg, "login", pick_login(rng));
+            ok = login_user(cli, email, cfg.password).size() == TOKEN_LENGTH;
+            break;
+        }
+        case OP_REGISTER: {
+            auto email = email_of(cfg,
+                                  ("reg" + std::to_string(id) + "x").c_str(),
+                                  registered++);
+            auto res = cli.Post("/register/",
+                                body_of(email, cfg.password),
+                                "application/json");
+            ok = accepted(res);
+            break;
+        }
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+        stats.latency_us[op].push_back(
+            static_cast<std::uint32_t>(elapsed.count()));
+        if (!ok)
+        {
+            ++stats.errors[op];
+        }
+    }
+}
+
+double percentile(const std::vector<std::uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    auto rank = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[rank] / 1000.0;
+}
+
+void report(const std::vector<WorkerStats> &stats, double seconds)
+{
+    std::printf("%-9s %10s %10s %8s %9s %9s %9s %9s %9s\n",
+                "route",
+                "requests",
+                "req/s",
+                "errors",
+                "p50 ms",
+                "p90 ms",
+                "p99 ms",
+                "p99.9 ms",
+                "max ms");
+    std::uint64_t total = 0;
+    for (int op = 0; op < OP_COUNT; ++op)
+    {
+        std::vector<std::uint32_t> all;
+        std::uint64_t errors = 0;
+        for (const auto &s : stats)
+        {
+            all.insert(all.end(),
+                       s.latency_us[op].begin(),
+                       s.latency_us[op].end());
+            errors += s.errors[op];
+        }
+        std::sort(all.begin(), all.end());
+        total += all.size();
+        std::printf("%-9s %10zu %10.0f %8lu %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+                    OP_NAMES[op],
+                    all.size(),
+                    all.size() / seconds,
+                    static_cast<unsigned long>(errors),
+                    percentile(all, 0.50),
+                    percentile(all, 0.90),
+                    percentile(all, 0.99),
+                    percentile(all, 0.999),
+                    all.empty() ? 0.0 : all.back() / 1000.0);
+    }
+    std::printf("total     %10lu %10.0f\n",
+                static_cast<unsigned long>(total),
+                total / seconds);
+    if (auto limited = rate_limited.load(); limited > 0)
+    {
+        std::printf("%lu calls were rate limited, start the server with %s\n",
+                    static_cast<unsigned long>(limited),
+                    NO_LIMITS);
+    }
+}
+
+bool parse_mix(const std::string &mix, unsigned (&weights)[OP_COUNT])
+{
+    unsigned webhook = 0, login = 0, reg = 0;
+    char tail;
+    if (std::sscanf(mix.c_str(), "%u:%u:%u%c", &webhook, &login, &reg, &tail) !=
+            3 ||
+        webhook + login + reg == 0)
+    {
+        return false;
+    }
+    weights[OP_WEBHOOK] = webhook;
+    weights[OP_LOGIN] = login;
+    weights[OP_REGISTER] = reg;
+    return true;
+}
+}  // namespace
+
+int main(int argc, const char *argv[])
+{
+    Config cfg;
+    std::string mix;
+    po::options_description desc("Allowed options");
+    desc.add_options()("help", "produce help message")(
+        "host,h",
+        po::value<std::string>(&cfg.host)->default_value("127.0.0.1"),
+        "Server address.")(
+        "port,p", po::value<int>(&cfg.port)->default_value(8080), "Port.")(
+        "concurrency,c",
+        po::value<int>(&cfg.concurrency)->default_value(32),
+        "Connections, one thread each.")(
+        "duration,d",
+        po::value<int>(&cfg.duration)->default_value(30),
+        "Seconds to run after setup.")(
+        "mix",
+        po::value<std::string>(&mix)->default_value("90:9:1"),
+        "webhook:login:register weights.")(
+        "hit-ratio",
+        po::value<double>(&cfg.hit_ratio)->default_value(0.95),
+        "Share of webhook calls with a valid token.")(
+        "users",
+        po::value<int>(&cfg.users)->default_value(1000),
+        "Users set up to provide webhook tokens.")(
+        "login-users",
+        po::value<int>(&cfg.login_users)->default_value(100),
+        "Users the login mix signs in as.")(
+        "password",
+        po::value<std::string>(&cfg.password)->default_value("loadgen-pw"),
+        "Password of every generated user.")(
+        "prefix",
+        po::value<std::string>(&cfg.prefix)
+            ->default_value("lg" + std::to_string(getpid())),
+        "Prefix of generated emails, reuse it to skip registration.");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        std::cout << desc << "\n";
+        return 0;
+    }
+    if (!parse_mix(mix, cfg.weights) || cfg.concurrency < 1 ||
+        cfg.duration < 1)
+    {
+        std::cerr << desc << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> tokens;
+    auto setup_start = std::chrono::steady_clock::now();
+    if (!setup(cfg, tokens))
+    {
+        return 1;
+    }
+    std::printf("setup: %d users in %.1fs\n",
+                cfg.users + cfg.login_users,
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - setup_start)
+                    .count());
+
+    std::atomic<bool> running{true};
+    std::vector<WorkerStats> stats(cfg.concurrency);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int k = 0; k < cfg.concurrency; ++k)
+    {
+        threads.emplace_back(worker,
+                             std::cref(cfg),
+                             k,
+                             std::cref(tokens),
+                             std::cref(running),
+                             std::ref(stats[k]));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.duration));
+    running = false;
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    report(stats,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+               .count());
+    return 0;
+}